@@ -37,7 +37,7 @@ echo "$ `basename $com` -h" > $fn
 echo >> $fn
 $com 2>> $fn
 
-for sub_com in build query ; do
+for sub_com in build query classify serve merge ; do
 	sub_fn="${fn}_${sub_com}.txt"
 	echo $sub_fn
 	echo "$ `basename $com` $sub_com -h" > $sub_fn
@@ -83,7 +83,7 @@ LIBRARIES = ['bacteria', 'viruses', 'plasmids', 'hmp']
 
 ZENODO_URL = 'https://zenodo.org/record/1054426'
 
-ANALYZE_IN_FMTS = ['sam', 'bam', 'cram', 'uncompressed_bam', 'kraken', 'histo']
+ANALYZE_IN_FMTS = ['sam', 'bam', 'cram', 'uncompressed_bam', 'kraken', 'bin', 'histo']
 ANALYZE_STATS = ['w', 'u', 'wl', 'ul']
 
 FILES_TO_ARCHIVE = [
@@ -599,17 +599,18 @@ def _bwtocc2sa(fa_fn):
     _log_file_md5(fa_fn + ".sa")
 
 
-def _bwtocc2klcp(fa_fn, k):
+def _bwtocc2klcp(fa_fn, k, threads):
     """Create k-LCP `` (BWT => k-LCP).
 
     Args:
         fa_fn (str): FASTA file.
         k (int): K-mer size.
+        threads (int): Number of threads for k-LCP construction.
     """
 
     #pro.message('Generating k-LCP array')
     pro.test_files(IND, fa_fn + ".bwt")
-    command = [IND, 'build', '-k', k, fa_fn]
+    command = [IND, 'build', '-k', k, '-t', threads, fa_fn]
     pro.run_safe(
         command,
         err_msg="k-Longest Common Prefix array construction failed.",
@@ -618,17 +619,18 @@ def _bwtocc2klcp(fa_fn, k):
     _log_file_md5("{}.{}.klcp".format(fa_fn, k))
 
 
-def _bwtocc2sa_klcp(fa_fn, k):
+def _bwtocc2sa_klcp(fa_fn, k, threads):
     """Create k-LCP `` (BWT => k-LCP).
 
     Args:
         fa_fn (str): FASTA file.
         k (int): K-mer size.
+        threads (int): Number of threads for k-LCP construction.
     """
 
     pro.message('Generating k-LCP array and SA in parallel')
     pro.test_files(IND, fa_fn + ".bwt")
-    command = [IND, 'build', '-s', '-k', k, fa_fn]
+    command = [IND, 'build', '-s', '-k', k, '-t', threads, fa_fn]
     pro.run_safe(
         command,
         err_msg="Parallel construction of k-Longest Common Prefix array and Sampled Suffix Array failed.",
@@ -772,7 +774,7 @@ def prophyle_index(
 
         if recompute:
             pro.message('[5/6],[6/6] Constructing SA + KLCP in parallel ', upper=True)
-            _bwtocc2sa_klcp(index_fa, k)
+            _bwtocc2sa_klcp(index_fa, k, threads)
             _mark_complete(index_dir, 5)
             _mark_complete(index_dir, 6)
             return
@@ -800,7 +802,7 @@ def prophyle_index(
 
         if recompute:
             pro.message('[6/6] Constructing k-LCP', upper=True)
-            _bwtocc2klcp(index_fa, k)
+            _bwtocc2klcp(index_fa, k, threads)
             _mark_complete(index_dir, 6)
         else:
             pro.message('[6/6] k-LCP already exists, skipping its construction', upper=True)
@@ -822,7 +824,7 @@ def prophyle_classify(
         fq_fn (str): Input reads (single-end or first of paired-end).
         fq_pe_fn (str): Input reads (second paired-end, None if single-end)
         k (int): K-mer size (None => detect automatically).
-        out_format (str): Output format: sam / kraken.
+        out_format (str): Output format: sam / kraken / bin.
         mimic_kraken (bool): Mimic Kraken algorithm (compute LCA for each k-mer).
         measure (str): Measure used for classification (h1 / h2 / c1 / c2).
         annotate (bool): Annotate assignments (insert annotations from Newick to SAM).
@@ -888,6 +890,8 @@ def prophyle_classify(
         kmer_lca = True
         out_format = "kraken"
 
+    assert cimpl or out_format != "bin", "Binary output is supported only by the C++ assignment (-C)"
+
     cmd_assign = [ASSIGN]
 
     if not cimpl and prophyle_conf_string:
@@ -907,18 +911,17 @@ def prophyle_classify(
     cmd_assign += [index_tree, k, '-']
 
     if fq_pe_fn:
-        cmd_read = [READ, fq_fn, fq_pe_fn, '|']
-        in_read = '-'
+        # mates are merged by prophyle_index itself
+        in_reads = [fq_fn, fq_pe_fn]
     else:
-        cmd_read = []
         # fq_fn can be '-' as well
-        in_read = fq_fn
+        in_reads = [fq_fn]
 
     cmd_query = [
-        IND, 'query', '-k', k, '-u' if use_rolling_window else '', '-b' if print_seq else '', index_fa, in_read, '|'
-    ]
+        IND, 'query', '-k', k, '-u' if use_rolling_window else '', '-b' if print_seq else '', index_fa
+    ] + in_reads + ['|']
 
-    command = cmd_read + cmd_query + cmd_assign
+    command = cmd_query + cmd_assign
     pro.run_safe(command)
 
 
@@ -1262,7 +1265,7 @@ def parser():
     parser_classify.add_argument(
         '-f',
         dest='oform',
-        choices=['kraken', 'sam'],
+        choices=['kraken', 'sam', 'bin'],
         default=DEFAULT_OUTPUT_FORMAT,
         help='output format [{}]'.format(DEFAULT_OUTPUT_FORMAT),
     )
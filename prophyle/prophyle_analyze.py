@@ -15,7 +15,10 @@ from ete3 import Tree
 from ete3.coretype.tree import TreeError
 from collections import Counter
 
-IN_FMTS = ['sam', 'bam', 'cram', 'uncompressed_bam', 'kraken', 'histo']
+sys.path.append(os.path.dirname(__file__))
+import prophylelib as pro
+
+IN_FMTS = ['sam', 'bam', 'cram', 'uncompressed_bam', 'kraken', 'bin', 'histo']
 STATS = ['w', 'u', 'wl', 'ul']
 KNOWN_RANKS = ['superkingdom', 'phylum', 'class', 'order', 'family', 'genus', 'species', 'strain']
 KRAKEN_RANKS = {
@@ -99,7 +102,7 @@ ul: unique assignments, propagated to leaves
 
 def open_asg(in_fn, in_format):
 
-    # try to detect kraken and histo formats automatically
+    # try to detect kraken, binary and histo formats automatically
     if in_format is None:
         if '.' in in_fn:
             f_ext = in_fn.split('.')[-1]
@@ -107,11 +110,13 @@ def open_asg(in_fn, in_format):
                 in_format = f_ext
         else:
             with open(in_fn, 'rb') as f:
-                f_start = f.read(2)
-                if f_start == b'C\t' or f_start == b'U\t':
+                f_start = f.read(len(pro.BINARY_ASSIGNMENT_MAGIC))
+                if f_start[:2] == b'C\t' or f_start[:2] == b'U\t':
                     in_format = 'kraken'
-                elif f_start == b'#O':
+                elif f_start[:2] == b'#O':
                     in_format = 'histo'
+                elif f_start == pro.BINARY_ASSIGNMENT_MAGIC:
+                    in_format = 'bin'
 
     if in_format == 'sam':
         in_f = pysam.AlignmentFile(in_fn, "r")
@@ -123,6 +128,8 @@ def open_asg(in_fn, in_format):
         in_f = pysam.AlignmentFile(in_fn, "ru")
     elif in_format == 'kraken':
         in_f = open(in_fn, 'r')
+    elif in_format == 'bin':
+        in_f = open(in_fn, 'rb')
     # no need to load assignments if input is a histogram -> go to load_histo
     elif in_format == 'histo':
         in_f = None
@@ -148,7 +155,8 @@ def load_asgs(in_fns, in_format):
             assert len(in_fns) == 1, "No support for multiple files with stdin"
             assert in_format is not None, "Not able to infer format from stdin"
             base_fn = 'stdin'
-            f = sys.stdin
+            f = sys.stdin.buffer if in_format == 'bin' else sys.stdin
+            f_fmt = in_format
         else:
             base_fn = os.path.basename(fn)
             if '.' in base_fn:
@@ -158,11 +166,13 @@ def load_asgs(in_fns, in_format):
 
         try:
             # if histogram, skip load_asgs and go to load_histo
-            if in_format == 'histo':
+            if f_fmt == 'histo':
                 histograms.append(fn)
                 continue
-            elif in_format == 'kraken':
+            elif f_fmt == 'kraken':
                 read_iterator = (read for read in f)
+            elif f_fmt == 'bin':
+                read_iterator = pro.read_binary_assignments(f)
             # pysam AlignmentFile (sam, bam etc.)
             else:
                 read_iterator = (read for read in f.fetch(until_eof=True))
@@ -172,11 +182,18 @@ def load_asgs(in_fns, in_format):
             unclassified = 0
 
             for read in read_iterator:
-                if in_format == 'kraken':
+                if f_fmt == 'kraken':
                     res, read_name, read_ref = read.split('\t')[0:3]
                     if res.strip() == 'U':
                         unclassified += 1
                         continue
+                elif f_fmt == 'bin':
+                    # reads are identified by their index in the input
+                    read_index, read_ref, _, _ = read
+                    if read_ref is None:
+                        unclassified += 1
+                        continue
+                    read_name = str(read_index)
                 else:
                     if read.is_unmapped:
                         unclassified += 1
@@ -189,7 +206,7 @@ def load_asgs(in_fns, in_format):
                 except KeyError:
                     current_asgs[read_name.strip()] = [read_ref.strip()]
         finally:
-            if base_fn != 'stdin':
+            if base_fn != 'stdin' and f is not None:
                 f.close()
 
     return asgs, histograms, unclassified
@@ -0,0 +1,195 @@
+/*
+	Binary k-mer files of prophyle_assembler (-b).
+
+	A file is a header followed by the sorted unique canonical k-mers:
+		magic "PHYK" | u32 version | u32 k | u64 number of k-mers
+	Every k-mer takes ceil(k/4) bytes (2 bits per nucleotide, the lowest
+	byte first); all integers are little-endian. The files are read through
+	zlib, so they can also be compressed by gzip.
+
+	Author: Karel Brinda <kbrinda@hsph.harvard.edu>
+	Licence: MIT
+*/
+
+#pragma once
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+static const char binary_kmer_magic[]="PHYK";
+static const uint32_t binary_kmer_version=1;
+static const size_t binary_kmer_header_size=20;
+
+
+inline size_t binary_kmer_bytes(int32_t k){
+	return (k+3)/4;
+}
+
+
+/*
+	Sequential writer, the number of k-mers must be known in advance.
+*/
+template<typename _nkmer_T>
+struct binary_kmer_writer_t{
+	FILE *file;
+	std::string fn;
+	size_t kmer_bytes;
+	std::vector<uint8_t> buffer;
+
+	binary_kmer_writer_t(const std::string &fn, int32_t k, uint64_t count): fn(fn), kmer_bytes(binary_kmer_bytes(k)) {
+		if(fn=="-"){
+			file=stdout;
+		}
+		else{
+			file=fopen(fn.c_str(),"wb");
+			if(file==nullptr){
+				std::cerr << "Error: file '" << fn << "' could not be open (error " << errno << ", " << strerror(errno) << ")." << std::endl;
+				exit(1);
+			}
+		}
+		buffer.reserve(buffer_size);
+		buffer.insert(buffer.end(),binary_kmer_magic,binary_kmer_magic+4);
+		append(binary_kmer_version,4);
+		append(static_cast<uint32_t>(k),4);
+		append(count,8);
+	}
+
+	~binary_kmer_writer_t(){
+		flush();
+		if(file!=stdout){
+			fclose(file);
+		}
+		else{
+			fflush(file);
+		}
+	}
+
+	void write(_nkmer_T nkmer){
+		for(size_t i=0;i<kmer_bytes;i++){
+			buffer.push_back(static_cast<uint8_t>(nkmer >> (8*i)));
+		}
+		if(buffer.size()+kmer_bytes>buffer_size){
+			flush();
+		}
+	}
+
+	void flush(){
+		if(fwrite(buffer.data(),1,buffer.size(),file)!=buffer.size()){
+			std::cerr << "Error: file '" << fn << "' could not be written (error " << errno << ", " << strerror(errno) << ")." << std::endl;
+			exit(1);
+		}
+		buffer.clear();
+	}
+
+private:
+	static const size_t buffer_size=1 << 20;
+
+	void append(uint64_t value, size_t bytes){
+		for(size_t i=0;i<bytes;i++){
+			buffer.push_back(static_cast<uint8_t>(value >> (8*i)));
+		}
+	}
+};
+
+
+/*
+	Sequential reader of an opened file whose magic has already been read.
+*/
+template<typename _nkmer_T>
+struct binary_kmer_reader_t{
+	gzFile fp;
+	std::string fn;
+	size_t kmer_bytes;
+	uint64_t count;
+	std::vector<uint8_t> buffer;
+
+	binary_kmer_reader_t(gzFile fp, const std::string &fn, int32_t k): fp(fp), fn(fn), kmer_bytes(binary_kmer_bytes(k)), position(0), loaded(0) {
+		uint8_t header[binary_kmer_header_size-4];
+		read_bytes(header,sizeof(header));
+		const uint32_t version=static_cast<uint32_t>(decode(header,4));
+		const uint32_t file_k=static_cast<uint32_t>(decode(header+4,4));
+		count=decode(header+8,8);
+		if(version!=binary_kmer_version){
+			std::cerr << "Error: file '" << fn << "' has an unsupported version of binary k-mers (" << version << ")." << std::endl;
+			exit(1);
+		}
+		if(file_k!=static_cast<uint32_t>(k)){
+			std::cerr << "Error: file '" << fn << "' contains k-mers of length " << file_k << ", not " << k << "." << std::endl;
+			exit(1);
+		}
+		buffer.resize(kmer_bytes*(buffer_size/kmer_bytes));
+	}
+
+	/* false after all count k-mers have been read */
+	bool next(_nkmer_T &nkmer){
+		if(remaining()==0){
+			return false;
+		}
+		if(position==loaded){
+			loaded=std::min<uint64_t>(remaining()*kmer_bytes,buffer.size());
+			read_bytes(buffer.data(),loaded);
+			position=0;
+		}
+		nkmer=static_cast<_nkmer_T>(decode(buffer.data()+position,kmer_bytes));
+		position+=kmer_bytes;
+		read_count++;
+		return true;
+	}
+
+private:
+	static const size_t buffer_size=1 << 20;
+
+	size_t position;
+	size_t loaded;
+	uint64_t read_count=0;
+
+	uint64_t remaining() const {
+		return count-read_count;
+	}
+
+	void read_bytes(uint8_t *data, size_t bytes){
+		if(gzread(fp,data,bytes)!=static_cast<int>(bytes)){
+			std::cerr << "Error: file '" << fn << "' is truncated." << std::endl;
+			exit(1);
+		}
+	}
+
+	/* k-mers of k > 32 do not fit into uint64_t, so they are decoded here */
+	static unsigned __int128 decode(const uint8_t *data, size_t bytes){
+		unsigned __int128 value=0;
+		for(size_t i=bytes;i>0;i--){
+			value=(value << 8) | data[i-1];
+		}
+		return value;
+	}
+};
+
+
+/*
+	Check whether an opened file is a binary k-mer file; if so, the magic
+	is consumed, otherwise the file is left at its first character.
+*/
+inline bool is_binary_kmer_file(gzFile fp, const std::string &fn){
+	const int c=gzgetc(fp);
+	if(c!=binary_kmer_magic[0]){
+		if(c!=-1){
+			gzungetc(c,fp);
+		}
+		return false;
+	}
+	char magic[3];
+	if(gzread(fp,magic,3)!=3 || memcmp(magic,binary_kmer_magic+1,3)!=0){
+		std::cerr << "Error: file '" << fn << "' is neither a FASTA file, nor a binary k-mer file." << std::endl;
+		exit(1);
+	}
+	return true;
+}
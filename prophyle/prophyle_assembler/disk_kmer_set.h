@@ -0,0 +1,339 @@
+/*
+	K-mer sets kept on disk for prophyle_assembler (-M).
+
+	While an input is loaded, its k-mers are collected in a buffer of
+	a bounded size; every full buffer is sorted and written to a temporary
+	file as a run, and the runs are merged into a single sorted file. The
+	intersection and the subtraction are streaming merges of these files,
+	so only small read buffers are in memory. A set is loaded to memory
+	only to be assembled.
+
+	Author: Karel Brinda <kbrinda@hsph.harvard.edu>
+	Licence: MIT
+*/
+
+#pragma once
+
+#include "sorted_kmer_set.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <queue>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+/*
+	Temporary file removed when the last reference is dropped.
+*/
+struct tmp_kmer_file_t{
+	std::string fn;
+
+	explicit tmp_kmer_file_t(const std::string &tmp_dir){
+		std::string pattern=tmp_dir+"/prophyle_assembler.XXXXXX";
+		std::vector<char> buffer(pattern.begin(), pattern.end());
+		buffer.push_back('\0');
+		int fd=mkstemp(buffer.data());
+		if(fd==-1){
+			std::cerr << "Error: temporary file in '" << tmp_dir << "' could not be created (error " << errno << ", " << strerror(errno) << ")." << std::endl;
+			exit(1);
+		}
+		close(fd);
+		fn=buffer.data();
+	}
+
+	~tmp_kmer_file_t(){
+		unlink(fn.c_str());
+	}
+};
+
+
+/*
+	Sequential reader of a file of sorted k-mers.
+*/
+template<typename _nkmer_T>
+struct kmer_file_reader_t{
+	FILE *file;
+	std::vector<_nkmer_T> buffer;
+	size_t position;
+	size_t loaded;
+
+	kmer_file_reader_t(const std::string &fn, size_t buffer_size): buffer(buffer_size), position(0), loaded(0) {
+		file=fopen(fn.c_str(),"rb");
+		if(file==nullptr){
+			std::cerr << "Error: file '" << fn << "' could not be open (error " << errno << ", " << strerror(errno) << ")." << std::endl;
+			exit(1);
+		}
+		fill();
+	}
+
+	~kmer_file_reader_t(){
+		fclose(file);
+	}
+
+	bool empty() const {
+		return position==loaded;
+	}
+
+	_nkmer_T value() const {
+		return buffer[position];
+	}
+
+	void advance(){
+		if(++position==loaded){
+			fill();
+		}
+	}
+
+private:
+	void fill(){
+		loaded=fread(buffer.data(),sizeof(_nkmer_T),buffer.size(),file);
+		position=0;
+	}
+};
+
+
+template<typename _nkmer_T>
+struct kmer_file_writer_t{
+	FILE *file;
+	std::string fn;
+	std::vector<_nkmer_T> buffer;
+	size_t count;
+
+	kmer_file_writer_t(const std::string &fn, size_t buffer_size): fn(fn), count(0) {
+		file=fopen(fn.c_str(),"wb");
+		if(file==nullptr){
+			std::cerr << "Error: file '" << fn << "' could not be open (error " << errno << ", " << strerror(errno) << ")." << std::endl;
+			exit(1);
+		}
+		buffer.reserve(buffer_size);
+	}
+
+	~kmer_file_writer_t(){
+		flush();
+		fclose(file);
+	}
+
+	void write(_nkmer_T nkmer){
+		buffer.push_back(nkmer);
+		count++;
+		if(buffer.size()==buffer.capacity()){
+			flush();
+		}
+	}
+
+	void flush(){
+		if(fwrite(buffer.data(),sizeof(_nkmer_T),buffer.size(),file)!=buffer.size()){
+			std::cerr << "Error: file '" << fn << "' could not be written (error " << errno << ", " << strerror(errno) << ")." << std::endl;
+			exit(1);
+		}
+		buffer.clear();
+	}
+};
+
+
+template<typename _nkmer_T>
+struct disk_kmer_set_t{
+	typedef _nkmer_T value_type;
+
+	int32_t k;
+	/* bytes for buffering k-mers of the input and for merging */
+	size_t memory;
+	std::string tmp_dir;
+
+	/* sorted unique k-mers of the set after finalize() */
+	std::shared_ptr<tmp_kmer_file_t> file;
+	size_t count;
+
+	disk_kmer_set_t(int32_t k, size_t memory, const std::string &tmp_dir): k(k), memory(memory), tmp_dir(tmp_dir), count(0) {}
+
+	void clear(){
+		std::vector<_nkmer_T>().swap(buffer);
+		runs.clear();
+		file.reset();
+		count=0;
+	}
+
+	/* only appends, finalize() must be called before the set is used */
+	void insert(_nkmer_T nkmer){
+		if(buffer.capacity()==0){
+			// the radix sort takes the same amount of memory again
+			buffer.reserve(std::max<size_t>(memory/(2*sizeof(_nkmer_T)),1));
+		}
+		buffer.push_back(nkmer);
+		if(buffer.size()==buffer.capacity()){
+			spill();
+		}
+	}
+
+	void finalize(){
+		if(!buffer.empty() || runs.empty()){
+			spill();
+		}
+		std::vector<_nkmer_T>().swap(buffer);
+		if(runs.size()==1){
+			file=runs[0].first;
+			count=runs[0].second;
+		}
+		else{
+			merge_runs();
+		}
+		runs.clear();
+	}
+
+	size_t size() const {
+		return count;
+	}
+
+	/* k-mers per read buffer when readers_count files are read at once */
+	size_t reader_buffer_size(size_t readers_count) const {
+		return std::max<size_t>(memory/sizeof(_nkmer_T)/(readers_count+1),1024);
+	}
+
+	void load(std::vector<_nkmer_T> &kmers) const {
+		kmers.clear();
+		kmers.reserve(count);
+		if(file){
+			kmer_file_reader_t<_nkmer_T> reader(file->fn,reader_buffer_size(1));
+			for(;!reader.empty();reader.advance()){
+				kmers.push_back(reader.value());
+			}
+		}
+	}
+
+private:
+	std::vector<_nkmer_T> buffer;
+	std::vector<std::pair<std::shared_ptr<tmp_kmer_file_t>, size_t>> runs;
+
+	void spill(){
+		radix_sort_kmers(buffer, 2*k);
+		buffer.erase(std::unique(buffer.begin(), buffer.end()), buffer.end());
+		auto run=std::make_shared<tmp_kmer_file_t>(tmp_dir);
+		FILE *run_file=fopen(run->fn.c_str(),"wb");
+		if(run_file==nullptr || fwrite(buffer.data(),sizeof(_nkmer_T),buffer.size(),run_file)!=buffer.size()){
+			std::cerr << "Error: file '" << run->fn << "' could not be written (error " << errno << ", " << strerror(errno) << ")." << std::endl;
+			exit(1);
+		}
+		fclose(run_file);
+		runs.emplace_back(run,buffer.size());
+		buffer.clear();
+	}
+
+	/* k-way merge with a heap of the current k-mers of the runs */
+	void merge_runs(){
+		std::vector<std::unique_ptr<kmer_file_reader_t<_nkmer_T>>> readers;
+		typedef std::pair<_nkmer_T, size_t> head_t;
+		std::priority_queue<head_t, std::vector<head_t>, std::greater<head_t>> heads;
+		for(const auto &run : runs){
+			readers.emplace_back(new kmer_file_reader_t<_nkmer_T>(run.first->fn,reader_buffer_size(runs.size())));
+			if(!readers.back()->empty()){
+				heads.emplace(readers.back()->value(),readers.size()-1);
+			}
+		}
+
+		file=std::make_shared<tmp_kmer_file_t>(tmp_dir);
+		kmer_file_writer_t<_nkmer_T> writer(file->fn,reader_buffer_size(runs.size()));
+		_nkmer_T last=0;
+		while(!heads.empty()){
+			const head_t head=heads.top();
+			heads.pop();
+			// the runs are unique, so duplicates come from different runs
+			if(writer.count==0 || head.first!=last){
+				writer.write(head.first);
+				last=head.first;
+			}
+			auto &reader=*readers[head.second];
+			reader.advance();
+			if(!reader.empty()){
+				heads.emplace(reader.value(),head.second);
+			}
+		}
+		count=writer.count;
+	}
+};
+
+
+/*
+	Streaming multi-way merge driven by the smallest set.
+*/
+template<typename _nkmer_T>
+int32_t find_intersection(const std::vector<disk_kmer_set_t<_nkmer_T>> &sets, disk_kmer_set_t<_nkmer_T> &intersection){
+	assert(sets.size()>0);
+
+	size_t i_min=0;
+	for (size_t i=1; i<sets.size(); i++){
+		if (sets[i].size()<sets[i_min].size()){
+			i_min=i;
+		}
+	}
+
+	intersection.clear();
+	const size_t buffer_size=intersection.reader_buffer_size(sets.size()+1);
+	std::vector<std::unique_ptr<kmer_file_reader_t<_nkmer_T>>> readers;
+	for (const auto &set : sets){
+		readers.emplace_back(new kmer_file_reader_t<_nkmer_T>(set.file->fn,buffer_size));
+	}
+
+	intersection.file=std::make_shared<tmp_kmer_file_t>(intersection.tmp_dir);
+	kmer_file_writer_t<_nkmer_T> writer(intersection.file->fn,buffer_size);
+	auto &driver=*readers[i_min];
+	for (;!driver.empty();driver.advance()){
+		const _nkmer_T nkmer=driver.value();
+		bool everywhere=true;
+		bool exhausted=false;
+		for (auto &reader : readers){
+			while (!reader->empty() && reader->value()<nkmer){
+				reader->advance();
+			}
+			if (reader->empty()){
+				exhausted=true;
+				break;
+			}
+			if (reader->value()!=nkmer){
+				everywhere=false;
+			}
+		}
+		if (exhausted){
+			break;
+		}
+		if (everywhere){
+			writer.write(nkmer);
+		}
+	}
+	intersection.count=writer.count;
+
+	return 0;
+}
+
+
+template<typename _nkmer_T>
+int32_t remove_subset(std::vector<disk_kmer_set_t<_nkmer_T>> &sets, const disk_kmer_set_t<_nkmer_T> &subset){
+	for (auto &current_set : sets){
+		const size_t buffer_size=current_set.reader_buffer_size(3);
+		auto file=std::make_shared<tmp_kmer_file_t>(current_set.tmp_dir);
+		size_t kept=0;
+		{
+			kmer_file_reader_t<_nkmer_T> reader(current_set.file->fn,buffer_size);
+			kmer_file_reader_t<_nkmer_T> removed(subset.file->fn,buffer_size);
+			kmer_file_writer_t<_nkmer_T> writer(file->fn,buffer_size);
+			for (;!reader.empty();reader.advance()){
+				while (!removed.empty() && removed.value()<reader.value()){
+					removed.advance();
+				}
+				if (removed.empty() || removed.value()!=reader.value()){
+					writer.write(reader.value());
+				}
+			}
+			kept=writer.count;
+		}
+		current_set.file=file;
+		current_set.count=kept;
+	}
+
+	return 0;
+}
@@ -33,12 +33,16 @@ Description:
 	done by greedy enumeration of disjoint paths in the corresponding
 	de-Bruijn graphs.
 
+	K-mers are encoded in 64 bits for k <= 32 and in 128 bits otherwise.
+
 Todo:
-	* Find a library for sets of integers bigger than uint64_t (to support k-mers longer than 32).
 	* Optimize loading FASTA files.
 	* Check memory consumption (and put it here).
 */
 #include "kseq.h"
+#include "sorted_kmer_set.h"
+#include "disk_kmer_set.h"
+#include "binary_kmer_file.h"
 
 #include <zlib.h>
 
@@ -52,15 +56,21 @@ Todo:
 #include <cassert>
 #include <sstream>
 #include <unordered_set>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
 #include <getopt.h>
 
-//typedef __uint128_t nkmer_t;
 typedef uint64_t nkmer_t;
+typedef unsigned __int128 long_nkmer_t;
 typedef std::set<nkmer_t> set_t;
 
 const int32_t fasta_line_length=60;
 const int32_t max_contig_length=10000000;
-const int32_t max_allowed_kmer_length=sizeof(nkmer_t)*4;
+const int32_t max_short_kmer_length=sizeof(nkmer_t)*4;
+const int32_t max_allowed_kmer_length=sizeof(long_nkmer_t)*4;
 //const int32_t default_k=31;
 
 static const uint8_t nt4_nt256[] = "ACGTN";
@@ -88,6 +98,28 @@ static const uint8_t nt256_nt4[] = {
 KSEQ_INIT(gzFile, gzread)
 
 
+/*
+	Hash tables of k-mers; the standard library has no hash of 128-bit integers.
+*/
+struct long_nkmer_hash_t{
+	size_t operator()(long_nkmer_t nkmer) const {
+		const uint64_t low=static_cast<uint64_t>(nkmer);
+		const uint64_t high=static_cast<uint64_t>(nkmer >> 64);
+		return std::hash<uint64_t>()(low ^ (high * 0x9e3779b97f4a7c15ULL));
+	}
+};
+
+template<typename _nkmer_T>
+struct hash_kmer_set{
+	typedef std::unordered_set<_nkmer_T> type;
+};
+
+template<>
+struct hash_kmer_set<long_nkmer_t>{
+	typedef std::unordered_set<long_nkmer_t, long_nkmer_hash_t> type;
+};
+
+
 void print_help(){
 	std::cerr <<
 		"\n" <<
@@ -105,11 +137,21 @@ void print_help(){
 		"\n" <<
 		"Command-line parameters:\n" <<
 		" -k INT   K-mer size.\n" <<
-		" -i FILE  Input FASTA file (can be used multiple times).\n" <<
+		" -i FILE  Input FASTA file or binary k-mer file (can be used multiple times).\n" <<
 		" -o FILE  Output FASTA file (if used, must be used as many times as -i).\n" <<
 		" -x FILE  Compute intersection, subtract it, save it.\n" <<
+		" -b       Save the intersection (-x) as a binary file of sorted k-mers instead of\n" <<
+		"          assembling it.\n" <<
 		" -s FILE  Output file with k-mer statistics.\n" <<
 		//" -k INT   K-mer size. [" << default_k << "]\n" <<
+		" -t INT   Number of threads (loading the input files, assembling sorted k-mer sets). [1]\n" <<
+		"          (sorted sets are then assembled into other contigs than by 1 thread,\n" <<
+		"          but into the same ones for any number of threads)\n" <<
+		" -M INT   Keep k-mer sets on disk and use about INT MB for loading and merging them\n" <<
+		"          (sets are still assembled in memory, one at a time, which INT does not\n" <<
+		"          bound: about 16 B per k-mer of the largest set, 24 B for k > 32).\n" <<
+		" -T DIR   Directory for temporary files of -M. [$TMPDIR or /tmp]\n" <<
+		" -V       Keep k-mer sets in sorted vectors instead of hash tables (less memory).\n" <<
 		" -S       Silent mode.\n" <<
 		"\n" <<
 		"Note that '-' can be used for standard input/output. \n" <<
@@ -178,6 +220,24 @@ int32_t encode_canonical(const char *kmers, const int32_t k, _nkmer_T &nkmer){
 	return 0;
 }
 
+/*
+	Reverse complement of an encoded k-mer: the nucleotides are complemented and
+	reversed in the whole word, then shifted down.
+*/
+inline nkmer_t reverse_complement(nkmer_t nkmer, int32_t k){
+	nkmer=~nkmer;
+	nkmer=((nkmer >> 2) & 0x3333333333333333ULL) | ((nkmer & 0x3333333333333333ULL) << 2);
+	nkmer=((nkmer >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((nkmer & 0x0F0F0F0F0F0F0F0FULL) << 4);
+	return __builtin_bswap64(nkmer) >> (64-2*k);
+}
+
+inline long_nkmer_t reverse_complement(long_nkmer_t nkmer, int32_t k){
+	const long_nkmer_t rc=(long_nkmer_t(reverse_complement(static_cast<nkmer_t>(nkmer),32)) << 64)
+		| reverse_complement(static_cast<nkmer_t>(nkmer >> 64),32);
+	return rc >> (128-2*k);
+}
+
+
 template<typename _nkmer_T>
 int32_t decode_kmer(_nkmer_T nkmer, int32_t k, std::string &kmer){
 	kmer.resize(k);
@@ -190,19 +250,6 @@ int32_t decode_kmer(_nkmer_T nkmer, int32_t k, std::string &kmer){
 	return 0;
 }
 
-void reverse_complement_in_place(std::string &kmer){
-	//std::cerr << "before reverse complementing " << kmer << std::endl;
-    std::reverse(kmer.begin(), kmer.end());
-	for (int32_t i=0;i<static_cast<int32_t>(kmer.size());i++){
-		char nt4=nt256_nt4[static_cast<int32_t>(kmer[i])];
-		if (nt4<4){
-			nt4=3-nt4;
-		}
-		kmer[i]=nt4_nt256[static_cast<int32_t>(nt4)];
-	}
-	//std::cerr << "after reverse complementing " << kmer << std::endl;
-}
-
 template<typename _set_T>
 void debug_print_kmer_set(_set_T &set, int k, bool verbose){
 	std::string kmer;
@@ -218,94 +265,225 @@ void debug_print_kmer_set(_set_T &set, int k, bool verbose){
 }
 
 
-struct contig_t{
-	int32_t k;
+/*
+	Bits set by several threads at once.
+*/
+struct atomic_bitmap_t{
+	std::unique_ptr<std::atomic<uint64_t>[]> words;
 
-	/* contig buffer */
-	char *seq_buffer;
+	atomic_bitmap_t(size_t size): words(new std::atomic<uint64_t>[(size+63)/64]) {
+		for(size_t i=0;i<(size+63)/64;i++){
+			words[i].store(0,std::memory_order_relaxed);
+		}
+	}
+
+	/* set the bit and return whether it was not set before */
+	bool set(size_t i){
+		const uint64_t bit=uint64_t(1) << (i%64);
+		return (words[i/64].fetch_or(bit,std::memory_order_relaxed) & bit)==0;
+	}
+
+	bool get(size_t i) const {
+		return (words[i/64].load(std::memory_order_relaxed) >> (i%64)) & 1;
+	}
+};
 
-	/* the first position of the contig */
-	char *l_ext;
 
-	/* the last position of the contig +1 (semiopen ) */
-	char *r_ext;
+/*
+	Contigs assembled by one thread, written out together.
+*/
+struct contig_batch_t{
+	static const size_t max_size=1<<20;
 
-	/* min possible value of l_ext */
-	char *l_ext_border;
+	/* concatenated sequences of the contigs */
+	std::string seqs;
+	std::vector<size_t> lengths;
 
-	/* max possible value of l_ext */
-	char *r_ext_border;
+	/* extensions of the contig being assembled */
+	std::string left;
+	std::string right;
+	std::string seed;
 
-	contig_t(uint32_t _k){
-		this->k=_k;
-		seq_buffer=new char[k+2*max_contig_length+1]();
-		l_ext_border=seq_buffer;
-		r_ext_border=seq_buffer+2*max_contig_length;
+	bool is_full() const {
+		return seqs.size()>=max_size;
 	}
 
-	int32_t new_contig(const char *base_kmer){
-		assert(static_cast<int32_t>(strlen(base_kmer))==k);
+	void clear(){
+		seqs.clear();
+		lengths.clear();
+	}
+};
 
-		l_ext = r_ext = &seq_buffer[max_contig_length];
-		*r_ext='\0';
 
-		for(int32_t i=0;i<k;i++){
-			r_extend(base_kmer[i]);
+/*
+	FASTA output shared by the assembling threads, contigs are numbered in the order of writing.
+*/
+struct contig_writer_t{
+	FILE *file;
+	int32_t contig_id;
+	std::mutex mutex;
+	std::string buffer;
+
+	contig_writer_t(const std::string &fasta_fn): contig_id(1) {
+		if(fasta_fn=="-"){
+			file=stdout;
+		}
+		else{
+			file=fopen(fasta_fn.c_str(),"w+");
+			test_file(file, fasta_fn);
 		}
-		return 0;
 	}
 
-	int32_t r_extend(char c){
-		uint8_t nt4 = nt256_nt4[static_cast<int32_t>(c)];
+	~contig_writer_t(){
+		fclose(file);
+	}
 
-		if (nt4==4){
-			return -1;
+	void write(contig_batch_t &batch){
+		std::lock_guard<std::mutex> lock(mutex);
+		buffer.clear();
+		const char *seq=batch.seqs.data();
+		for(const size_t length : batch.lengths){
+			buffer+=">c";
+			buffer+=std::to_string(contig_id++);
+			buffer+='\n';
+			for(size_t i=0;i<length;i+=fasta_line_length){
+				buffer.append(seq+i,std::min<size_t>(fasta_line_length,length-i));
+				buffer+='\n';
+			}
+			seq+=length;
 		}
-
-		*r_ext=nt4_nt256[nt4];
-		++r_ext;
-		*r_ext='\0';
-		return 0;
+		fwrite(buffer.data(),1,buffer.size(),file);
+		batch.clear();
 	}
+};
 
-	int32_t l_extend(char c){
-		uint8_t nt4 = nt256_nt4[static_cast<int32_t>(c)];
 
-		if (nt4==4){
-			return -1;
-		}
+/*
+	Greedily extend the seed k-mer to the right and then to the left and append
+	the contig to the batch. claim(nkmer) removes a canonical k-mer from the
+	remaining set and returns whether it was there; the neighbours are tried in
+	the order A, C, G, T and their encodings are rolled in O(1).
+*/
+template<typename _nkmer_T, typename _claim_T>
+void assemble_contig(_nkmer_T seed_nkmer, int32_t k, _claim_T &claim, contig_batch_t &batch){
+	const int32_t bits=2*k;
+	const _nkmer_T mask=bits==static_cast<int32_t>(8*sizeof(_nkmer_T)) ? ~_nkmer_T(0) : (_nkmer_T(1) << bits)-1;
+
+	decode_kmer(seed_nkmer,k,batch.seed);
+	_nkmer_T seed_f;
+	_nkmer_T seed_r;
+	encode_forward(batch.seed.c_str(),k,seed_f);
+	encode_reverse(batch.seed.c_str(),k,seed_r);
+
+	batch.left.clear();
+	batch.right.clear();
+	auto is_full=[&batch,k](){
+		return static_cast<int32_t>(batch.right.size())>=max_contig_length-k
+			|| static_cast<int32_t>(batch.left.size())>=max_contig_length;
+	};
 
-		--l_ext;
-		*l_ext=nt4_nt256[3-nt4];
-		return 0;
+	for (int direction=0;direction<2;direction++){
+		// the left extension is the right extension of the reverse complement
+		_nkmer_T nkmer_f = direction==0 ? seed_f : seed_r;
+		_nkmer_T nkmer_r = direction==0 ? seed_r : seed_f;
+		std::string &extension = direction==0 ? batch.right : batch.left;
+
+		bool extending = true;
+		while (extending){
+			extending=false;
+			for(uint8_t nt4=0;nt4<4;nt4++){
+				_nkmer_T next_f = ((nkmer_f << 2) | nt4) & mask;
+				_nkmer_T next_r = (nkmer_r >> 2) | (_nkmer_T(3-nt4) << (bits-2));
+				if(claim(std::min(next_f,next_r))){
+					extension+=nt4_nt256[nt4];
+					nkmer_f=next_f;
+					nkmer_r=next_r;
+					extending=!is_full();
+					break;
+				}
+			}
+		}
 	}
 
-	~contig_t(){
-		delete[] seq_buffer;
+	for(auto it=batch.left.crbegin();it!=batch.left.crend();++it){
+		batch.seqs+=nt4_nt256[3-nt256_nt4[static_cast<uint8_t>(*it)]];
 	}
+	batch.seqs+=batch.seed;
+	batch.seqs+=batch.right;
+	batch.lengths.push_back(batch.left.size()+k+batch.right.size());
+}
 
-	bool is_full(){
-		return (r_ext>=r_ext_border) || (l_ext<=l_ext_border);
-	}
 
-	int32_t print_to_fasta(FILE* fasta_file, const char* contig_name, const char *comment=nullptr) const {
-		if (comment==nullptr){
-			fprintf(fasta_file,">%s\n",contig_name);
-		} else {
-			fprintf(fasta_file,">%s %s\n",contig_name,comment);
+template<typename _set_T>
+void finalize_set(_set_T &set, int32_t k){
+	(void)set;
+	(void)k;
+}
+
+template<typename _nkmer_T>
+void finalize_set(sorted_kmer_set_t<_nkmer_T> &set, int32_t k){
+	set.finalize(k);
+}
+
+template<typename _nkmer_T>
+void finalize_set(disk_kmer_set_t<_nkmer_T> &set, int32_t k){
+	(void)k;
+	set.finalize();
+}
+
+/*
+	Insert all canonical k-mers of the sequence; the forward and the reverse
+	complementary encodings are updated in O(1) per position.
+*/
+template<typename _set_T>
+void insert_canonical_kmers(const char *seq, size_t len, int32_t k, _set_T &set){
+	typedef typename _set_T::value_type _nkmer_T;
+
+	const int32_t bits=2*k;
+	const _nkmer_T mask=bits==static_cast<int32_t>(8*sizeof(_nkmer_T)) ? ~_nkmer_T(0) : (_nkmer_T(1) << bits)-1;
+	_nkmer_T nkmer_f=0;
+	_nkmer_T nkmer_r=0;
+	// number of the last nucleotides without any non-ACGT character
+	int32_t valid=0;
+
+	for(size_t i=0;i<len;i++){
+		uint8_t nt4 = nt256_nt4[static_cast<uint8_t>(seq[i])];
+		if (nt4==4){
+			valid=0;
+			continue;
 		}
 
-		char print_buffer[fasta_line_length+1]={0};
+		nkmer_f = ((nkmer_f << 2) | nt4) & mask;
+		nkmer_r = (nkmer_r >> 2) | (_nkmer_T(3-nt4) << (bits-2));
 
-		for (char *p=l_ext;p<r_ext;p+=fasta_line_length){
-			strncpy(print_buffer,p,fasta_line_length);
-			fprintf(fasta_file, "%s\n", print_buffer);
-		}       
+		if (++valid>=k){
+			set.insert(std::min(nkmer_f,nkmer_r));
+		}
+	}
+}
 
-		return 0;
+/*
+	Binary k-mer files are already sorted and unique, so sorted sets are
+	filled directly.
+*/
+template<typename _set_T>
+void kmers_from_binary(binary_kmer_reader_t<typename _set_T::value_type> &reader, _set_T &set, int32_t k){
+	typename _set_T::value_type nkmer;
+	while(reader.next(nkmer)){
+		set.insert(nkmer);
 	}
-};
+	finalize_set(set, k);
+}
 
+template<typename _nkmer_T>
+void kmers_from_binary(binary_kmer_reader_t<_nkmer_T> &reader, sorted_kmer_set_t<_nkmer_T> &set, int32_t k){
+	(void)k;
+	set.kmers.reserve(reader.count);
+	_nkmer_T nkmer;
+	while(reader.next(nkmer)){
+		set.kmers.push_back(nkmer);
+	}
+}
 
 /*
 	TODO: test if kmer is correct
@@ -313,10 +491,11 @@ struct contig_t{
 
 //template<typename _nkmer_T, typename _set_T>
 template<typename _set_T>
-int kmers_from_fasta(const std::string &fasta_fn, _set_T &set, int32_t k, FILE* fstats,bool verbose){
+int kmers_from_fasta(const std::string &fasta_fn, _set_T &set, int32_t k, bool verbose){
 
 	if (verbose){
-		std::cerr << "Loading " << fasta_fn << std::endl;
+		// a single write, files can be loaded by several threads at once
+		std::cerr << ("Loading " + fasta_fn + "\n") << std::flush;
 	}
 
 	set.clear();
@@ -333,29 +512,21 @@ int kmers_from_fasta(const std::string &fasta_fn, _set_T &set, int32_t k, FILE*
 		test_file(instream, fasta_fn);
 	}
 	gzFile fp = gzdopen(fileno(instream), "r");
-	seq = kseq_init(fp);
 
-	typename _set_T::value_type nkmer;
+	if(is_binary_kmer_file(fp, fasta_fn)){
+		binary_kmer_reader_t<typename _set_T::value_type> reader(fp, fasta_fn, k);
+		kmers_from_binary(reader, set, k);
+		gzclose(fp);
+		return 0;
+	}
 
-	for(int32_t seqid=0;(l = kseq_read(seq)) >= 0;seqid++) {
-		//std::cerr << "kmers from fasta" << std::endl;
+	seq = kseq_init(fp);
 
-		//std::cerr << "starting iterator" << std::endl;
-		for(char *kmer=seq->seq.s; kmer < (seq->seq.s) + (seq->seq.l) -k +1 ;kmer++){
-			int c = encode_canonical(kmer, k, nkmer);
-			if (c==0){
-				set.insert(nkmer);
-			}
-			else{
-				//std::cerr << "problem" <<std::endl;
-			}
-		}
+	for(int32_t seqid=0;(l = kseq_read(seq)) >= 0;seqid++) {
+		insert_canonical_kmers(seq->seq.s, seq->seq.l, k, set);
 	}
 
-	if(fstats){
-		fprintf(fstats,"%s\t%lu\n",fasta_fn.c_str(),set.size());
-	}
-	//std::cerr << "iterator finished" << std::endl;
+	finalize_set(set, k);
 
 	kseq_destroy(seq);
 	gzclose(fp);
@@ -437,108 +608,553 @@ int32_t remove_subset(std::vector<_set_T> &sets, const _subset_T &subset){
 
 
 template<typename _set_T>
-int assemble(const std::string &fasta_fn, _set_T &set, int32_t k, FILE* fstats, bool verbose){
+int assemble(const std::string &fasta_fn, _set_T &set, int32_t k, FILE* fstats, int32_t threads, bool verbose){
+	// hash tables are assembled by a single thread
+	(void)threads;
+
 	if(fstats){
 		fprintf(fstats,"%s\t%lu\n",fasta_fn.c_str(),set.size());
 	}
 
-	FILE *file=nullptr;
-	if(fasta_fn=="-"){
-		file=stdout;
-	}
-	else{
-		file=fopen(fasta_fn.c_str(),"w+");
-		test_file(file, fasta_fn);
-	}
-	char kmer_str[max_allowed_kmer_length+1];
-	contig_t contig(k);
-	const std::vector<char> nucls = {'A','C','G','T'};
+	contig_writer_t writer(fasta_fn);
+	contig_batch_t batch;
+	auto claim=[&set](typename _set_T::value_type nkmer){
+		return set.erase(nkmer)>0;
+	};
 
-	//int32_t i=0;
-	int32_t contig_id=1;
 	while(set.size()>0){
-
 		const auto central_nkmer=*(set.begin());
 		set.erase(central_nkmer);
+		assemble_contig(central_nkmer,k,claim,batch);
+		if(batch.is_full()){
+			writer.write(batch);
+		}
+	}
+	writer.write(batch);
 
-		std::string central_kmer_string;
-		decode_kmer(central_nkmer,k,central_kmer_string);
-		contig.new_contig(central_kmer_string.c_str());
+	if(verbose){
+		std::cerr << "   assembly finished (" << writer.contig_id << " contigs)" << std::endl;
+	}
 
-		typename _set_T::value_type nkmer;
+	return 0;
+}
+
+
+/*
+	Joined ends of k-mers in a sorted set, for assembling it by several threads.
+	End 2*i is the right end of the i-th canonical k-mer and end 2*i+1 its left
+	end. In every round, each free end proposes its first neighbour with a free
+	end in the order A, C, G, T, and two ends are joined if they propose each
+	other. The k-mers thus form disjoint paths and cycles which do not depend
+	on the number of threads.
+*/
+template<typename _nkmer_T>
+struct kmer_paths_t{
+	static const size_t no_end=std::numeric_limits<size_t>::max();
+	static const uint8_t free_end=4;
+	static const int32_t max_rounds=16;
+
+	const sorted_kmer_set_t<_nkmer_T> &set;
+	const int32_t k;
+	const int32_t bits;
+	const _nkmer_T mask;
+
+	/* nucleotide to the joined neighbour of every end, or free_end */
+	std::vector<uint8_t> joins;
+	/* nucleotide to the proposed neighbour of every free end, or free_end if there is none */
+	std::vector<uint8_t> proposals;
+
+	kmer_paths_t(const sorted_kmer_set_t<_nkmer_T> &set, int32_t k):
+		set(set), k(k), bits(2*k),
+		mask(2*k==static_cast<int32_t>(8*sizeof(_nkmer_T)) ? ~_nkmer_T(0) : (_nkmer_T(1) << (2*k))-1),
+		joins(2*set.size(), free_end),
+		proposals(2*set.size(), 0)
+	{}
+
+	/* k-mer read towards the end (forward for the right end), and its reverse complement */
+	void oriented(size_t end, _nkmer_T &nkmer_f, _nkmer_T &nkmer_r) const {
+		const _nkmer_T nkmer=set.kmers[end/2];
+		const _nkmer_T rc=reverse_complement(nkmer,k);
+		nkmer_f = end%2==0 ? nkmer : rc;
+		nkmer_r = end%2==0 ? rc : nkmer;
+	}
 
+	/* end of the neighbour nt4 behind the end, a k-mer read forward is entered by its left end */
+	size_t neighbour(size_t end, _nkmer_T nkmer_f, _nkmer_T nkmer_r, uint8_t nt4) const {
+		const _nkmer_T next_f = ((nkmer_f << 2) | nt4) & mask;
+		const _nkmer_T next_r = (nkmer_r >> 2) | (_nkmer_T(3-nt4) << (bits-2));
+		const size_t i=set.find(std::min(next_f,next_r));
+		if(i==set.size() || i==end/2){
+			return no_end;
+		}
+		return 2*i + (next_f<=next_r ? 1 : 0);
+	}
 
-		for (int direction=0;direction<2;direction++){
+	size_t neighbour(size_t end, uint8_t nt4) const {
+		_nkmer_T nkmer_f;
+		_nkmer_T nkmer_r;
+		oriented(end,nkmer_f,nkmer_r);
+		return neighbour(end,nkmer_f,nkmer_r,nt4);
+	}
 
-			//std::cerr << "direction " << direction << std::endl;
+	size_t joined(size_t end) const {
+		return joins[end]==free_end ? no_end : neighbour(end,joins[end]);
+	}
 
-			if (direction==0){
-				// forward
+	/* run fn(first, last) on chunks of the ends by the threads */
+	template<typename _fn_T>
+	static void parallel_for(size_t ends_count, int32_t threads, _fn_T fn){
+		const size_t ends_chunk=8192;
+		std::atomic<size_t> next(0);
+		auto run=[&](){
+			for(size_t first=next.fetch_add(ends_chunk);first<ends_count;first=next.fetch_add(ends_chunk)){
+				fn(first,std::min(first+ends_chunk,ends_count));
+			}
+		};
+		std::vector<std::thread> workers;
+		for(int32_t t=1;t<threads;t++){
+			workers.emplace_back(run);
+		}
+		run();
+		for(auto &worker : workers){
+			worker.join();
+		}
+	}
+
+	void join_ends(int32_t threads){
+		const size_t ends_count=joins.size();
+		for(int32_t round=0;round<max_rounds;round++){
+			// joins are never undone, so a proposal changes only when the proposed end has been joined
+			parallel_for(ends_count,threads,[this](size_t first, size_t last){
+				_nkmer_T nkmer_f;
+				_nkmer_T nkmer_r;
+				for(size_t end=first;end<last;end++){
+					if(joins[end]!=free_end || proposals[end]==free_end){
+						continue;
+					}
+					oriented(end,nkmer_f,nkmer_r);
+					uint8_t nt4=proposals[end];
+					for(;nt4<4;nt4++){
+						const size_t next=neighbour(end,nkmer_f,nkmer_r,nt4);
+						if(next!=no_end && joins[next]==free_end){
+							break;
+						}
+					}
+					proposals[end]=nt4;
+				}
+			});
+
+			std::atomic<size_t> joined_count(0);
+			parallel_for(ends_count,threads,[this,&joined_count](size_t first, size_t last){
+				size_t count=0;
+				_nkmer_T nkmer_f;
+				_nkmer_T nkmer_r;
+				for(size_t end=first;end<last;end++){
+					if(joins[end]!=free_end || proposals[end]==free_end){
+						continue;
+					}
+					oriented(end,nkmer_f,nkmer_r);
+					const size_t next=neighbour(end,nkmer_f,nkmer_r,proposals[end]);
+					// the way back is the complement of the first nucleotide, a palindrome is entered by its left end
+					const uint8_t back_nt4=3-static_cast<uint8_t>(nkmer_f >> (bits-2));
+					if(proposals[next]==back_nt4 && (nkmer_f!=nkmer_r || end%2==1)){
+						joins[end]=proposals[end];
+						count++;
+					}
+				}
+				joined_count+=count;
+			});
+			if(joined_count==0){
+				break;
+			}
+		}
+		std::vector<uint8_t>().swap(proposals);
+	}
+
+	/*
+		Append the contigs of the k-mers from the end first_end on, until the
+		end not joined or the k-mer last_kmer, and return the index of the
+		last k-mer.
+	*/
+	template<typename _mark_T>
+	size_t walk(size_t first_end, size_t last_kmer, contig_batch_t &batch, _mark_T &mark) const {
+		_nkmer_T nkmer_f;
+		_nkmer_T nkmer_r;
+		size_t end=first_end;
+		size_t length=0;
+		while(true){
+			mark(end/2);
+			if(length==0){
+				oriented(end,nkmer_f,nkmer_r);
+				decode_kmer(nkmer_f,k,batch.seed);
+				batch.seqs+=batch.seed;
+				length=k;
 			}
 			else{
-				// reverse
-				reverse_complement_in_place(central_kmer_string);
+				oriented(end,nkmer_f,nkmer_r);
+				batch.seqs+=nt4_nt256[nkmer_f & 3];
+				length++;
 			}
+			if(length>=static_cast<size_t>(max_contig_length)){
+				batch.lengths.push_back(length);
+				length=0;
+			}
+			const size_t next=joined(end);
+			if(next==no_end || next/2==last_kmer){
+				break;
+			}
+			end=next^1;
+		}
+		if(length>0){
+			batch.lengths.push_back(length);
+		}
+		return end/2;
+	}
+};
 
-			strncpy(kmer_str,central_kmer_string.c_str(),k);
-			kmer_str[k]='\0';
+template<typename _nkmer_T>
+const size_t kmer_paths_t<_nkmer_T>::no_end;
+template<typename _nkmer_T>
+const uint8_t kmer_paths_t<_nkmer_T>::free_end;
+template<typename _nkmer_T>
+const int32_t kmer_paths_t<_nkmer_T>::max_rounds;
 
-			bool extending = true;
 
-			//std::cerr << "central k-mer: " << central_kmer_string << std::endl;
+/*
+	Sorted sets are assembled greedily by a single thread, or along the joined
+	ends of kmer_paths_t by several threads. The paths are assembled from
+	their ends with the lower index, in chunks of consecutive k-mers written in
+	order, and the remaining k-mers, which form cycles, by a single thread. The
+	contigs are the same in every run, but they can differ from those of -t 1.
+*/
+template<typename _nkmer_T>
+int assemble(const std::string &fasta_fn, sorted_kmer_set_t<_nkmer_T> &set, int32_t k, FILE* fstats, int32_t threads, bool verbose){
+	if(fstats){
+		fprintf(fstats,"%s\t%lu\n",fasta_fn.c_str(),set.size());
+	}
 
+	const size_t seeds_chunk=4096;
+	const size_t kmers_count=set.size();
+	set.build_index(k);
+
+	atomic_bitmap_t visited(kmers_count);
+
+	contig_writer_t writer(fasta_fn);
+
+	if(threads==1){
+		auto claim=[&set,&visited](_nkmer_T nkmer){
+			size_t i=set.find(nkmer);
+			return i!=set.size() && visited.set(i);
+		};
+		contig_batch_t batch;
+		for(size_t i=0;i<kmers_count;i++){
+			if(visited.set(i)){
+				assemble_contig(set.kmers[i],k,claim,batch);
+				if(batch.is_full()){
+					writer.write(batch);
+				}
+			}
+		}
+		writer.write(batch);
+	}
+	else{
+		kmer_paths_t<_nkmer_T> paths(set,k);
+		paths.join_ends(threads);
+		auto mark=[&visited](size_t i){
+			visited.set(i);
+		};
+		// last k-mers of paths walked from the other end, which is lower
+		atomic_bitmap_t upper_ends(kmers_count);
+
+		// chunks are written in the order of their k-mers
+		std::mutex turn_mutex;
+		std::condition_variable turn_cv;
+		size_t written_chunks=0;
+		auto wait_turn=[&](size_t chunk){
+			std::unique_lock<std::mutex> lock(turn_mutex);
+			turn_cv.wait(lock,[&](){return written_chunks==chunk;});
+		};
+
+		std::atomic<size_t> next_seed(0);
+		auto assemble_paths=[&](){
+			contig_batch_t batch;
+			for(size_t begin=next_seed.fetch_add(seeds_chunk);begin<kmers_count;begin=next_seed.fetch_add(seeds_chunk)){
+				const size_t end=std::min(begin+seeds_chunk,kmers_count);
+				for(size_t i=begin;i<end;i++){
+					const bool joined_right=paths.joins[2*i]!=paths.free_end;
+					const bool joined_left=paths.joins[2*i+1]!=paths.free_end;
+					if((joined_right && joined_left) || upper_ends.get(i)){
+						continue;
+					}
 
-			while (extending){
-				for(int32_t i=0;i<k;i++){
-					kmer_str[i]=kmer_str[i+1];
+					// only the walk from the lower end is kept, the other one is skipped if it has not started yet
+					const size_t seqs_size=batch.seqs.size();
+					const size_t lengths_size=batch.lengths.size();
+					const size_t last=paths.walk(joined_left ? 2*i+1 : 2*i,paths.no_end,batch,mark);
+					if(last<i){
+						batch.seqs.resize(seqs_size);
+						batch.lengths.resize(lengths_size);
+						continue;
+					}
+					upper_ends.set(last);
+					if(batch.is_full()){
+						wait_turn(begin/seeds_chunk);
+						writer.write(batch);
+					}
+				}
+				wait_turn(begin/seeds_chunk);
+				writer.write(batch);
+				{
+					std::lock_guard<std::mutex> lock(turn_mutex);
+					written_chunks++;
 				}
-				kmer_str[k]='\0';
+				turn_cv.notify_all();
+			}
+		};
+		std::vector<std::thread> assemblers;
+		for(int32_t t=1;t<threads;t++){
+			assemblers.emplace_back(assemble_paths);
+		}
+		assemble_paths();
+		for(auto &assembler : assemblers){
+			assembler.join();
+		}
 
-				extending=false;
-				for(const char &c : nucls){
-					kmer_str[k-1]=c;
+		// every cycle is started by its lowest k-mer, all the lower ones have been used
+		contig_batch_t batch;
+		for(size_t i=0;i<kmers_count;i++){
+			if(visited.set(i)){
+				paths.walk(2*i,i,batch,mark);
+				if(batch.is_full()){
+					writer.write(batch);
+				}
+			}
+		}
+		writer.write(batch);
+	}
 
-					encode_canonical(kmer_str, k, nkmer);
+	// all k-mers have been used
+	set.clear();
 
-					if(set.count( nkmer )){
-						//std::cerr << "extending " << c << std::endl;
-						//debug_print_kmer_set(set,k);
-						//std::cerr << std::string(contig.l_ext) << c << std::endl;
-						//std::cerr << std::endl;
-						if(direction==0){
-							contig.r_extend(c);
-						}
-						else{
-							contig.l_extend(c);
-						}
-						set.erase(nkmer);
+	if(verbose){
+		std::cerr << "   assembly finished (" << writer.contig_id << " contigs)" << std::endl;
+	}
 
-						if(!contig.is_full()){
-							extending=true;
-						}
-						break;
-					}
-				}
+	return 0;
+}
+
+
+/*
+	Sets on disk are assembled one by one in memory, as sorted sets: the
+	memory of -M bounds only loading and merging them.
+*/
+template<typename _nkmer_T>
+int assemble(const std::string &fasta_fn, disk_kmer_set_t<_nkmer_T> &set, int32_t k, FILE* fstats, int32_t threads, bool verbose){
+	sorted_kmer_set_t<_nkmer_T> loaded_set;
+	set.load(loaded_set.kmers);
+	set.clear();
+	return assemble(fasta_fn, loaded_set, k, fstats, threads, verbose);
+}
+
+
+/*
+	Save a set as a binary k-mer file instead of assembling it.
+*/
+template<typename _nkmer_T, typename _iterator_T>
+void write_binary_kmers(const std::string &kmers_fn, _iterator_T first, _iterator_T last, size_t count, int32_t k){
+	binary_kmer_writer_t<_nkmer_T> writer(kmers_fn, k, count);
+	for(auto it=first;it!=last;++it){
+		writer.write(*it);
+	}
+}
+
+template<typename _set_T>
+int save_binary(const std::string &kmers_fn, _set_T &set, int32_t k, FILE* fstats, bool verbose){
+	typedef typename _set_T::value_type _nkmer_T;
+	if(fstats){
+		fprintf(fstats,"%s\t%lu\n",kmers_fn.c_str(),set.size());
+	}
+
+	std::vector<_nkmer_T> kmers(set.begin(), set.end());
+	set.clear();
+	radix_sort_kmers(kmers, 2*k);
+	write_binary_kmers<_nkmer_T>(kmers_fn, kmers.cbegin(), kmers.cend(), kmers.size(), k);
+
+	if(verbose){
+		std::cerr << "   saved " << kmers.size() << " k-mers" << std::endl;
+	}
+
+	return 0;
+}
+
+template<typename _nkmer_T>
+int save_binary(const std::string &kmers_fn, sorted_kmer_set_t<_nkmer_T> &set, int32_t k, FILE* fstats, bool verbose){
+	if(fstats){
+		fprintf(fstats,"%s\t%lu\n",kmers_fn.c_str(),set.size());
+	}
+
+	const size_t count=set.size();
+	write_binary_kmers<_nkmer_T>(kmers_fn, set.kmers.cbegin(), set.kmers.cend(), count, k);
+	set.clear();
+
+	if(verbose){
+		std::cerr << "   saved " << count << " k-mers" << std::endl;
+	}
+
+	return 0;
+}
+
+template<typename _nkmer_T>
+int save_binary(const std::string &kmers_fn, disk_kmer_set_t<_nkmer_T> &set, int32_t k, FILE* fstats, bool verbose){
+	if(fstats){
+		fprintf(fstats,"%s\t%lu\n",kmers_fn.c_str(),set.size());
+	}
+
+	const size_t count=set.size();
+	{
+		binary_kmer_writer_t<_nkmer_T> writer(kmers_fn, k, count);
+		if(set.file){
+			kmer_file_reader_t<_nkmer_T> reader(set.file->fn,set.reader_buffer_size(1));
+			for(;!reader.empty();reader.advance()){
+				writer.write(reader.value());
 			}
 		}
+	}
+	set.clear();
+
+	if(verbose){
+		std::cerr << "   saved " << count << " k-mers" << std::endl;
+	}
+
+	return 0;
+}
+
+
+template<typename _set_T>
+int32_t process_sets(const _set_T &empty_set, const std::vector<std::string> &in_fns, const std::vector<std::string> &out_fns,
+		const std::string &intersection_fn, int32_t k, bool compute_intersection, bool compute_output,
+		bool binary_intersection, FILE *fstats, int32_t threads, bool verbose){
+	const int32_t no_sets=in_fns.size();
+	std::vector<_set_T> full_sets(no_sets, empty_set);
+
+	if(verbose){
+		std::cerr << "=====================" << std::endl;
+		std::cerr << "1) Loading references" << std::endl;
+		std::cerr << "=====================" << std::endl;
+	}
+
+
+	std::vector<int32_t> in_sizes;
+	std::vector<int32_t> out_sizes;
+
+	// the files are loaded concurrently, every thread takes the next file not loaded yet
+	std::atomic<int32_t> next_set(0);
+	auto load_sets=[&](){
+		for (int32_t i=next_set++;i<no_sets;i=next_set++){
+			kmers_from_fasta(in_fns[i],full_sets[i],k,verbose);
+		}
+	};
+	std::vector<std::thread> loaders;
+	for(int32_t t=1;t<std::min(threads,no_sets);t++){
+		loaders.emplace_back(load_sets);
+	}
+	load_sets();
+	for(auto &loader : loaders){
+		loader.join();
+	}
 
-		//std::cerr << "====================" << std::endl;
+	for(int32_t i=0;i<no_sets;i++){
+		if(fstats){
+			fprintf(fstats,"%s\t%lu\n",in_fns[i].c_str(),full_sets[i].size());
+		}
+		//debug_print_kmer_set(full_sets[i],k);
+		in_sizes.insert(in_sizes.end(),full_sets[i].size());
+	}
 
-		std::stringstream ss;
-		ss<<"c"<<contig_id;
-		const std::string contig_name(ss.str());
-		contig.print_to_fasta(file,contig_name.c_str());
-		contig_id++;
+	if(verbose){
+		std::cerr << "===============" << std::endl;
+		std::cerr << "2) Intersecting" << std::endl;
+		std::cerr << "===============" << std::endl;
 	}
 
-	fclose(file);
+
+	_set_T intersection(empty_set);
+
+	int32_t intersection_size = 0;
+
+	if(compute_intersection){
+		if (verbose){
+			std::cerr << "2.1) Computing intersection" << std::endl;
+		}
+
+		find_intersection(full_sets, intersection);
+		intersection_size  = intersection.size();
+		if (verbose){
+			std::cerr << "   intersection size: " <<  intersection_size << std::endl;
+		}
+		if(compute_output){
+			if (verbose){
+				std::cerr << "2.2) Removing this intersection from all kmer sets" << std::endl;
+			}
+			remove_subset(full_sets, intersection);
+		}
+	}
+
+	if(compute_output){
+		for (int32_t i=0;i<no_sets;i++){
+			out_sizes.insert(out_sizes.end(),full_sets[i].size());
+			assert(in_sizes[i]==out_sizes[i]+intersection_size);
+			if (verbose){
+				std::cerr << in_sizes[i] << " " << out_sizes[i] << " ...inter:" << intersection_size << std::endl;
+			}
+		}
+	}
 
 	if(verbose){
-		std::cerr << "   assembly finished (" << contig_id << " contigs)" << std::endl;
+		std::cerr << "=============" << std::endl;
+		std::cerr << "3) Assembling" << std::endl;
+		std::cerr << "=============" << std::endl;
+	}
+
+	if(compute_output){
+		for(int32_t i=0;i<static_cast<int32_t>(in_fns.size());i++){
+			assemble(out_fns[i], full_sets[i], k, fstats, threads, verbose);
+		}
+	}
+	if(compute_intersection){
+		if(binary_intersection){
+			save_binary(intersection_fn, intersection, k, fstats, verbose);
+		}
+		else{
+			assemble(intersection_fn, intersection, k, fstats, threads, verbose);
+		}
 	}
 
 	return 0;
+}
 
+
+template<typename _nkmer_T>
+int32_t run_with_sets(bool sorted_sets, size_t memory, const std::string &tmp_dir,
+		const std::vector<std::string> &in_fns, const std::vector<std::string> &out_fns,
+		const std::string &intersection_fn, int32_t k, bool compute_intersection, bool compute_output,
+		bool binary_intersection, FILE *fstats, int32_t threads, bool verbose){
+	if(memory>0){
+		// the files are loaded by all threads at once
+		const disk_kmer_set_t<_nkmer_T> empty_set(k, memory/threads, tmp_dir);
+		return process_sets(empty_set, in_fns, out_fns, intersection_fn, k,
+			compute_intersection, compute_output, binary_intersection, fstats, threads, verbose);
+	}
+	else if(sorted_sets){
+		const sorted_kmer_set_t<_nkmer_T> empty_set;
+		return process_sets(empty_set, in_fns, out_fns, intersection_fn, k,
+			compute_intersection, compute_output, binary_intersection, fstats, threads, verbose);
+	}
+	else{
+		const typename hash_kmer_set<_nkmer_T>::type empty_set;
+		return process_sets(empty_set, in_fns, out_fns, intersection_fn, k,
+			compute_intersection, compute_output, binary_intersection, fstats, threads, verbose);
+	}
 }
 
 
@@ -560,10 +1176,15 @@ int main (int argc, char* argv[])
 	bool compute_intersection=false;
 	bool compute_output=false;
 	bool verbose=true;
+	bool sorted_sets=false;
+	bool binary_intersection=false;
+	int32_t threads=1;
+	size_t memory=0;
+	std::string tmp_dir=getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
 	int32_t no_sets=0;
 
 	int c;
-	while ((c = getopt(argc, (char *const *)argv, "hSi:o:x:s:k:")) >= 0) {
+	while ((c = getopt(argc, (char *const *)argv, "hSVbi:o:x:s:k:t:M:T:")) >= 0) {
 		switch (c) {
 			case 'h': {
 				print_help();
@@ -602,10 +1223,37 @@ int main (int argc, char* argv[])
 
 				break;
 			}
+			case 'V': {
+				sorted_sets=true;
+
+				break;
+			}
+			case 'b': {
+				binary_intersection=true;
+
+				break;
+			}
 			case 'k': {
 				k = atoi(optarg);
 				break;
 			}
+			case 't': {
+				threads = atoi(optarg);
+				break;
+			}
+			case 'M': {
+				const int64_t memory_mb = atoll(optarg);
+				if (memory_mb <= 0){
+					std::cerr << "Memory for k-mer sets (-M) must be positive." << std::endl;
+					return EXIT_FAILURE;
+				}
+				memory = static_cast<size_t>(memory_mb) << 20;
+				break;
+			}
+			case 'T': {
+				tmp_dir = std::string(optarg);
+				break;
+			}
 			case '?': {
 				std::cerr<<"Unknown error"<<std::endl;
 				exit(1);
@@ -626,6 +1274,11 @@ int main (int argc, char* argv[])
 		return EXIT_FAILURE;
 	}
 
+	if (threads <= 0){
+		std::cerr << "Number of threads must be positive." << std::endl;
+		return EXIT_FAILURE;
+	}
+
 	if (compute_output && (static_cast<int32_t>(out_fns.size())!=no_sets)){
 		std::cerr << "If -o is used, it must be used as many times as -i (" << no_sets << "!=" << out_fns.size() << ")." << std::endl;
 		return EXIT_FAILURE;
@@ -640,76 +1293,13 @@ int main (int argc, char* argv[])
 		fprintf(fstats,"\n");
 	}
 
-	std::vector< std::unordered_set<nkmer_t> > full_sets(no_sets);
-
-	if(verbose){
-		std::cerr << "=====================" << std::endl;
-		std::cerr << "1) Loading references" << std::endl;
-		std::cerr << "=====================" << std::endl;
-	}
-
-
-	std::vector<int32_t> in_sizes;
-	std::vector<int32_t> out_sizes;
-
-	for(int32_t i=0;i<no_sets;i++){
-		kmers_from_fasta(in_fns[i],full_sets[i],k,fstats,verbose);
-		//debug_print_kmer_set(full_sets[i],k);
-		in_sizes.insert(in_sizes.end(),full_sets[i].size());
+	if(k<=max_short_kmer_length){
+		run_with_sets<nkmer_t>(sorted_sets, memory, tmp_dir, in_fns, out_fns, intersection_fn, k,
+			compute_intersection, compute_output, binary_intersection, fstats, threads, verbose);
 	}
-
-	if(verbose){
-		std::cerr << "===============" << std::endl;
-		std::cerr << "2) Intersecting" << std::endl;
-		std::cerr << "===============" << std::endl;
-	}
-
-
-	std::unordered_set<nkmer_t> intersection;
-
-	int32_t intersection_size = 0;
-
-	if(compute_intersection){
-		if (verbose){
-			std::cerr << "2.1) Computing intersection" << std::endl;
-		}
-
-		find_intersection(full_sets, intersection);
-		intersection_size  = intersection.size();
-		if (verbose){
-			std::cerr << "   intersection size: " <<  intersection_size << std::endl;
-		}
-		if(compute_output){
-			if (verbose){
-				std::cerr << "2.2) Removing this intersection from all kmer sets" << std::endl;
-			}
-			remove_subset(full_sets, intersection);
-		}
-	}
-
-	if(compute_output){
-		for (int32_t i=0;i<no_sets;i++){
-			out_sizes.insert(out_sizes.end(),full_sets[i].size());
-			assert(in_sizes[i]==out_sizes[i]+intersection_size);
-			if (verbose){
-				std::cerr << in_sizes[i] << " " << out_sizes[i] << " ...inter:" << intersection_size << std::endl;
-			}
-		}
-	}
-
-	if(verbose){
-		std::cerr << "=============" << std::endl;
-		std::cerr << "3) Assembling" << std::endl;
-		std::cerr << "=============" << std::endl;
-	}
-
-	if(compute_output){
-		for(int32_t i=0;i<static_cast<int32_t>(in_fns.size());i++){
-			assemble(out_fns[i], full_sets[i], k, fstats, verbose);
-		}
-	}
-	if(compute_intersection){
-		assemble(intersection_fn, intersection, k, fstats, verbose);
+	else{
+		run_with_sets<long_nkmer_t>(sorted_sets, memory, tmp_dir, in_fns, out_fns, intersection_fn, k,
+			compute_intersection, compute_output, binary_intersection, fstats, threads, verbose);
 	}
 
 	if (fstats){
@@ -0,0 +1,179 @@
+/*
+	Sorted k-mer sets for prophyle_assembler (-V).
+
+	K-mers are collected into a plain vector, radix sorted and deduplicated,
+	so a set takes 8 bytes per k-mer (16 for k > 32) and intersection / subtraction are
+	linear merges instead of hash probes. K-mers are looked up by a binary
+	search within buckets given by their highest bits.
+
+	Author: Karel Brinda <kbrinda@hsph.harvard.edu>
+	Licence: MIT
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+/*
+	LSD radix sort by bytes of the lowest bits, passes with a single bucket are skipped.
+*/
+template<typename _nkmer_T>
+void radix_sort_kmers(std::vector<_nkmer_T> &v, int32_t bits){
+	std::vector<_nkmer_T> buffer(v.size());
+	for (int32_t shift=0; shift<bits; shift+=8){
+		size_t counts[256]={0};
+		for (const auto &x : v){
+			counts[static_cast<uint8_t>(x >> shift)]++;
+		}
+		if (std::count(counts, counts+256, v.size())==1){
+			continue;
+		}
+		size_t offset=0;
+		for (int32_t b=0; b<256; b++){
+			size_t c=counts[b];
+			counts[b]=offset;
+			offset+=c;
+		}
+		for (const auto &x : v){
+			buffer[counts[static_cast<uint8_t>(x >> shift)]++]=x;
+		}
+		v.swap(buffer);
+	}
+}
+
+
+template<typename _nkmer_T>
+struct sorted_kmer_set_t{
+	typedef _nkmer_T value_type;
+
+	/* sorted and unique after finalize() */
+	std::vector<_nkmer_T> kmers;
+
+	/* kmers[buckets[b]..buckets[b+1]) are the k-mers with the highest bits equal to b */
+	std::vector<size_t> buckets;
+	int32_t bucket_shift;
+
+	sorted_kmer_set_t(): bucket_shift(0) {}
+
+	void clear(){
+		std::vector<_nkmer_T>().swap(kmers);
+		std::vector<size_t>().swap(buckets);
+	}
+
+	/* only appends, finalize() must be called before the set is used */
+	void insert(_nkmer_T nkmer){
+		kmers.push_back(nkmer);
+	}
+
+	void finalize(int32_t k){
+		radix_sort_kmers(kmers, 2*k);
+		kmers.erase(std::unique(kmers.begin(), kmers.end()), kmers.end());
+		kmers.shrink_to_fit();
+	}
+
+	size_t size() const {
+		return kmers.size();
+	}
+
+	/* must be called before find(), about one k-mer per bucket */
+	void build_index(int32_t k){
+		int32_t bucket_bits=0;
+		while (bucket_bits<max_bucket_bits && bucket_bits<2*k && (size_t(1) << (bucket_bits+1)) <= kmers.size()){
+			bucket_bits++;
+		}
+		bucket_shift=2*k-bucket_bits;
+		buckets.assign((size_t(1) << bucket_bits)+1, 0);
+		for (const auto &x : kmers){
+			buckets[bucket(x)+1]++;
+		}
+		for (size_t b=1; b<buckets.size(); b++){
+			buckets[b]+=buckets[b-1];
+		}
+	}
+
+	/* index of the k-mer, or size() if it is not in the set */
+	size_t find(_nkmer_T nkmer) const {
+		const size_t b=bucket(nkmer);
+		auto first=kmers.cbegin()+buckets[b];
+		auto last=kmers.cbegin()+buckets[b+1];
+		auto it=std::lower_bound(first, last, nkmer);
+		if (it==last || *it!=nkmer){
+			return kmers.size();
+		}
+		return it-kmers.cbegin();
+	}
+
+private:
+	static const int32_t max_bucket_bits=24;
+
+	/* a set of less than 2 k-mers has a single bucket, the shift could then be the width of the type */
+	size_t bucket(_nkmer_T nkmer) const {
+		return bucket_shift<static_cast<int32_t>(8*sizeof(_nkmer_T)) ? static_cast<size_t>(nkmer >> bucket_shift) : 0;
+	}
+};
+
+
+/*
+	Multi-way merge: every set is scanned once, the smallest one drives the scan.
+*/
+template<typename _nkmer_T>
+int32_t find_intersection(const std::vector<sorted_kmer_set_t<_nkmer_T>> &sets, sorted_kmer_set_t<_nkmer_T> &intersection){
+	assert(sets.size()>0);
+
+	size_t i_min=0;
+	for (size_t i=1; i<sets.size(); i++){
+		if (sets[i].kmers.size()<sets[i_min].kmers.size()){
+			i_min=i;
+		}
+	}
+
+	intersection.clear();
+	std::vector<size_t> positions(sets.size(), 0);
+	for (const auto &nkmer : sets[i_min].kmers){
+		bool everywhere=true;
+		for (size_t i=0; i<sets.size(); i++){
+			const auto &kmers=sets[i].kmers;
+			size_t &p=positions[i];
+			while (p<kmers.size() && kmers[p]<nkmer){
+				p++;
+			}
+			if (p==kmers.size()){
+				return 0;
+			}
+			if (kmers[p]!=nkmer){
+				everywhere=false;
+			}
+		}
+		if (everywhere){
+			intersection.kmers.push_back(nkmer);
+		}
+	}
+
+	return 0;
+}
+
+
+template<typename _nkmer_T>
+int32_t remove_subset(std::vector<sorted_kmer_set_t<_nkmer_T>> &sets, const sorted_kmer_set_t<_nkmer_T> &subset){
+	const auto &removed=subset.kmers;
+
+	for (auto &current_set : sets){
+		auto &kmers=current_set.kmers;
+		size_t p=0;
+		size_t kept=0;
+		for (size_t i=0; i<kmers.size(); i++){
+			while (p<removed.size() && removed[p]<kmers[i]){
+				p++;
+			}
+			if (p==removed.size() || removed[p]!=kmers[i]){
+				kmers[kept++]=kmers[i];
+			}
+		}
+		kmers.resize(kept);
+	}
+
+	return 0;
+}
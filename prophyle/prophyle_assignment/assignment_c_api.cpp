@@ -0,0 +1,104 @@
+#include "assignment_c_api.h"
+#include "tree_index.h"
+#include "read_processor.h"
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <vector>
+
+namespace {
+
+char* copy_to_c_string(const std::string& str) {
+  char* c_str = static_cast<char*>(malloc(str.length() + 1));
+  memcpy(c_str, str.c_str(), str.length() + 1);
+  return c_str;
+}
+
+}
+
+struct assignment_s {
+  assignment_s(const std::string& newick_fn, size_t k, AssignmentOutputFormat format, Measure measure,
+      bool simulate_lca, bool annotate, bool tie_lca, bool not_translate_blocks):
+      tree(newick_fn),
+      k(k),
+      format(format),
+      measure(measure),
+      simulate_lca(simulate_lca),
+      annotate(annotate),
+      tie_lca(tie_lca),
+      not_translate_blocks(not_translate_blocks) {}
+
+  TreeIndex tree;
+  size_t k;
+  AssignmentOutputFormat format;
+  Measure measure;
+  bool simulate_lca;
+  bool annotate;
+  bool tie_lca;
+  bool not_translate_blocks;
+};
+
+struct read_assigner_s {
+  explicit read_assigner_s(const assignment_s* assignment):
+      assignment(assignment),
+      read_processor(assignment->tree, assignment->k, assignment->simulate_lca, assignment->annotate,
+          assignment->tie_lca, assignment->not_translate_blocks) {}
+
+  const assignment_s* assignment;
+  ReadProcessor read_processor;
+  std::vector<KmerBlock> blocks;
+  std::vector<int32_t> nodes;
+};
+
+assignment_t* assignment_init(const char* newick_fn, int32_t k, int32_t format, int32_t measure,
+    int32_t simulate_lca, int32_t annotate, int32_t tie_lca, int32_t not_translate_blocks) {
+  return new assignment_s(newick_fn, static_cast<size_t>(k),
+      format == ASSIGNMENT_FORMAT_SAM ? AssignmentOutputFormat::Sam : AssignmentOutputFormat::Kraken,
+      measure == ASSIGNMENT_MEASURE_H1 ? Measure::H1 : Measure::C1,
+      simulate_lca, annotate, tie_lca, not_translate_blocks);
+}
+
+void assignment_destroy(assignment_t* assignment) {
+  delete assignment;
+}
+
+int32_t assignment_id_by_name(const assignment_t* assignment, const char* node_name) {
+  return assignment->tree.id_by_name(node_name);
+}
+
+char* assignment_header(const assignment_t* assignment) {
+  std::ostringstream out;
+  if (assignment->format == AssignmentOutputFormat::Sam) {
+    ReadProcessor read_processor(assignment->tree, assignment->k, assignment->simulate_lca, assignment->annotate,
+        assignment->tie_lca, assignment->not_translate_blocks);
+    read_processor.print_sam_header(out);
+  }
+  return copy_to_c_string(out.str());
+}
+
+read_assigner_t* read_assigner_init(const assignment_t* assignment) {
+  return new read_assigner_s(assignment);
+}
+
+void read_assigner_destroy(read_assigner_t* read_assigner) {
+  delete read_assigner;
+}
+
+const char* read_assigner_process(read_assigner_t* read_assigner, const char* read_name, int32_t read_length,
+    int32_t blocks_count, const assignment_block_t* blocks, int32_t nodes_count, const int32_t* nodes,
+    const char* krakmers, const char* read, const char* qualities, size_t* records_length) {
+  read_assigner->blocks.resize(blocks_count);
+  for (int32_t i = 0; i < blocks_count; ++i) {
+    KmerBlock& block = read_assigner->blocks[i];
+    block.length = blocks[i].length;
+    block.nodes_offset = blocks[i].nodes_offset;
+    block.nodes_count = blocks[i].nodes_count;
+    block.ambiguous = blocks[i].ambiguous;
+  }
+  read_assigner->nodes.assign(nodes, nodes + nodes_count);
+  const assignment_s* assignment = read_assigner->assignment;
+  StringPiece records = read_assigner->read_processor.process_read(read_name, static_cast<size_t>(read_length),
+      read_assigner->blocks, read_assigner->nodes, krakmers, read, qualities, assignment->format, assignment->measure);
+  *records_length = records.length;
+  return records.data;
+}
@@ -0,0 +1,51 @@
+/*
+	C interface to read assignment, used by prophyle_index classify to assign reads in-process.
+	Licence: MIT
+*/
+
+#ifndef ASSIGNMENT_C_API_H
+#define ASSIGNMENT_C_API_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ASSIGNMENT_FORMAT_SAM 0
+#define ASSIGNMENT_FORMAT_KRAKEN 1
+
+#define ASSIGNMENT_MEASURE_H1 0
+#define ASSIGNMENT_MEASURE_C1 1
+
+typedef struct assignment_s assignment_t;
+typedef struct read_assigner_s read_assigner_t;
+
+/* block of consecutive k-mers with the same matching nodes, nodes are given by tree ids */
+typedef struct {
+	int32_t length;
+	int32_t nodes_offset;
+	int32_t nodes_count;
+	int32_t ambiguous;
+} assignment_block_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	assignment_t* assignment_init(const char* newick_fn, int32_t k, int32_t format, int32_t measure,
+		int32_t simulate_lca, int32_t annotate, int32_t tie_lca, int32_t not_translate_blocks);
+	void assignment_destroy(assignment_t* assignment);
+	int32_t assignment_id_by_name(const assignment_t* assignment, const char* node_name);
+	char* assignment_header(const assignment_t* assignment);
+
+	read_assigner_t* read_assigner_init(const assignment_t* assignment);
+	void read_assigner_destroy(read_assigner_t* read_assigner);
+	/* the returned records (records_length bytes, not terminated) are owned by the assigner and valid until
+	   its next read; krakmers are used only by the Kraken-like format */
+	const char* read_assigner_process(read_assigner_t* read_assigner, const char* read_name, int32_t read_length,
+		int32_t blocks_count, const assignment_block_t* blocks, int32_t nodes_count, const int32_t* nodes,
+		const char* krakmers, const char* read, const char* qualities, size_t* records_length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ASSIGNMENT_C_API_H
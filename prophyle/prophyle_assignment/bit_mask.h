@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+// Fixed-size set of positions of a read stored as 64-bit words; bits past size() are always 0.
+class BitMask {
+public:
+  // clears the mask and sets its size, the words are reused between reads
+  void reset(size_t size) {
+    size_ = size;
+    words_.assign(words_count(size), 0);
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  bool test(size_t position) const {
+    return (words_[position / kWordBits] >> (position % kWordBits)) & 1;
+  }
+
+  // sets positions [from, to)
+  void set_range(size_t from, size_t to) {
+    if (from >= to) {
+      return;
+    }
+    size_t first_word = from / kWordBits;
+    size_t last_word = (to - 1) / kWordBits;
+    uint64_t first_mask = ~uint64_t(0) << (from % kWordBits);
+    uint64_t last_mask = ~uint64_t(0) >> (kWordBits - 1 - (to - 1) % kWordBits);
+    if (first_word == last_word) {
+      words_[first_word] |= first_mask & last_mask;
+      return;
+    }
+    words_[first_word] |= first_mask;
+    for (size_t word = first_word + 1; word < last_word; ++word) {
+      words_[word] = ~uint64_t(0);
+    }
+    words_[last_word] |= last_mask;
+  }
+
+  // masks of the same read have the same size
+  BitMask& operator|=(const BitMask& other) {
+    for (size_t word = 0; word < words_.size(); ++word) {
+      words_[word] |= other.words_[word];
+    }
+    return *this;
+  }
+
+  int32_t count() const {
+    int32_t count = 0;
+    for (auto word : words_) {
+      count += __builtin_popcountll(word);
+    }
+    return count;
+  }
+
+  // first position after from with a value different from the one at from, or size()
+  size_t run_end(size_t from) const {
+    uint64_t flip = test(from) ? ~uint64_t(0) : 0;
+    size_t word = from / kWordBits;
+    uint64_t bits = (words_[word] ^ flip) & (~uint64_t(0) << (from % kWordBits));
+    while (bits == 0) {
+      if (++word == words_.size()) {
+        return size_;
+      }
+      bits = words_[word] ^ flip;
+    }
+    size_t position = word * kWordBits + __builtin_ctzll(bits);
+    return position < size_ ? position : size_;
+  }
+
+private:
+  static constexpr size_t kWordBits = 64;
+
+  static size_t words_count(size_t size) {
+    return (size + kWordBits - 1) / kWordBits;
+  }
+
+  std::vector<uint64_t> words_;
+  size_t size_ = 0;
+};
@@ -11,7 +11,7 @@ typedef struct {
 
 static inline char *add_node(const char *s, knaux_t *aux, int x)
 {
-	char *p, *nbeg, *nend = 0;
+	char *p, *nbeg, *nend = 0, *tbeg = 0, *tend = 0;
 	knhx1_t *r;
 	if (aux->n == aux->max) {
 		aux->max = aux->max? aux->max<<1 : 8;
@@ -22,11 +22,13 @@ static inline char *add_node(const char *s, knaux_t *aux, int x)
 	for (p = (char*)s, nbeg = p, r->d = -1.0; *p && *p != ',' && *p != ')'; ++p) {
 		if (*p == '[') {
 			if (nend == 0) nend = p;
+			if (tbeg == 0) tbeg = p + 1;
 			do ++p; while (*p && *p != ']');
 			if (*p == 0) {
 				aux->error |= KNERR_BRACKET;
 				break;
 			}
+			tend = p;
 		} else if (*p == ':') {
 			if (nend == 0) nend = p;
 			r->d = strtod(p + 1, &p);
@@ -38,6 +40,10 @@ static inline char *add_node(const char *s, knaux_t *aux, int x)
 		r->name = (char*)calloc(nend - nbeg + 1, 1);
 		strncpy(r->name, nbeg, nend - nbeg);
 	} else r->name = strdup("");
+	if (tend != 0) {
+		r->tags = (char*)calloc(tend - tbeg + 1, 1);
+		strncpy(r->tags, tbeg, tend - tbeg);
+	} else r->tags = 0;
 	return p;
 }
 
@@ -15,6 +15,7 @@ typedef struct {
 	int *child;
 	char *name;
 	double d;
+	char *tags; // content of the node's [...] comment (NHX tags), NULL if there is none
 } knhx1_t;
 
 #ifndef KSTRING_T
@@ -3,8 +3,14 @@
 #include "word_splitter.h"
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <thread>
+#include <algorithm>
 #include <getopt.h>
 
+// number of kraklines processed by one thread at a time
+constexpr size_t kLinesPerThread = 4096;
+
 struct Arguments {
   size_t k;
   std::string input_file = "-";
@@ -15,6 +21,7 @@ struct Arguments {
   bool annotate = false;
   bool tie_lca = false;
   bool not_translate_blocks = false;
+  int32_t threads = 1;
 };
 
 void print_usage() {
@@ -27,12 +34,13 @@ void print_usage() {
   std::cerr << "Options: newick_fn     STR                          phylogenetic tree (Newick/NHX)" << std::endl;
   std::cerr << "         k             INT                          k-mer length" << std::endl;
   std::cerr << "         input_file    STR                          assignments in generalized Kraken format" << std::endl;
-  std::cerr << "         -f            sam, kraken                  format of output [default:sam]" << std::endl;
+  std::cerr << "         -f            sam, kraken, bin             format of output [default:sam]" << std::endl;
   std::cerr << "         -m            h1=hitnumber, c1=coverage    measure [default:h1]" << std::endl;
   std::cerr << "         -A                                         annotate assignments" << std::endl;
   std::cerr << "         -L                                         use LCA when tie (multiple hits with the same score)" << std::endl;
   std::cerr << "         -X                                         replace k-mer matches by their LCA" << std::endl;
   std::cerr << "         -D                                         do not translate blocks from node to tax IDs" << std::endl;
+  std::cerr << "         -t            INT                          number of threads [default:1]" << std::endl;
   std::cerr << std::endl;
 }
 
@@ -53,7 +61,7 @@ Arguments parse_arguments(int argc, char *argv[]) {
   int32_t c;
   int index;
   Arguments arguments;
-  while ((c = getopt(argc, argv, "f:m:XALD")) >= 0) {
+  while ((c = getopt(argc, argv, "f:m:XALDt:")) >= 0) {
     switch (c) {
       case 'f': {
         std::string format_str(optarg);
@@ -61,8 +69,10 @@ Arguments parse_arguments(int argc, char *argv[]) {
           arguments.format = AssignmentOutputFormat::Sam;
         } else if (format_str == "kraken") {
           arguments.format = AssignmentOutputFormat::Kraken;
+        } else if (format_str == "bin") {
+          arguments.format = AssignmentOutputFormat::Binary;
         } else {
-          std::cerr << "assignment format should be sam or kraken" << std::endl;
+          std::cerr << "assignment format should be sam, kraken or bin" << std::endl;
           exit(1);
         }
         break;
@@ -83,6 +93,14 @@ Arguments parse_arguments(int argc, char *argv[]) {
       case 'A': arguments.annotate = true; break;
       case 'L': arguments.tie_lca = true; break;
       case 'D': arguments.not_translate_blocks = true; break;
+      case 't': {
+        if (!is_integer_without_sign(std::string(optarg)) || std::stoi(optarg) <= 0) {
+          std::cerr << "number of threads should be > 0, but t = " << optarg << std::endl;
+          exit(1);
+        }
+        arguments.threads = std::stoi(optarg);
+        break;
+      }
       default: {
         std::cerr << "argument " << c << " is not supported" << std::endl;
         exit(1);
@@ -109,34 +127,100 @@ Arguments parse_arguments(int argc, char *argv[]) {
   return arguments;
 }
 
+// Kraklines are read in batches, every thread assigns a contiguous part of the batch to its own
+// buffer and the buffers are written in the order of the input. The previous batch is written and
+// the next one is read while the current one is being assigned.
+void process_kraklines_parallel(std::vector<ReadProcessor>& read_processors, const Arguments& arguments,
+    std::istream& input) {
+  size_t threads = read_processors.size();
+  size_t batch_size = threads * kLinesPerThread;
+  std::vector<std::string> lines[2];
+  std::vector<std::ostringstream> outputs[2];
+  outputs[0].resize(threads);
+  outputs[1].resize(threads);
+  std::vector<std::thread> workers;
+  auto read_batch = [batch_size, &input](std::vector<std::string>& batch) {
+    batch.resize(batch_size);
+    size_t lines_count = 0;
+    while (lines_count < batch_size && getline(input, batch[lines_count])) {
+      lines_count++;
+    }
+    batch.resize(lines_count);
+  };
+  auto write_outputs = [](std::vector<std::ostringstream>& thread_outputs) {
+    for (auto& thread_output : thread_outputs) {
+      std::cout << thread_output.str();
+      thread_output.str("");
+    }
+  };
+  size_t current = 0;
+  read_batch(lines[current]);
+  bool has_previous = false;
+  while (!lines[current].empty()) {
+    const auto& batch = lines[current];
+    auto& batch_outputs = outputs[current];
+    size_t lines_per_thread = (batch.size() + threads - 1) / threads;
+    for (size_t tid = 0; tid < threads; ++tid) {
+      size_t from = std::min(batch.size(), tid * lines_per_thread);
+      size_t to = std::min(batch.size(), from + lines_per_thread);
+      workers.emplace_back([&, tid, from, to]() {
+        for (size_t i = from; i < to; ++i) {
+          read_processors[tid].process_krakline(batch[i], arguments.format, arguments.criteria, batch_outputs[tid]);
+        }
+      });
+    }
+    size_t next = 1 - current;
+    if (has_previous) {
+      write_outputs(outputs[next]);
+    }
+    read_batch(lines[next]);
+    for (auto& worker : workers) {
+      worker.join();
+    }
+    workers.clear();
+    has_previous = true;
+    current = next;
+  }
+  if (has_previous) {
+    write_outputs(outputs[1 - current]);
+  }
+}
+
 int main(int argc, char *argv[]) {
   Arguments arguments = parse_arguments(argc, argv);
   TreeIndex tree = TreeIndex(arguments.newick_file);
-  ReadProcessor read_processor = ReadProcessor(tree, arguments.k, arguments.simulate_lca, arguments.annotate,
-      arguments.tie_lca, arguments.not_translate_blocks);
+  // the tree is shared, every thread assigns with its own processor
+  std::vector<ReadProcessor> read_processors;
+  for (int32_t tid = 0; tid < arguments.threads; ++tid) {
+    read_processors.emplace_back(tree, arguments.k, arguments.simulate_lca, arguments.annotate,
+        arguments.tie_lca, arguments.not_translate_blocks);
+  }
 
+  // iostreams synchronized with stdio lock for every character once there are several threads
+  std::ios_base::sync_with_stdio(false);
+  std::ifstream input_file;
   if (arguments.input_file != "-") {
-    freopen(arguments.input_file.c_str(), "r", stdin);
+    input_file.open(arguments.input_file);
+    if (!input_file) {
+      std::cerr << "cannot open " << arguments.input_file << std::endl;
+      exit(1);
+    }
   }
+  std::istream& input = arguments.input_file != "-" ? input_file : std::cin;
 
   if (arguments.format == AssignmentOutputFormat::Sam) {
-    read_processor.print_sam_header(std::cout);
+    read_processors[0].print_sam_header(std::cout);
+  } else if (arguments.format == AssignmentOutputFormat::Binary) {
+    read_processors[0].print_binary_header(std::cout);
   }
-  std::string line;
-  while (getline(std::cin, line)) {
-    read_processor.process_krakline(line, arguments.format, arguments.criteria);
+  if (arguments.threads == 1) {
+    std::string line;
+    while (getline(input, line)) {
+      read_processors[0].process_krakline(line, arguments.format, arguments.criteria, std::cout);
+    }
+  } else {
+    process_kraklines_parallel(read_processors, arguments, input);
   }
 
-//  std::string krakline = "U\tread1\t0\t60\tn001:21 n001,n154:1 n001:8 n001,n410:1 n001:12 n001,n151:1 n001:1";
-//  read_processor.process_krakline(krakline, arguments.format, arguments.criteria);
-//  krakline = "U\tread2\t0\t37\tn001:3 n001,n023:2 n001:1 n001,n154,n176:1 n001,n176:2 n001,n154,n176:4 n001,n176:2 n001,n154,n176:4 n001,n176:1 n001:2";
-//  read_processor.process_krakline(krakline, arguments.format, arguments.criteria);
-//  krakline = "U\tread3\t0\t60\tn002:20 0:11 n006:7 n006,n134:1 n006:6";
-//  read_processor.process_krakline(krakline, arguments.format, arguments.criteria);
-//  krakline = "U\tread4\t0\t60\tn175,n199,n223,n271,n272,n287,n293,n307,n323,n329,n332,n348,n354,n355,n358:45";
-//  read_processor.process_krakline(krakline, arguments.format, arguments.criteria);
-//  krakline = "U\tread5\t0\t60\t0:45U";
-//  read_processor.process_krakline(krakline, arguments.format, arguments.criteria);
-
   return 0;
 }
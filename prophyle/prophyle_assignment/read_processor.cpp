@@ -5,20 +5,41 @@
 #include <sstream>
 #include <iostream>
 #include <string.h>
+#include <algorithm>
 
 namespace {
 
-int32_t ones_count(const std::vector<int16_t> &values, size_t size) {
-  int32_t count = 0;
-  for (size_t i = 0; i < size; ++i) {
-    count += values[i];
+void append(std::string& buffer, StringPiece piece) {
+  buffer.append(piece.data, piece.length);
+}
+
+void append_number(std::string& buffer, size_t value) {
+  char digits[20];
+  size_t length = 0;
+  do {
+    digits[length++] = '0' + value % 10;
+    value /= 10;
+  } while (value > 0);
+  while (length > 0) {
+    buffer += digits[--length];
+  }
+}
+
+void append_uint32(std::string& buffer, uint32_t value) {
+  for (int byte = 0; byte < 4; ++byte) {
+    buffer += static_cast<char>((value >> (8 * byte)) & 0xff);
   }
-  return count;
 }
 
 }
 
 constexpr size_t ReadProcessor::kFakeContigLength;
+constexpr int32_t ReadProcessor::kNoBlock;
+constexpr int32_t ReadProcessor::kUnmatchedBlock;
+constexpr int32_t ReadProcessor::kAmbiguousBlock;
+constexpr char ReadProcessor::kBinaryMagic[];
+constexpr uint32_t ReadProcessor::kBinaryVersion;
+constexpr uint32_t ReadProcessor::kBinarySameRead;
 
 ReadProcessor::ReadProcessor(const TreeIndex& tree, size_t k, bool simulate_lca, bool annotate,
     bool tie_lca, bool not_translate_blocks):
@@ -28,20 +49,39 @@ ReadProcessor::ReadProcessor(const TreeIndex& tree, size_t k, bool simulate_lca,
     annotate_(annotate),
     tie_lca_(tie_lca),
     not_translate_blocks_(not_translate_blocks),
-    hit_masks_(tree_.nodes_count()),
-    coverage_masks_(tree_.nodes_count()) {
-  if (simulate_lca_) {
-    std::cerr << "simulating lca is not supported yet" << std::endl;
-    exit(1);
-  }
-  if (tie_lca_) {
-    std::cerr << "tie lca is not supported yet" << std::endl;
-    exit(1);
-  }
+    mask_ids_(tree_.nodes_count(), -1),
+    masks_count_(0),
+    tie_solved_(false) {
 }
 
-void ReadProcessor::process_krakline(const std::string& krakline, AssignmentOutputFormat format, Measure criteria) {
+void ReadProcessor::process_krakline(const std::string& krakline, AssignmentOutputFormat format, Measure criteria,
+    std::ostream& out) {
   load_krakline(krakline);
+  assign(format, criteria, out);
+}
+
+StringPiece ReadProcessor::process_read(StringPiece read_name, size_t read_length, const std::vector<KmerBlock>& blocks,
+    const std::vector<int32_t>& block_nodes, StringPiece krakmers, StringPiece read, StringPiece qualities,
+    AssignmentOutputFormat format, Measure criteria) {
+  read_name_ = read_name;
+  read_length_ = read_length;
+  krakmers_ = krakmers;
+  read_ = read;
+  qualities_ = qualities;
+  fill_masks_from_kmer_blocks(blocks, block_nodes);
+  assign_records(format, criteria);
+  return StringPiece(output_);
+}
+
+void ReadProcessor::assign(AssignmentOutputFormat format, Measure criteria, std::ostream& out) {
+  assign_records(format, criteria);
+  out.write(output_.data(), output_.size());
+}
+
+void ReadProcessor::assign_records(AssignmentOutputFormat format, Measure criteria) {
+  output_.clear();
+  // ties are reported in the order of node ids
+  std::sort(matching_nodes_.begin(), matching_nodes_.end());
   propagate_matching_kmers();
   filter_assignments();
   print_assignments(format, criteria);
@@ -51,8 +91,7 @@ void ReadProcessor::process_krakline(const std::string& krakline, AssignmentOutp
 void ReadProcessor::filter_assignments() {
   best_hit_ = -1;
   for (auto node_id : matching_nodes_) {
-    auto& hit_mask = hit_masks_[node_id];
-    auto hit = ones_count(hit_mask, hit_mask_size());
+    auto hit = hit_masks_[mask_ids_[node_id]].count();
     if (hit > best_hit_) {
       best_hit_ = hit;
       best_hit_nodes_.clear();
@@ -63,8 +102,7 @@ void ReadProcessor::filter_assignments() {
   }
   best_coverage_ = -1;
   for (auto node_id : matching_nodes_) {
-    auto& coverage_mask = coverage_masks_[node_id];
-    auto coverage = ones_count(coverage_mask, coverage_mask_size());
+    auto coverage = coverage_masks_[mask_ids_[node_id]].count();
     if (coverage > best_coverage_) {
       best_coverage_ = coverage;
       best_coverage_nodes_.clear();
@@ -76,35 +114,44 @@ void ReadProcessor::filter_assignments() {
 }
 
 void ReadProcessor::print_assignments(AssignmentOutputFormat format, Measure criteria) {
-  std::vector<int32_t> best_matching_nodes;
-  if (criteria == Measure::H1) {
-    best_matching_nodes = best_hit_nodes_;
-  } else {
-    best_matching_nodes = best_coverage_nodes_;
-  }
-  bool tie_solved = false;
-  if (tie_lca_ && best_matching_nodes.size() > 1) {
-    std::cerr << "tie_lca is not implemented yet" << std::endl;
-    exit(1);
+  const std::vector<int32_t>& best_nodes = criteria == Measure::H1 ? best_hit_nodes_ : best_coverage_nodes_;
+  const int32_t* best_matching_nodes = best_nodes.data();
+  size_t best_matching_nodes_count = best_nodes.size();
+  int32_t lca = -1;
+  tie_solved_ = false;
+  if (tie_lca_ && best_matching_nodes_count > 1) {
+    lca = nodes_lca(best_matching_nodes, best_matching_nodes_count);
+    best_matching_nodes = &lca;
+    best_matching_nodes_count = 1;
+    tie_solved_ = true;
   }
-  if (best_matching_nodes.size() > 0) {
-    for (auto id : best_matching_nodes) {
+  if (best_matching_nodes_count > 0) {
+    for (size_t i = 0; i < best_matching_nodes_count; ++i) {
+      int32_t id = best_matching_nodes[i];
       if (format == AssignmentOutputFormat::Sam) {
-        if (!tie_solved) {
-          fill_cigar(hit_masks_[id], hit_mask_size(), hit_cigar_);
-          fill_cigar(coverage_masks_[id], coverage_mask_size(), coverage_cigar_);
+        if (tie_solved_) {
+          // the LCA keeps the score of the winners but has no masks of its own
+          coverage_cigar_ = "*";
+          hit_cigar_.clear();
+        } else {
+          fill_cigar(hit_masks_[mask_ids_[id]], hit_cigar_);
+          fill_cigar(coverage_masks_[mask_ids_[id]], coverage_cigar_);
         }
         // add annotations
-        print_sam_line(id, annotate_ ? tree_.joined_tags(id) : "");
+        print_sam_line(id, annotate_ ? StringPiece(tree_.joined_tags(id)) : StringPiece());
       } else if (format == AssignmentOutputFormat::Kraken) {
         print_kraken_line(id);
+      } else if (format == AssignmentOutputFormat::Binary) {
+        print_binary_record(id, i > 0);
       }
     }
   } else {
     if (format == AssignmentOutputFormat::Sam) {
-      print_sam_line(-1);
+      print_sam_line(-1, StringPiece());
     } else if (format == AssignmentOutputFormat::Kraken) {
       print_kraken_line(-1);
+    } else if (format == AssignmentOutputFormat::Binary) {
+      print_binary_record(-1, false);
     }
   }
 }
@@ -128,42 +175,81 @@ void ReadProcessor::print_sam_header(std::ostream& out) const {
   }
 }
 
-void ReadProcessor::print_sam_line(int32_t id, const std::string& suffix, std::ostream& out) {
-  out << read_name_ << "\t";
+void ReadProcessor::print_sam_line(int32_t id, StringPiece suffix) {
+  append(output_, read_name_);
+  output_ += '\t';
   if (id == -1) {
-    out << "4\t*\t0\t0\t*\t";
+    output_ += "4\t*\t0\t0\t*\t";
   } else {
     const knhx1_t* node = tree_.node_by_id(id);
-    out << "0\t" << node->name << "\t1\t60\t" << coverage_cigar_ << "\t";
+    output_ += "0\t";
+    output_ += node->name;
+    output_ += "\t1\t60\t";
+    output_ += coverage_cigar_;
+    output_ += '\t';
   }
-  out << "*\t0\t0\t" << read_ << "\t" << qualities_ << "\t";
+  output_ += "*\t0\t0\t";
+  append(output_, read_);
+  output_ += '\t';
+  append(output_, qualities_);
+  output_ += '\t';
   if (id != -1) {
-    out << "h1:i:" << best_hit_ << "\t";
-    out << "c1:i:" << best_coverage_ << "\t";
-    out << "hc:Z:" << hit_cigar_;
+    output_ += "h1:i:";
+    append_number(output_, best_hit_);
+    output_ += "\tc1:i:";
+    append_number(output_, best_coverage_);
+    if (!tie_solved_) {
+      output_ += "\thc:Z:";
+      output_ += hit_cigar_;
+    }
   }
-  out << suffix << "\n";
+  append(output_, suffix);
+  output_ += '\n';
 }
 
-void ReadProcessor::print_kraken_line(int32_t id, std::ostream& out) {
-  if (simulate_lca_) {
-    std::cerr << "simulate_lca_ is not implemented yet" << std::endl;
-    exit(1);
-  }
+void ReadProcessor::print_kraken_line(int32_t id) {
   if (id == -1) {
-    out << "U\t";
+    output_ += "U\t";
   } else {
-    out << "C\t";
+    output_ += "C\t";
   }
-  out << read_name_ << "\t";
+  append(output_, read_name_);
+  output_ += '\t';
   if (id == -1) {
-    out << "0\t";
+    output_ += "0\t";
   } else {
     const knhx1_t* node = tree_.node_by_id(id);
-    out << node->name << "\t";
+    output_ += node->name;
+    output_ += '\t';
+  }
+  append_number(output_, read_length_);
+  output_ += '\t';
+  append(output_, krakmers_);
+  output_ += '\n';
+}
+
+void ReadProcessor::print_binary_header(std::ostream& out) const {
+  std::string header(kBinaryMagic);
+  append_uint32(header, kBinaryVersion);
+  append_uint32(header, tree_.nodes_count());
+  for (int32_t id = 0; id < tree_.nodes_count(); ++id) {
+    const char* name = tree_.node_by_id(id)->name;
+    size_t length = strlen(name);
+    append_uint32(header, length);
+    header.append(name, length);
   }
-  out << read_length_ << "\t";
-  out << krakmers_ << "\n";
+  out.write(header.data(), header.size());
+}
+
+void ReadProcessor::print_binary_record(int32_t id, bool same_read) {
+  // records of a read are consecutive, so the read of a record is given by its position
+  uint32_t node = static_cast<uint32_t>(id + 1);
+  if (same_read) {
+    node |= kBinarySameRead;
+  }
+  append_uint32(output_, node);
+  append_uint32(output_, id == -1 ? 0 : best_hit_);
+  append_uint32(output_, id == -1 ? 0 : best_coverage_);
 }
 
 void ReadProcessor::clear() {
@@ -174,77 +260,144 @@ void ReadProcessor::clear() {
 }
 
 void ReadProcessor::load_krakline(const std::string& krakline) {
-  // std::cerr << "process krakline: " << krakline << std::endl;
-  std::vector<std::string> parts = split(krakline, '\t');
+  // the fields are only referenced, the krakline lives until the read is assigned
+  constexpr size_t kMaxParts = 8;
+  StringPiece parts[kMaxParts];
+  size_t parts_count = 0;
+  WordSplitter splitter(krakline, '\t');
+  while (parts_count < kMaxParts && splitter.next(parts[parts_count])) {
+    parts_count++;
+  }
+  if (parts_count < 5 || !parse_size(parts[3], read_length_)) {
+    std::cerr << "wrong krakline: " << krakline << std::endl;
+    exit(1);
+  }
   read_name_ = parts[1];
-  read_length_ = std::stoi(parts[3]);
   krakmers_ = parts[4];
-  if (parts.size() == 7) {
+  if (parts_count == 7) {
     read_ = parts[5];
     qualities_ = parts[6];
   } else {
     read_ = "*";
     qualities_ = "*";
   }
-  fill_masks_from_kmer_blocks();
+  parse_kmer_blocks();
+  fill_masks_from_kmer_blocks(blocks_, block_nodes_);
 }
 
 void ReadProcessor::propagate_matching_kmers() {
-  for (auto id : matching_nodes_) {
-    for (auto upper_node_id : tree_.upper_nodes(id)) {
-      if (matching_nodes_.count(upper_node_id) > 0) {
-        copy_masks(upper_node_id, id);
-      }
+  // in preorder, the matching ancestors of a node are on the stack when it is visited and the
+  // masks of the nearest one already contain the masks of the others
+  preorder_matching_nodes_.assign(matching_nodes_.begin(), matching_nodes_.end());
+  std::sort(preorder_matching_nodes_.begin(), preorder_matching_nodes_.end(),
+      [this](int32_t first, int32_t second) { return tree_.entry_time(first) < tree_.entry_time(second); });
+  ancestors_stack_.clear();
+  for (auto id : preorder_matching_nodes_) {
+    while (!ancestors_stack_.empty() && !tree_.is_ancestor(ancestors_stack_.back(), id)) {
+      ancestors_stack_.pop_back();
+    }
+    if (!ancestors_stack_.empty()) {
+      copy_masks(ancestors_stack_.back(), id);
     }
+    ancestors_stack_.push_back(id);
   }
 }
 
 void ReadProcessor::copy_masks(int32_t node_from, int32_t node_to) {
   // std::cerr << "copy node_from: " << node_from << " node_to: " << node_to << std::endl;
-  auto& hit_mask_from = hit_masks_[node_from];
-  auto& hit_mask_to = hit_masks_[node_to];
-  for (size_t i = 0; i < hit_mask_size(); ++i) {
-    hit_mask_to[i] |= hit_mask_from[i];
-  }
+  hit_masks_[mask_ids_[node_to]] |= hit_masks_[mask_ids_[node_from]];
+  coverage_masks_[mask_ids_[node_to]] |= coverage_masks_[mask_ids_[node_from]];
+}
 
-  auto& coverage_mask_from = coverage_masks_[node_from];
-  auto& coverage_mask_to = coverage_masks_[node_to];
-  for (size_t i = 0; i < coverage_mask_size(); ++i) {
-    coverage_mask_to[i] |= coverage_mask_from[i];
+void ReadProcessor::add_matching_node(int32_t node_id) {
+  if (mask_ids_[node_id] != -1) {
+    return;
+  }
+  matching_nodes_.push_back(node_id);
+  if (masks_count_ == hit_masks_.size()) {
+    hit_masks_.emplace_back();
+    coverage_masks_.emplace_back();
   }
+  hit_masks_[masks_count_].reset(hit_mask_size());
+  coverage_masks_[masks_count_].reset(coverage_mask_size());
+  mask_ids_[node_id] = masks_count_++;
 }
 
-void ReadProcessor::fill_masks_from_kmer_blocks() {
-  size_t kmers_count = 0;
-  for (auto& block : split(krakmers_, ' ')) {
-    auto block_split = split(block, ':');
-    size_t count = std::stoi(block_split[1]);
-    std::string& ids = block_split[0];
-    std::vector<int32_t> node_ids;
-    bool no_nodes = false;
-    bool ambiguous_kmers = false;
-    for (auto& node_name : split(ids, ',')) {
+void ReadProcessor::parse_kmer_blocks() {
+  blocks_.clear();
+  block_nodes_.clear();
+  WordSplitter block_splitter(krakmers_, ' ');
+  StringPiece block;
+  while (block_splitter.next(block)) {
+    WordSplitter part_splitter(block, ':');
+    StringPiece ids;
+    StringPiece length;
+    KmerBlock kmer_block;
+    if (!part_splitter.next(ids) || !part_splitter.next(length) || !parse_size(length, kmer_block.length)) {
+      std::cerr << "wrong k-mer block: " << std::string(block.data, block.length) << std::endl;
+      exit(1);
+    }
+    kmer_block.nodes_offset = block_nodes_.size();
+    kmer_block.ambiguous = false;
+    WordSplitter name_splitter(ids, ',');
+    StringPiece node_name;
+    while (name_splitter.next(node_name)) {
       if (node_name == "0") {
-        no_nodes = true;
         break;
       }
       if (node_name == "A") {
-        ambiguous_kmers = true;
+        kmer_block.ambiguous = true;
         break;
       }
-      int32_t id = tree_.id_by_name(node_name);
-      node_ids.push_back(id);
-      matching_nodes_.insert(id);
-    }
-    if (!no_nodes && !ambiguous_kmers) {
-      if (simulate_lca_) {
-        // not implemented yet
-        std::cerr << "simulate_lca is not implemented yet" << std::endl;
+      int32_t id = tree_.id_by_name(node_name.data, node_name.length);
+      if (id == -1) {
+        std::cerr << "node " << std::string(node_name.data, node_name.length) << " is not in the tree" << std::endl;
         exit(1);
       }
-      set_masks(node_ids, kmers_count, count);
+      block_nodes_.push_back(id);
+    }
+    kmer_block.nodes_count = block_nodes_.size() - kmer_block.nodes_offset;
+    blocks_.push_back(kmer_block);
+  }
+}
+
+void ReadProcessor::fill_masks_from_kmer_blocks(const std::vector<KmerBlock>& blocks,
+    const std::vector<int32_t>& block_nodes) {
+  size_t kmers_count = 0;
+  if (simulate_lca_) {
+    lca_krakmers_.clear();
+  }
+  int32_t run_node = kNoBlock;
+  size_t run_length = 0;
+  for (auto& block : blocks) {
+    const int32_t* node_ids = block_nodes.data() + block.nodes_offset;
+    size_t node_ids_count = block.nodes_count;
+    int32_t block_node = block.ambiguous ? kAmbiguousBlock : kUnmatchedBlock;
+    if (simulate_lca_) {
+      // the nodes of the block are replaced by their LCA, also in the printed k-mer blocks
+      if (block.nodes_count > 0) {
+        block_node = nodes_lca(node_ids, node_ids_count);
+        node_ids = &block_node;
+        node_ids_count = 1;
+      }
+      if (block_node != run_node && block.length > 0) {
+        append_krakmer(run_node, run_length);
+        run_node = block_node;
+        run_length = 0;
+      }
+      run_length += block.length;
+    }
+    for (size_t i = 0; i < node_ids_count; ++i) {
+      add_matching_node(node_ids[i]);
     }
-    kmers_count += count;
+    if (block.nodes_count > 0 && !block.ambiguous) {
+      set_masks(node_ids, node_ids_count, kmers_count, block.length);
+    }
+    kmers_count += block.length;
+  }
+  if (simulate_lca_) {
+    append_krakmer(run_node, run_length);
+    krakmers_ = lca_krakmers_;
   }
   if (kmers_count + k_ - 1 != read_length_ && read_length_ >= k_) {
     std::cerr << "read length does not correspond to kmers blocks total length" << std::endl;
@@ -253,58 +406,79 @@ void ReadProcessor::fill_masks_from_kmer_blocks() {
   // print_masks();
 }
 
+int32_t ReadProcessor::nodes_lca(const int32_t* nodes, size_t nodes_count) const {
+  if (nodes_count == 1) {
+    return nodes[0];
+  }
+  int32_t lca = nodes[0];
+  for (size_t i = 1; i < nodes_count; ++i) {
+    lca = tree_.lca(lca, nodes[i]);
+  }
+  // the same as in prophyle_assignment.py, a root with a single child is not reported
+  int32_t root = tree_.root() - tree_.first_node();
+  if (lca == root && tree_.root()->n == 1) {
+    lca = tree_.root()->child[0];
+  }
+  return lca;
+}
+
+void ReadProcessor::append_krakmer(int32_t block_node, size_t block_length) {
+  if (block_node == kNoBlock) {
+    return;
+  }
+  if (!lca_krakmers_.empty()) {
+    lca_krakmers_ += ' ';
+  }
+  if (block_node == kUnmatchedBlock) {
+    lca_krakmers_ += '0';
+  } else if (block_node == kAmbiguousBlock) {
+    lca_krakmers_ += 'A';
+  } else {
+    lca_krakmers_ += tree_.node_by_id(block_node)->name;
+  }
+  lca_krakmers_ += ':';
+  append_number(lca_krakmers_, block_length);
+}
+
 void ReadProcessor::clear_masks() {
   for (auto id : matching_nodes_) {
-    std::fill(hit_masks_[id].begin(), hit_masks_[id].end(), 0);
-    std::fill(coverage_masks_[id].begin(), coverage_masks_[id].end(), 0);
+    mask_ids_[id] = -1;
   }
+  masks_count_ = 0;
 }
 
 void ReadProcessor::print_masks() const {
   for (auto id : matching_nodes_) {
-    auto& hit_mask = hit_masks_[id];
-    auto& coverage_mask = coverage_masks_[id];
+    auto& hit_mask = hit_masks_[mask_ids_[id]];
+    auto& coverage_mask = coverage_masks_[mask_ids_[id]];
     std::cerr << tree_.node_by_id(id)->name << " " << hit_mask_size() << " " << coverage_mask_size() << std::endl;
     for (size_t i = 0; i < hit_mask_size(); ++i) {
-      std::cerr << hit_mask[i];
+      std::cerr << hit_mask.test(i);
     }
     std::cerr << std::endl;
     for (size_t i = 0; i < coverage_mask_size(); ++i) {
-      std::cerr << coverage_mask[i];
+      std::cerr << coverage_mask.test(i);
     }
     std::cerr << std::endl;
   }
 }
 
-void ReadProcessor::set_masks(const std::vector<int32_t>& node_ids, size_t block_position, size_t block_length) {
-  for (auto id : node_ids) {
-    auto& hit_mask = hit_masks_[id];
-    if (hit_mask.size() <= hit_mask_size()) {
-      hit_mask.resize(2 * hit_mask_size(), 0);
-    }
-    for (size_t i = block_position; i < block_position + block_length; ++i) {
-      hit_mask[i] = 1;
-    }
-    auto& coverage_mask = coverage_masks_[id];
-    if (coverage_mask.size() <= coverage_mask_size()) {
-      coverage_mask.resize(2 * coverage_mask_size(), 0);
-    }
-    for (size_t i = block_position; i < block_position + block_length + k_ - 1; ++i) {
-      coverage_mask[i] = 1;
-    }
+void ReadProcessor::set_masks(const int32_t* node_ids, size_t node_ids_count, size_t block_position,
+    size_t block_length) {
+  for (size_t i = 0; i < node_ids_count; ++i) {
+    int32_t id = node_ids[i];
+    hit_masks_[mask_ids_[id]].set_range(block_position, block_position + block_length);
+    coverage_masks_[mask_ids_[id]].set_range(block_position, block_position + block_length + k_ - 1);
   }
 }
 
-void ReadProcessor::fill_cigar(const std::vector<int16_t>& mask, size_t mask_size, std::string& cigar) {
+void ReadProcessor::fill_cigar(const BitMask& mask, std::string& cigar) {
   cigar.clear();
   size_t block_start = 0;
-  while (block_start < mask_size) {
-    size_t position = block_start;
-    while (position < mask_size && mask[block_start] == mask[position]) {
-      position++;
-    }
-    char match = mask[block_start] == 0 ? 'X' : '=';
-    cigar += std::to_string(position - block_start);
+  while (block_start < mask.size()) {
+    size_t position = mask.run_end(block_start);
+    char match = mask.test(block_start) ? '=' : 'X';
+    append_number(cigar, position - block_start);
     cigar += match;
     block_start = position;
   }
@@ -1,14 +1,16 @@
 #pragma once
 
 #include "tree_index.h"
+#include "bit_mask.h"
+#include "word_splitter.h"
 #include <vector>
 #include <iostream>
-#include <set>
 #include <sstream>
 
 enum class AssignmentOutputFormat {
   Sam = 0,
   Kraken,
+  Binary,
   Count
 };
 
@@ -18,33 +20,70 @@ enum class Measure {
   Count
 };
 
+// Block of consecutive k-mers with the same set of matching nodes; the node ids of the block
+// are stored contiguously from nodes_offset in a separate array.
+struct KmerBlock {
+  size_t length;
+  size_t nodes_offset;
+  size_t nodes_count;
+  bool ambiguous;
+};
+
 class ReadProcessor {
 public:
   ReadProcessor(const TreeIndex& tree, size_t k, bool simulate_lca = false, bool annotate = false,
       bool tie_lca = false, bool not_translate_blocks = false);
 
-  void process_krakline(const std::string& krakline, AssignmentOutputFormat format, Measure criteria);
+  void process_krakline(const std::string& krakline, AssignmentOutputFormat format, Measure criteria,
+      std::ostream& out = std::cout);
+  // the strings are only referenced while the read is assigned, the returned records are valid until
+  // the next read is processed; krakmers are used only by the Kraken-like format
+  StringPiece process_read(StringPiece read_name, size_t read_length, const std::vector<KmerBlock>& blocks,
+      const std::vector<int32_t>& block_nodes, StringPiece krakmers, StringPiece read, StringPiece qualities,
+      AssignmentOutputFormat format, Measure criteria);
   void print_sam_header(std::ostream& out) const;
+  // string table of node names preceding the fixed-width binary records
+  void print_binary_header(std::ostream& out) const;
 
 private:
   static constexpr size_t kFakeContigLength = 42424242;
+  // pseudo node ids of k-mer blocks without a node
+  static constexpr int32_t kNoBlock = -1;
+  static constexpr int32_t kUnmatchedBlock = -2;
+  static constexpr int32_t kAmbiguousBlock = -3;
+  // binary output: the header is the magic, the version, the number of nodes and the names
+  // (each preceded by its length), then every record is three little-endian uint32 -
+  // node id + 1 (0 if unassigned, the top bit marks further ties of the previous read), h1, c1
+  static constexpr char kBinaryMagic[] = "PHYA";
+  static constexpr uint32_t kBinaryVersion = 1;
+  static constexpr uint32_t kBinarySameRead = 0x80000000u;
 
   void load_krakline(const std::string& krakline);
+  void assign(AssignmentOutputFormat format, Measure criteria, std::ostream& out);
+  // fills output_ with the records of the current read
+  void assign_records(AssignmentOutputFormat format, Measure criteria);
   void filter_assignments();
   void print_assignments(AssignmentOutputFormat format, Measure criteria);
-  void print_sam_line(int32_t node_id, const std::string& suffix = "", std::ostream& out = std::cout);
-  void print_kraken_line(int32_t node_id, std::ostream& out = std::cout);
-  void fill_masks_from_kmer_blocks();
-  void set_masks(const std::vector<int32_t>& node_ids, size_t block_position, size_t block_length);
+  void print_sam_line(int32_t node_id, StringPiece suffix);
+  void print_kraken_line(int32_t node_id);
+  void print_binary_record(int32_t node_id, bool same_read);
+  void parse_kmer_blocks();
+  void fill_masks_from_kmer_blocks(const std::vector<KmerBlock>& blocks, const std::vector<int32_t>& block_nodes);
+  void set_masks(const int32_t* node_ids, size_t node_ids_count, size_t block_position, size_t block_length);
   void print_masks() const;
   void clear();
   void clear_masks();
   void propagate_matching_kmers();
   void copy_masks(int32_t node_from, int32_t node_to);
-  void fill_cigar(const std::vector<int16_t>& mask, size_t mask_size, std::string& cigar);
+  void add_matching_node(int32_t node_id);
+  void fill_cigar(const BitMask& mask, std::string& cigar);
+  // LCA of a nonempty set of nodes, O(1) per node
+  int32_t nodes_lca(const int32_t* nodes, size_t nodes_count) const;
+  // appends a block of the k-mers replaced by their LCA to krakmers_
+  void append_krakmer(int32_t block_node, size_t block_length);
 
   size_t hit_mask_size() const {
-    return read_length_ - k_ + 1;
+    return read_length_ >= k_ ? read_length_ - k_ + 1 : 0;
   }
 
   size_t coverage_mask_size() const {
@@ -58,15 +97,27 @@ private:
   const bool tie_lca_;
   const bool not_translate_blocks_;
 
-  std::string read_name_;
+  // fields of the current read, they point to the krakline or to the arguments of process_read
+  StringPiece read_name_;
   size_t read_length_;
-  std::string krakmers_;
-  std::string read_;
-  std::string qualities_;
+  StringPiece krakmers_;
+  StringPiece read_;
+  StringPiece qualities_;
+  // k-mer blocks rewritten to their LCAs if simulate_lca_
+  std::string lca_krakmers_;
+
+  std::vector<KmerBlock> blocks_;
+  std::vector<int32_t> block_nodes_;
 
-  std::vector<std::vector<int16_t>> hit_masks_;
-  std::vector<std::vector<int16_t>> coverage_masks_;
-  std::set<int32_t> matching_nodes_;
+  // masks exist only for the nodes matching the current read, mask_ids_ maps a node to its masks
+  // (-1 if it does not match); the masks are reused by later reads
+  std::vector<int32_t> mask_ids_;
+  std::vector<BitMask> hit_masks_;
+  std::vector<BitMask> coverage_masks_;
+  size_t masks_count_;
+  std::vector<int32_t> matching_nodes_;
+  std::vector<int32_t> preorder_matching_nodes_;
+  std::vector<int32_t> ancestors_stack_;
 
   std::vector<int32_t> best_hit_nodes_;
   int32_t best_hit_;
@@ -75,4 +126,8 @@ private:
 
   std::string hit_cigar_;
   std::string coverage_cigar_;
+  // the winners of the current read were replaced by their LCA
+  bool tie_solved_;
+  // records of the current read, written to the output stream at once
+  std::string output_;
 };
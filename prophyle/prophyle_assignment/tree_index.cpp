@@ -1,18 +1,23 @@
 #include "tree_index.h"
 #include "word_splitter.h"
 #include "knhx.h"
-#include <sstream>
 #include <fstream>
 #include <cstring>
+#include <utility>
 
 TreeIndex::TreeIndex(const std::string& tree_filename) {
-  std::ifstream t(tree_filename);
-  std::stringstream buffer;
-  buffer << t.rdbuf();
-  char s[buffer.str().length()+1];
-  strcpy(s, buffer.str().c_str());
+  // the file is read at once into a heap buffer, big trees do not fit the stack
+  std::ifstream tree_file(tree_filename, std::ios::binary);
+  if (!tree_file) {
+    std::cerr << "cannot open tree " << tree_filename << std::endl;
+    exit(1);
+  }
+  tree_file.seekg(0, std::ios::end);
+  std::string newick_string(static_cast<size_t>(tree_file.tellg()), '\0');
+  tree_file.seekg(0, std::ios::beg);
+  tree_file.read(&newick_string[0], newick_string.size());
   int error;
-  first_node_ = kn_parse(s, &nodes_count_, &error);
+  first_node_ = kn_parse(newick_string.c_str(), &nodes_count_, &error);
   bool root_found = false;
   for (int32_t i = 0; i < nodes_count_; ++i) {
     knhx1_t* possible_root = first_node_ + i;
@@ -26,42 +31,79 @@ TreeIndex::TreeIndex(const std::string& tree_filename) {
     std::cerr << "root not found" << std::endl;
     exit(1);
   }
-  for (int32_t i = 0; i < nodes_count_; ++i) {
-    const knhx1_t* node = node_by_id(i);
-    id_by_name_.emplace(std::pair<std::string, int32_t>(node->name, i));
+  fill_name_table();
+  fill_intervals();
+  fill_lca_table();
+  fill_tags();
+}
+
+namespace {
+
+// FNV-1a
+uint64_t name_hash(const char* name, size_t length) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < length; ++i) {
+    hash = (hash ^ static_cast<unsigned char>(name[i])) * 0x100000001b3ULL;
   }
-  upper_nodes_.resize(nodes_count_);
-  fill_upper_nodes(root_);
-  fill_tags(buffer.str());
+  return hash;
 }
 
-void TreeIndex::fill_tags(const std::string& newick_string) {
-  tags_.resize(nodes_count_);
-  auto parts_by_comma = split(newick_string, ',');
-  std::vector<std::string> parts;
-  for (auto& part : parts_by_comma) {
-    for (auto& part_by_bracket : split(part, ')')) {
-      parts.push_back(part_by_bracket);
-    }
+}
+
+void TreeIndex::fill_name_table() {
+  size_t table_size = 2;
+  while (table_size < 2 * static_cast<size_t>(nodes_count_)) {
+    table_size <<= 1;
   }
+  name_table_.assign(table_size, -1);
+  name_lengths_.resize(nodes_count_);
   for (int32_t id = 0; id < nodes_count_; ++id) {
-    auto& part = parts[id];
-    if (part.find('[') == std::string::npos) {
+    const char* name = node_by_id(id)->name;
+    name_lengths_[id] = strlen(name);
+    if (id_by_name(name, name_lengths_[id]) != -1) {
       continue;
     }
-    std::string tag_string = part.substr(part.find('[') + 1, part.length() - part.find('[') - 2);
-    auto tags = split(tag_string, ':');
-    for (auto& tag : tags) {
-      auto pair = split(tag, '=');
-      if (pair.size() != 2) {
-        continue;
-      }
-      tags_[id].emplace(std::pair<std::string, std::string>(pair[0], pair[1]));
+    size_t slot = name_hash(name, name_lengths_[id]) & (table_size - 1);
+    while (name_table_[slot] != -1) {
+      slot = (slot + 1) & (table_size - 1);
+    }
+    name_table_[slot] = id;
+  }
+}
+
+int32_t TreeIndex::id_by_name(const char* name, size_t length) const {
+  size_t mask = name_table_.size() - 1;
+  size_t slot = name_hash(name, length) & mask;
+  while (name_table_[slot] != -1) {
+    int32_t id = name_table_[slot];
+    if (name_lengths_[id] == length && memcmp(node_by_id(id)->name, name, length) == 0) {
+      return id;
     }
+    slot = (slot + 1) & mask;
   }
+  return -1;
+}
+
+void TreeIndex::fill_tags() {
+  tags_.resize(nodes_count_);
   joined_tags_.resize(nodes_count_);
   for (int32_t id = 0; id < nodes_count_; ++id) {
-    std::string joined_tags;
+    const char* tag_string = node_by_id(id)->tags;
+    if (tag_string == nullptr) {
+      continue;
+    }
+    // NHX tags are key=value pairs separated by ':', other parts (&&NHX) are skipped
+    WordSplitter splitter(tag_string, ':');
+    StringPiece tag;
+    while (splitter.next(tag)) {
+      const char* equals = static_cast<const char*>(memchr(tag.data, '=', tag.length));
+      const char* end = tag.data + tag.length;
+      if (equals == nullptr || equals + 1 == end || memchr(equals + 1, '=', end - equals - 1) != nullptr) {
+        continue;
+      }
+      tags_[id].emplace(std::string(tag.data, equals), std::string(equals + 1, end));
+    }
+    std::string& joined_tags = joined_tags_[id];
     auto& tags = tags_[id];
     auto gi = tags.find("gi");
     if (gi != tags.cend()) {
@@ -79,27 +121,68 @@ void TreeIndex::fill_tags(const std::string& newick_string) {
     if (rank != tags.cend()) {
       joined_tags += "\tra:Z:" + (*rank).second;
     }
-    joined_tags_[id] = joined_tags;
   }
+}
+
+void TreeIndex::fill_intervals() {
+  entry_.assign(nodes_count_, -1);
+  exit_.assign(nodes_count_, -1);
+  depth_.assign(nodes_count_, 0);
+  preorder_.clear();
+  preorder_.reserve(nodes_count_);
+  // explicit stack of (node, index of the next child to visit), deep trees would overflow recursion
+  std::vector<std::pair<int32_t, int32_t>> stack;
+  int32_t root_id = root_ - first_node_;
+  stack.emplace_back(root_id, 0);
+  entry_[root_id] = 0;
+  preorder_.push_back(root_id);
+  while (!stack.empty()) {
+    auto& top = stack.back();
+    const knhx1_t* node = node_by_id(top.first);
+    if (top.second == node->n) {
+      exit_[top.first] = preorder_.size() - 1;
+      stack.pop_back();
+      continue;
+    }
+    int32_t child = node->child[top.second++];
+    entry_[child] = preorder_.size();
+    depth_[child] = depth_[top.first] + 1;
+    preorder_.push_back(child);
+    stack.emplace_back(child, 0);
+  }
+}
 
-//  for (int32_t id = 0; id < nodes_count_; ++id) {
-//    std::cerr << id << " ";
-//    for (auto& pair : tags_[id]) {
-//      std::cerr << pair.first << ":" << pair.second << " ";
-//    }
-//    std::cerr << std::endl;
-//  }
+void TreeIndex::fill_lca_table() {
+  int32_t size = preorder_.size();
+  lca_table_.clear();
+  lca_table_.push_back(preorder_);
+  for (int32_t length = 2; length <= size; length <<= 1) {
+    const auto& previous = lca_table_.back();
+    std::vector<int32_t> level(size - length + 1);
+    for (int32_t i = 0; i + length <= size; ++i) {
+      int32_t first = previous[i];
+      int32_t second = previous[i + length / 2];
+      level[i] = depth_[first] <= depth_[second] ? first : second;
+    }
+    lca_table_.push_back(std::move(level));
+  }
 }
 
-void TreeIndex::fill_upper_nodes(const knhx1_t* node) {
-  int32_t node_id = id_by_name(node->name);
-  // std::cerr << "processing node: " << node_id << " " << node->name << " " << node->n << std::endl;
-  for (int32_t i = 0; i < node->n; ++i) {
-    auto child = node_by_id(node->child[i]);
-    upper_nodes_[node->child[i]] = upper_nodes_[node_id];
-    upper_nodes_[node->child[i]].push_back(node_id);
-    fill_upper_nodes(child);
+int32_t TreeIndex::lca(int32_t first, int32_t second) const {
+  if (first == second) {
+    return first;
+  }
+  int32_t from = entry_[first];
+  int32_t to = entry_[second];
+  if (from > to) {
+    std::swap(from, to);
   }
+  // the shallowest node in preorder positions (from, to] is a child of the LCA
+  from++;
+  int32_t level = 31 - __builtin_clz(to - from + 1);
+  int32_t left = lca_table_[level][from];
+  int32_t right = lca_table_[level][to - (1 << level) + 1];
+  return parent(depth_[left] <= depth_[right] ? left : right);
 }
 
 std::ostream& operator<<(std::ostream& sout, const TreeIndex& tree) {
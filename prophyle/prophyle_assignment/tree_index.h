@@ -6,7 +6,6 @@
 #include <unordered_map>
 #include <iostream>
 #include <vector>
-#include <unordered_map>
 
 class TreeIndex {
 public:
@@ -33,18 +32,38 @@ public:
   }
 
   int32_t id_by_name(const std::string& name) const {
-    const auto &node = id_by_name_.find(name);
-    if (node == id_by_name_.end()) {
-      return -1;
-    } else {
-      return node->second;
-    }
+    return id_by_name(name.data(), name.length());
+  }
+
+  // -1 if there is no such node, the name does not have to be null-terminated
+  int32_t id_by_name(const char* name, size_t length) const;
+
+  int32_t parent(int32_t id) const {
+    return (first_node_ + id)->parent;
+  }
+
+  // position of the node in the preorder traversal; the subtree of the node occupies
+  // positions [entry_time(id), exit_time(id)]
+  int32_t entry_time(int32_t id) const {
+    return entry_[id];
   }
 
-  const std::vector<int32_t>& upper_nodes(int32_t node_id) const {
-    return upper_nodes_[node_id];
+  int32_t exit_time(int32_t id) const {
+    return exit_[id];
   }
 
+  int32_t depth(int32_t id) const {
+    return depth_[id];
+  }
+
+  // ancestor is an ancestor of node or the node itself
+  bool is_ancestor(int32_t ancestor, int32_t node) const {
+    return entry_[ancestor] <= entry_[node] && exit_[node] <= exit_[ancestor];
+  }
+
+  // lowest common ancestor in O(1)
+  int32_t lca(int32_t first, int32_t second) const;
+
   const std::unordered_map<std::string, std::string>& tags(int32_t id) const {
     return tags_[id];
   }
@@ -54,14 +73,24 @@ public:
   }
 
 private:
-  void fill_upper_nodes(const knhx1_t* node);
-  void fill_tags(const std::string& newick_string);
+  void fill_name_table();
+  void fill_intervals();
+  void fill_lca_table();
+  void fill_tags();
 
   knhx1_t* first_node_;
   knhx1_t* root_;
   int32_t nodes_count_;
-  std::unordered_map<std::string, int32_t> id_by_name_;
-  std::vector<std::vector<int32_t>> upper_nodes_;
+  // open addressing table of node ids by their names (-1 for a free slot), the first node of
+  // a name wins as before
+  std::vector<int32_t> name_table_;
+  std::vector<size_t> name_lengths_;
+  std::vector<int32_t> entry_;
+  std::vector<int32_t> exit_;
+  std::vector<int32_t> depth_;
+  std::vector<int32_t> preorder_;
+  // lca_table_[j][i] is the shallowest node among preorder_[i .. i + 2^j - 1]
+  std::vector<std::vector<int32_t>> lca_table_;
   std::vector<std::unordered_map<std::string, std::string>> tags_;
   std::vector<std::string> joined_tags_;
 };
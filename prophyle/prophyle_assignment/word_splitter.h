@@ -1,5 +1,69 @@
 #pragma once
 #include <vector>
 #include <string>
+#include <cstring>
+#include <cstddef>
 
 std::vector<std::string> split(const std::string &s, char delim);
+
+// Part of a string which is referenced, not copied; valid as long as the string is.
+struct StringPiece {
+  const char* data = nullptr;
+  size_t length = 0;
+
+  StringPiece() = default;
+  StringPiece(const char* data, size_t length): data(data), length(length) {}
+  StringPiece(const char* c_str): data(c_str), length(strlen(c_str)) {}
+  StringPiece(const std::string& str): data(str.data()), length(str.length()) {}
+
+  bool empty() const {
+    return length == 0;
+  }
+
+  bool operator==(const char* c_str) const {
+    return strncmp(data, c_str, length) == 0 && c_str[length] == '\0';
+  }
+};
+
+// Iterates over the parts of a string separated by delim without allocating.
+class WordSplitter {
+public:
+  WordSplitter(StringPiece s, char delim): position_(s.data), end_(s.data + s.length), delim_(delim),
+      finished_(s.length == 0) {}
+
+  // returns false when there are no more parts; as split(), a trailing delimiter gives no empty part
+  bool next(StringPiece& word) {
+    if (finished_) {
+      return false;
+    }
+    const char* word_end = static_cast<const char*>(memchr(position_, delim_, end_ - position_));
+    if (word_end == nullptr) {
+      word_end = end_;
+    }
+    word = StringPiece(position_, word_end - position_);
+    finished_ = word_end == end_ || word_end + 1 == end_;
+    position_ = word_end + 1;
+    return true;
+  }
+
+private:
+  const char* position_;
+  const char* end_;
+  char delim_;
+  bool finished_;
+};
+
+// parses a decimal number without a sign, returns false if the piece is not one
+inline bool parse_size(StringPiece s, size_t& value) {
+  if (s.empty()) {
+    return false;
+  }
+  value = 0;
+  for (size_t i = 0; i < s.length; ++i) {
+    if (s.data[i] < '0' || s.data[i] > '9') {
+      return false;
+    }
+    value = value * 10 + (s.data[i] - '0');
+  }
+  return true;
+}
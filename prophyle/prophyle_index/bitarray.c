@@ -22,11 +22,32 @@ bitarray_t* create_bitarray(uint64_t n)
 void add_to_bitarray(bitarray_t* array, uint64_t value)
 {
 	array->blocks[value / BITS_IN_BLOCK] =
-    array->blocks[value / BITS_IN_BLOCK] | ( 1 << (BITS_IN_BLOCK - 1 - value % BITS_IN_BLOCK));
+    array->blocks[value / BITS_IN_BLOCK] | ((bitarray_block_t)1 << (value % BITS_IN_BLOCK));
 }
 
 void delete_from_bitarray(bitarray_t* array, uint64_t value)
 {
 	array->blocks[value / BITS_IN_BLOCK] =
-    array->blocks[value / BITS_IN_BLOCK] & ~(1 << (BITS_IN_BLOCK - 1 - value % BITS_IN_BLOCK));
+    array->blocks[value / BITS_IN_BLOCK] & ~((bitarray_block_t)1 << (value % BITS_IN_BLOCK));
+}
+
+void add_range_to_bitarray(bitarray_t* array, uint64_t from, uint64_t to)
+{
+  if (from >= to) {
+    return;
+  }
+  uint64_t first_block = from / BITS_IN_BLOCK;
+  uint64_t last_block = (to - 1) / BITS_IN_BLOCK;
+  bitarray_block_t first_mask = MAX_BITARRAY_BLOCK_VALUE << (from % BITS_IN_BLOCK);
+  bitarray_block_t last_mask = MAX_BITARRAY_BLOCK_VALUE >> (BITS_IN_BLOCK - 1 - (to - 1) % BITS_IN_BLOCK);
+  if (first_block == last_block) {
+    __sync_fetch_and_or(array->blocks + first_block, first_mask & last_mask);
+    return;
+  }
+  __sync_fetch_and_or(array->blocks + first_block, first_mask);
+  uint64_t block;
+  for (block = first_block + 1; block < last_block; ++block) {
+    array->blocks[block] = MAX_BITARRAY_BLOCK_VALUE;
+  }
+  __sync_fetch_and_or(array->blocks + last_block, last_mask);
 }
@@ -8,9 +8,10 @@
 #include<stdlib.h>
 #include <stdint.h>
 
-#define bitarray_block_t uint16_t
-#define BITS_IN_BLOCK 16
-#define MAX_BITARRAY_BLOCK_VALUE (1 << BITS_IN_BLOCK) - 1
+// bit of value v is bit v % BITS_IN_BLOCK (counted from the least significant one) of block v / BITS_IN_BLOCK
+#define bitarray_block_t uint64_t
+#define BITS_IN_BLOCK 64
+#define MAX_BITARRAY_BLOCK_VALUE UINT64_MAX
 
 typedef struct {
   bitarray_block_t* blocks;
@@ -22,3 +23,6 @@ void destroy_bitarray(bitarray_t* array);
 bitarray_t* create_bitarray(uint64_t n);
 void add_to_bitarray(bitarray_t* array, uint64_t value);
 void delete_from_bitarray(bitarray_t* array, uint64_t value);
+// sets bits of values from..to-1; blocks shared with values outside the range are updated atomically,
+// so that threads can fill disjoint ranges concurrently
+void add_range_to_bitarray(bitarray_t* array, uint64_t from, uint64_t to);
@@ -9,6 +9,7 @@
 #include "prophyle_utils.h"
 #include "khash.h"
 #include "contig_node_translator.h"
+#include "bwa_utils.h"
 
 KHASH_MAP_INIT_STR(str, int)
 
@@ -33,11 +34,14 @@ void bns_destroy_without_names_and_anno(bntseq_t* bns) {
 	}
 }
 
-void bwa_idx_destroy_without_bns_name_and_anno(bwaidx_t* idx)
+void bwa_idx_destroy_without_bns_name_and_anno(bwaidx_t* idx, int use_mmap)
 {
 	if (idx == 0) return;
 	if (idx->mem == 0) {
-		if (idx->bwt) bwt_destroy(idx->bwt);
+		if (idx->bwt) {
+			if (use_mmap) bwt_destroy_mmap(idx->bwt);
+			else bwt_destroy(idx->bwt);
+		}
 		if (idx->bns) bns_destroy_without_names_and_anno(idx->bns);
 	} else {
 		free(idx->bwt); free(idx->bns->anns); free(idx->bns);
@@ -158,7 +162,56 @@ bntseq_t* bns_restore_partial(const char* prefix)
 	return bns;
 }
 
-bwt_t* bwa_idx_load_bwt_with_time(const char* hint, int need_log, FILE* log_file)
+// Sizes of the headers of the .bwt (primary, L2[1..4]) and .sa (primary, L2[1..4], sa_intv, seq_len) files,
+// see bwt_dump_bwt and bwt_dump_sa in bwa/bwt.c
+#define BWT_FILE_HEADER_LENGTH (5 * sizeof(bwtint_t))
+#define SA_FILE_HEADER_LENGTH (7 * sizeof(bwtint_t))
+
+bwt_t* bwt_restore_bwt_mmap(const char* fn)
+{
+	size_t length;
+	char* addr = prophyle_map_file(fn, &length);
+	xassert(length >= BWT_FILE_HEADER_LENGTH, "[prophyle_index] .bwt file is too short");
+	bwt_t* bwt = calloc(1, sizeof(bwt_t));
+	bwt->bwt_size = (length - BWT_FILE_HEADER_LENGTH) >> 2;
+	memcpy(&bwt->primary, addr, sizeof(bwtint_t));
+	memcpy(bwt->L2 + 1, addr + sizeof(bwtint_t), 4 * sizeof(bwtint_t));
+	bwt->bwt = (uint32_t*)(addr + BWT_FILE_HEADER_LENGTH);
+	bwt->seq_len = bwt->L2[4];
+	bwt_gen_cnt_table(bwt);
+	return bwt;
+}
+
+void bwt_restore_sa_mmap(const char* fn, bwt_t* bwt)
+{
+	size_t length;
+	char* addr = prophyle_map_file(fn, &length);
+	xassert(length >= SA_FILE_HEADER_LENGTH, "[prophyle_index] .sa file is too short");
+	bwtint_t* header = (bwtint_t*)addr;
+	xassert(header[0] == bwt->primary, "SA-BWT inconsistency: primary is not the same.");
+	xassert(header[6] == bwt->seq_len, "SA-BWT inconsistency: seq_len is not the same.");
+	bwt->sa_intv = header[5];
+	bwt->n_sa = (bwt->seq_len + bwt->sa_intv) / bwt->sa_intv;
+	xassert(length == SA_FILE_HEADER_LENGTH + (bwt->n_sa - 1) * sizeof(bwtint_t), "[prophyle_index] .sa file has unexpected size");
+	// the stored SA values start right after the header, sa[0] = -1 overwrites the last header word
+	// in the private mapping, so only the first page stops being shared
+	bwt->sa = header + 6;
+	bwt->sa[0] = -1;
+}
+
+void bwt_destroy_mmap(bwt_t* bwt)
+{
+	if (bwt == 0) return;
+	if (bwt->bwt) {
+		prophyle_unmap_file((char*)bwt->bwt - BWT_FILE_HEADER_LENGTH, BWT_FILE_HEADER_LENGTH + (bwt->bwt_size << 2));
+	}
+	if (bwt->sa) {
+		prophyle_unmap_file((char*)(bwt->sa + 1) - SA_FILE_HEADER_LENGTH, SA_FILE_HEADER_LENGTH + (bwt->n_sa - 1) * sizeof(bwtint_t));
+	}
+	free(bwt);
+}
+
+bwt_t* bwa_idx_load_bwt_with_time(const char* hint, int need_log, FILE* log_file, int use_mmap)
 {
 	char* tmp;
 	char* prefix;
@@ -171,13 +224,14 @@ bwt_t* bwa_idx_load_bwt_with_time(const char* hint, int need_log, FILE* log_file
 	clock_t t = clock();
 	tmp = calloc(strlen(prefix) + 5, 1);
 	strcat(strcpy(tmp, prefix), ".bwt");
-	bwt = bwt_restore_bwt(tmp);
+	bwt = use_mmap ? bwt_restore_bwt_mmap(tmp) : bwt_restore_bwt(tmp);
 	if (need_log) {
 		fprintf(log_file, "bwt_loading\t%.2fs\n", (float)(clock() - t) / CLOCKS_PER_SEC);
 	}
 	t = clock();
 	strcat(strcpy(tmp, prefix), ".sa");
-	bwt_restore_sa(tmp, bwt);
+	if (use_mmap) bwt_restore_sa_mmap(tmp, bwt);
+	else bwt_restore_sa(tmp, bwt);
 	if (need_log) {
 		fprintf(log_file, "sa_loading\t%.2fs\n", (float)(clock() - t) / CLOCKS_PER_SEC);
 	}
@@ -185,7 +239,7 @@ bwt_t* bwa_idx_load_bwt_with_time(const char* hint, int need_log, FILE* log_file
 	return bwt;
 }
 
-bwaidx_t* bwa_idx_load_partial(const char* hint, int which, int need_log, FILE* log_file)
+bwaidx_t* bwa_idx_load_partial(const char* hint, int which, int need_log, FILE* log_file, int use_mmap)
 {
 	bwaidx_t* idx;
 	char* prefix;
@@ -195,7 +249,7 @@ bwaidx_t* bwa_idx_load_partial(const char* hint, int which, int need_log, FILE*
 		return 0;
 	}
 	idx = calloc(1, sizeof(bwaidx_t));
-	if (which & BWA_IDX_BWT) idx->bwt = bwa_idx_load_bwt_with_time(hint, need_log, log_file);
+	if (which & BWA_IDX_BWT) idx->bwt = bwa_idx_load_bwt_with_time(hint, need_log, log_file, use_mmap);
 	if (which & BWA_IDX_BNS) {
 		int i, c;
 		clock_t t = clock();
@@ -233,3 +287,51 @@ void bwt_destroy_without_sa(bwt_t* bwt)
 	free(bwt->bwt);
 	free(bwt);
 }
+
+// 2^shift is about a quarter of the mean contig length, within 256 to 4096 positions per sample
+// (8 bytes per sample, at most 1 byte per 32 bp of the index)
+#define POS2NODE_MAP_MIN_SHIFT 8
+#define POS2NODE_MAP_MAX_SHIFT 12
+
+pos2node_map_t* pos2node_map_init(const bntseq_t* bns) {
+	pos2node_map_t* map = malloc(sizeof(pos2node_map_t));
+	const int64_t mean_length = bns->n_seqs > 0 ? bns->l_pac / bns->n_seqs : 0;
+	map->shift = POS2NODE_MAP_MIN_SHIFT;
+	while (map->shift < POS2NODE_MAP_MAX_SHIFT && (INT64_C(4) << (map->shift + 1)) <= mean_length) {
+		++map->shift;
+	}
+	// samples past the end of the forward strand are in no contig
+	map->samples_cnt = ((bns->l_pac - 1) >> map->shift) + 2;
+	map->rids = malloc(map->samples_cnt * sizeof(int32_t));
+	map->nodes = malloc(map->samples_cnt * sizeof(int32_t));
+	xassert(map->rids && map->nodes, "[prophyle_index] not enough memory for the position to node map\n");
+	int rid = 0;
+	int node = bns->n_seqs > 0 ? get_node_from_contig(0) : -1;
+	int64_t i;
+	for (i = 0; i < map->samples_cnt; ++i) {
+		int64_t pos = i << map->shift;
+		if (pos >= bns->l_pac) {
+			map->rids[i] = bns->n_seqs;
+			map->nodes[i] = -1;
+			continue;
+		}
+		if (rid + 1 < bns->n_seqs && bns->anns[rid + 1].offset <= pos) {
+			while (rid + 1 < bns->n_seqs && bns->anns[rid + 1].offset <= pos) {
+				++rid;
+			}
+			node = get_node_from_contig(rid);
+		}
+		map->rids[i] = rid;
+		map->nodes[i] = node;
+	}
+	return map;
+}
+
+void pos2node_map_destroy(pos2node_map_t* map) {
+	if (!map) {
+		return;
+	}
+	free(map->rids);
+	free(map->nodes);
+	free(map);
+}
@@ -13,11 +13,59 @@
 
 void bwa_destroy_unused_fields(bwaidx_t* idx);
 void bns_destroy_without_names_and_anno(bntseq_t* bns);
-void bwa_idx_destroy_without_bns_name_and_anno(bwaidx_t* idx);
+void bwa_idx_destroy_without_bns_name_and_anno(bwaidx_t* idx, int use_mmap);
 bntseq_t* bns_restore_core_partial(const char* ann_filename, const char* amb_filename, const char* pac_filename);
 bntseq_t* bns_restore_partial(const char* prefix);
-bwaidx_t* bwa_idx_load_partial(const char* hint, int which, int need_log, FILE* log_file);
+bwaidx_t* bwa_idx_load_partial(const char* hint, int which, int need_log, FILE* log_file, int use_mmap);
+// .bwt and .sa loaded with mmap instead of reading into private memory, the mapped files must not change
+bwt_t* bwt_restore_bwt_mmap(const char* fn);
+void bwt_restore_sa_mmap(const char* fn, bwt_t* bwt);
+void bwt_destroy_mmap(bwt_t* bwt);
 bwt_t* bwa_idx_load_bwt_without_sa(const char* hint);
 void bwt_destroy_without_sa(bwt_t* bwt);
 
+// contig and node of every 2^shift-th position of the forward strand; the spacing is chosen from
+// the mean contig length so that most k-mers lie between two samples of the same contig
+typedef struct {
+	int32_t* rids;
+	int32_t* nodes;
+	int64_t samples_cnt;
+	int shift;
+} pos2node_map_t;
+
+pos2node_map_t* pos2node_map_init(const bntseq_t* bns);
+void pos2node_map_destroy(pos2node_map_t* map);
+
+// node of the contig containing the whole [pos, pos + length) if both surrounding samples lie in
+// that contig, the k-mer is then not on a border; -1 otherwise
+static inline int pos2node_map_get_node(const pos2node_map_t* map, int64_t pos, int length, int* rid) {
+	const int64_t first = pos >> map->shift;
+	const int64_t last = ((pos + length - 1) >> map->shift) + 1;
+	if (last >= map->samples_cnt || map->rids[first] != map->rids[last]) {
+		return -1;
+	}
+	*rid = map->rids[first];
+	return map->nodes[first];
+}
+
+// same result as bns_pos2rid(bns, pos), by a binary search over the contigs between two samples
+static inline int pos2node_map_get_rid(const pos2node_map_t* map, const bntseq_t* bns, int64_t pos) {
+	if (pos >= bns->l_pac) {
+		return -1;
+	}
+	// the last sample is past the end of the forward strand
+	const int64_t sample = pos >> map->shift;
+	int left = map->rids[sample];
+	int right = map->rids[sample + 1] < bns->n_seqs ? map->rids[sample + 1] : bns->n_seqs - 1;
+	while (left < right) {
+		int middle = left + (right - left + 1) / 2;
+		if (bns->anns[middle].offset <= pos) {
+			left = middle;
+		} else {
+			right = middle - 1;
+		}
+	}
+	return left;
+}
+
 #endif // BWAUTILS_H
@@ -4,12 +4,15 @@
 #include "contig_node_translator.h"
 #include "utils.h"
 
-#define MAX_NODES_COUNT 100000
-#define MAX_CONTIGS_COUNT 200000000
-
-static int contig_to_node[MAX_CONTIGS_COUNT];
-static char* node_names[MAX_NODES_COUNT];
-static int node_name_lengths[MAX_NODES_COUNT];
+// Contigs of one node are consecutive in the index, so every node is a run of contigs starting
+// at node_first_contigs[node]. Node names are stored one after another in a single arena.
+static int32_t* node_first_contigs = NULL;
+static size_t* node_name_offsets = NULL;
+static int* node_name_lengths = NULL;
+static int nodes_capacity = 0;
+static char* node_names_arena = NULL;
+static size_t node_names_arena_length = 0;
+static size_t node_names_arena_capacity = 0;
 static int nodes_count = 0;
 static int contigs_count = 0;
 
@@ -17,21 +20,62 @@ int get_node_from_contig(int contig) {
   if (contig < 0 || contig >= contigs_count) {
     fprintf(stderr, "[prophyle_index:%s] contig %d is outside of range [%d, %d]\n",
       __func__, contig, 0, contigs_count - 1);
+    return -1;
+  }
+  // last node starting at or before the contig
+  int left = 0;
+  int right = nodes_count;
+  while (right - left > 1) {
+    int middle = left + (right - left) / 2;
+    if (node_first_contigs[middle] <= contig) {
+      left = middle;
+    } else {
+      right = middle;
+    }
   }
-  return contig_to_node[contig];
+  return left;
 }
 
 char* get_node_name(int node) {
-  return node_names[node];
+  return node_names_arena + node_name_offsets[node];
 }
 
 int get_node_name_length(int node) {
   return node_name_lengths[node];
 }
 
+int get_nodes_count() {
+  return nodes_count;
+}
+
+static void add_node(const char* node_name, int length, int first_contig) {
+  if (nodes_count == nodes_capacity) {
+    nodes_capacity = nodes_capacity ? nodes_capacity << 1 : 1024;
+    node_first_contigs = realloc(node_first_contigs, nodes_capacity * sizeof(int32_t));
+    node_name_offsets = realloc(node_name_offsets, nodes_capacity * sizeof(size_t));
+    node_name_lengths = realloc(node_name_lengths, nodes_capacity * sizeof(int));
+    xassert(node_first_contigs && node_name_offsets && node_name_lengths,
+      "[prophyle_index] not enough memory for the nodes of the index\n");
+  }
+  if (node_names_arena_length + length + 1 > node_names_arena_capacity) {
+    while (node_names_arena_length + length + 1 > node_names_arena_capacity) {
+      node_names_arena_capacity = node_names_arena_capacity ? node_names_arena_capacity << 1 : 16384;
+    }
+    node_names_arena = realloc(node_names_arena, node_names_arena_capacity);
+    xassert(node_names_arena != NULL, "[prophyle_index] not enough memory for node names of the index\n");
+  }
+  memcpy(node_names_arena + node_names_arena_length, node_name, length);
+  node_names_arena[node_names_arena_length + length] = '\0';
+  node_first_contigs[nodes_count] = first_contig;
+  node_name_offsets[nodes_count] = node_names_arena_length;
+  node_name_lengths[nodes_count] = length;
+  node_names_arena_length += length + 1;
+  nodes_count++;
+}
+
 void add_contig(char* contig, int contig_number) {
-  xassert(contigs_count < MAX_CONTIGS_COUNT,
-    "[prophyle_index] there are more than MAX_CONTIGS_COUNT contigs, try to increase MAX_CONTIGS_COUNT in contig_node_translator.c\n");
+  xassert(contig_number == contigs_count,
+    "[prophyle_index] contigs have to be added in the order of the index\n");
   contigs_count++;
   const char* ch = strchr(contig, '@');
   int index = 0;
@@ -41,17 +85,7 @@ void add_contig(char* contig, int contig_number) {
     index = ch - contig;
   }
   contig[index] = '\0';
-  if (nodes_count == 0 || strcmp(contig, node_names[nodes_count - 1])) {
-    char* node_name = malloc((index + 1) * sizeof(char));
-    memcpy(node_name, contig, index);
-    node_name[index] = '\0';
-    xassert(nodes_count < MAX_NODES_COUNT,
-      "[prophyle_index] there are more than MAX_NODES_COUNT nodes, try to increase MAX_NODES_COUNT in contig_node_translator.c\n");
-    node_names[nodes_count] = node_name;
-    node_name_lengths[nodes_count] = strlen(node_name);
-    contig_to_node[contig_number] = nodes_count;
-    nodes_count++;
-  } else {
-    contig_to_node[contig_number] = nodes_count - 1;
+  if (nodes_count == 0 || strcmp(contig, get_node_name(nodes_count - 1))) {
+    add_node(contig, index, contig_number);
   }
 }
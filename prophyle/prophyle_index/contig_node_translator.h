@@ -12,6 +12,7 @@
 int get_node_from_contig(int contig);
 char* get_node_name(int node);
 int get_node_name_length(int node);
+int get_nodes_count();
 void add_contig(char* contig, int contig_number);
 
 #endif //CONTIG_NODE_TRANSLATOR_H
@@ -3,74 +3,67 @@
 #include <stdint.h>
 #include "utils.h"
 #include "klcp.h"
+#include "prophyle_utils.h"
 
-int32_t position_of_smallest_zero_bit[MAX_BITARRAY_BLOCK_VALUE + 1];
-int32_t position_of_biggest_zero_bit[MAX_BITARRAY_BLOCK_VALUE + 1];
+// Version 1 files are seq_len followed by 16-bit blocks with the bit of position p stored at
+// bit 15 - p % 16 of block p / 16. Version 2 files start with a header and store 64-bit blocks.
+#define KLCP_FILE_MAGIC 0x0050434c4b4f5250ULL // "PROKLCP"
+#define KLCP_FILE_VERSION 2
+#define KLCP_FILE_HEADER_LENGTH (3 * sizeof(uint64_t))
+#define KLCP_V1_BITS_IN_BLOCK 16
 
 void destroy_klcp(klcp_t* klcp) {
 	if (klcp == 0) {
 		return;
 	}
-	destroy_bitarray(klcp->klcp);
+	if (klcp->mapping) {
+		prophyle_unmap_file(klcp->mapping, klcp->mapping_length);
+		free(klcp->klcp);
+	} else {
+		destroy_bitarray(klcp->klcp);
+	}
 	free(klcp);
 }
 
+// Both functions find the ends of the run of set bits around the interval, i.e. of the SA interval
+// of the (k-1)-mer shared by the suffixes; a run is skipped a whole block at a time.
 uint64_t decrease_sa_position(const klcp_t* klcp, uint64_t k) {
-	int64_t new_position = (int64_t)k - 1;
-  int new_position_found = 0;
-  bitarray_block_t value = klcp->klcp->blocks[new_position / BITS_IN_BLOCK];
-	int64_t new_position_res = new_position % BITS_IN_BLOCK;
-  value = value >> (BITS_IN_BLOCK - 1 - new_position_res);
-  if (value == (1 << (new_position_res + 1)) - 1) {
-    new_position -= (new_position_res + 1);
-  } else {
-    new_position -= position_of_smallest_zero_bit[value];
-    new_position_found = 1;
-  }
-  if (!new_position_found) {
-  	while (new_position >= 0) {
-  		bitarray_block_t value = klcp->klcp->blocks[new_position / BITS_IN_BLOCK];
-      if (value == MAX_BITARRAY_BLOCK_VALUE) {
-        new_position -= BITS_IN_BLOCK;
-      } else {
-        new_position -= position_of_smallest_zero_bit[value];
-        break;
-      }
-    }
-  }
-  new_position++;
-	return (uint64_t)new_position;
+	if (k == 0) {
+		return 0;
+	}
+	const bitarray_block_t* blocks = klcp->klcp->blocks;
+	int64_t position = (int64_t)k - 1;
+	int64_t block = position / BITS_IN_BLOCK;
+	// zero bits at positions <= position in the block, the one of position is moved to the top bit
+	bitarray_block_t zeros = ~blocks[block] << (BITS_IN_BLOCK - 1 - position % BITS_IN_BLOCK);
+	while (zeros == 0) {
+		if (--block < 0) {
+			return 0;
+		}
+		position = block * BITS_IN_BLOCK + BITS_IN_BLOCK - 1;
+		zeros = ~blocks[block];
+	}
+	return (uint64_t)(position - __builtin_clzll(zeros) + 1);
 }
 
 uint64_t increase_sa_position(const klcp_t* klcp, uint64_t l) {
-	int64_t new_position = (int64_t)l;
-  int new_position_found = 0;
-  bitarray_block_t value = klcp->klcp->blocks[new_position / BITS_IN_BLOCK];
-  int64_t shift = BITS_IN_BLOCK - new_position % BITS_IN_BLOCK;
-  value = value & ((1 << shift) - 1);
-  if (value == (1 << shift) - 1) {
-    new_position += shift;
-  } else {
-    new_position += shift - 1 -
-      position_of_biggest_zero_bit[(bitarray_block_t)((1 << BITS_IN_BLOCK) - (1 << shift) + value)];
-    new_position_found = 1;
-  }
-  if (!new_position_found) {
-	   while (new_position < klcp->seq_len) {
-  		bitarray_block_t value = klcp->klcp->blocks[new_position / BITS_IN_BLOCK];
-      if (value == MAX_BITARRAY_BLOCK_VALUE) {
-        new_position += BITS_IN_BLOCK;
-      } else {
-        new_position += BITS_IN_BLOCK - 1 - position_of_biggest_zero_bit[value];
-        new_position_found = 1;
-        break;
-      }
-  	}
-  }
-  if (new_position > klcp->seq_len) {
-    new_position = klcp->seq_len;
-  }
-	return (uint64_t)new_position;
+	if (l >= klcp->seq_len) {
+		return klcp->seq_len;
+	}
+	const bitarray_block_t* blocks = klcp->klcp->blocks;
+	uint64_t position = l;
+	uint64_t block = position / BITS_IN_BLOCK;
+	// zero bits at positions >= position in the block, the one of position is moved to the lowest bit
+	bitarray_block_t zeros = ~blocks[block] >> (position % BITS_IN_BLOCK);
+	while (zeros == 0) {
+		if (++block == klcp->klcp->capacity) {
+			return klcp->seq_len;
+		}
+		position = block * BITS_IN_BLOCK;
+		zeros = ~blocks[block];
+	}
+	position += __builtin_ctzll(zeros);
+	return position < klcp->seq_len ? position : klcp->seq_len;
 }
 
 void construct_klcp_recursion(const bwt_t* bwt, bwtint_t k, bwtint_t l, int tree_depth, int kmer_length, klcp_t* klcp) {
@@ -81,10 +74,7 @@ void construct_klcp_recursion(const bwt_t* bwt, bwtint_t k, bwtint_t l, int tree
 		return;
 	}
 	if (tree_depth == kmer_length - 1) {
-		uint64_t sa_position;
-		for(sa_position = k; sa_position < l; ++sa_position) {
-			add_to_bitarray(klcp->klcp, sa_position);
-		}
+		add_range_to_bitarray(klcp->klcp, k, l);
 		return;
 	}
 	ubyte_t c = 0;
@@ -107,7 +97,8 @@ void klcp_dump(const char *fn, const klcp_t* klcp)
 {
 	FILE *fp;
 	fp = xopen(fn, "wb");
-	err_fwrite(&klcp->seq_len, sizeof(uint64_t), 1, fp);
+	uint64_t header[3] = {KLCP_FILE_MAGIC, KLCP_FILE_VERSION, klcp->seq_len};
+	err_fwrite(header, sizeof(uint64_t), 3, fp);
 	err_fwrite(klcp->klcp->blocks, sizeof(bitarray_block_t), klcp->klcp->capacity, fp);
 	err_fflush(fp);
 	err_fclose(fp);
@@ -125,59 +116,126 @@ static bwtint_t fread_fix(FILE *fp, bwtint_t size, void *a)
 	return offset;
 }
 
-int32_t find_smallest_zero_index(bitarray_block_t value) {
-  int32_t position = 0;
-  while (position < BITS_IN_BLOCK) {
-    if ((value & (1 << position)) != 0) {
-      position++;
-    } else {
-      break;
-    }
-  }
-  return position;
+static void klcp_init_blocks(klcp_t* klcp, uint64_t seq_len) {
+	klcp->seq_len = seq_len;
+	klcp->mapping = NULL;
+	klcp->mapping_length = 0;
+	klcp->klcp->size = seq_len;
+	klcp->klcp->capacity = (seq_len + BITS_IN_BLOCK - 1) / BITS_IN_BLOCK;
 }
 
-int32_t find_biggest_zero_index(bitarray_block_t value) {
-  int32_t position = BITS_IN_BLOCK - 1;
-  while (position >= 0) {
-    if ((value & (1 << position)) != 0) {
-      position--;
-    } else {
-      break;
-    }
-  }
-  return position;
+// converts blocks of a version 1 file that follow seq_len in fp
+static void klcp_restore_v1_blocks(FILE* fp, klcp_t* klcp) {
+	uint64_t v1_capacity = (klcp->seq_len + KLCP_V1_BITS_IN_BLOCK - 1) / KLCP_V1_BITS_IN_BLOCK;
+	uint16_t* v1_blocks = malloc(v1_capacity * sizeof(uint16_t));
+	fread_fix(fp, sizeof(uint16_t) * v1_capacity, v1_blocks);
+	klcp->klcp->blocks = (bitarray_block_t*)calloc(klcp->klcp->capacity, sizeof(bitarray_block_t));
+	uint64_t position;
+	for (position = 0; position < klcp->seq_len; ++position) {
+		if ((v1_blocks[position / KLCP_V1_BITS_IN_BLOCK] >> (KLCP_V1_BITS_IN_BLOCK - 1 - position % KLCP_V1_BITS_IN_BLOCK)) & 1) {
+			add_to_bitarray(klcp->klcp, position);
+		}
+	}
+	free(v1_blocks);
 }
 
 void klcp_restore(const char *fn, klcp_t* klcp)
 {
 	FILE *fp;
 	fp = xopen(fn, "rb");
-	err_fread_noeof(&klcp->seq_len, sizeof(uint64_t), 1, fp);
-	klcp->klcp->size = klcp->seq_len;
-	klcp->klcp->capacity = (klcp->seq_len + BITS_IN_BLOCK - 1) / BITS_IN_BLOCK;
-	klcp->klcp->blocks = (bitarray_block_t*)calloc(klcp->klcp->capacity, sizeof(bitarray_block_t));
-	fread_fix(fp, sizeof(bitarray_block_t) * klcp->klcp->capacity, klcp->klcp->blocks);
+	uint64_t first_word;
+	err_fread_noeof(&first_word, sizeof(uint64_t), 1, fp);
+	if (first_word == KLCP_FILE_MAGIC) {
+		uint64_t version, seq_len;
+		err_fread_noeof(&version, sizeof(uint64_t), 1, fp);
+		if (version != KLCP_FILE_VERSION) {
+			err_fatal(__func__, "unsupported version %llu of klcp file '%s'", (unsigned long long)version, fn);
+		}
+		err_fread_noeof(&seq_len, sizeof(uint64_t), 1, fp);
+		klcp_init_blocks(klcp, seq_len);
+		klcp->klcp->blocks = (bitarray_block_t*)calloc(klcp->klcp->capacity, sizeof(bitarray_block_t));
+		fread_fix(fp, sizeof(bitarray_block_t) * klcp->klcp->capacity, klcp->klcp->blocks);
+	} else {
+		fprintf(stderr, "[prophyle_index:%s] klcp file %s has the old format, "
+			"it can be converted by prophyle_index klcpupdate\n", __func__, fn);
+		klcp_init_blocks(klcp, first_word);
+		klcp_restore_v1_blocks(fp, klcp);
+	}
 	err_fclose(fp);
-  uint64_t i;
-  for(i = 0; i <= MAX_BITARRAY_BLOCK_VALUE; ++i) {
-    position_of_smallest_zero_bit[i] = find_smallest_zero_index((bitarray_block_t)i);
-		position_of_biggest_zero_bit[i] = find_biggest_zero_index((bitarray_block_t)i);
-  }
 }
 
-klcp_t* construct_klcp(const bwt_t *bwt, const int kmer_length) {
+void klcp_restore_mmap(const char *fn, klcp_t* klcp)
+{
+	size_t length;
+	char* addr = prophyle_map_file(fn, &length);
+	uint64_t header[3] = {0, 0, 0};
+	if (length >= KLCP_FILE_HEADER_LENGTH) {
+		memcpy(header, addr, KLCP_FILE_HEADER_LENGTH);
+	}
+	if (header[0] != KLCP_FILE_MAGIC || header[1] != KLCP_FILE_VERSION) {
+		// the old format cannot be used in place
+		prophyle_unmap_file(addr, length);
+		klcp_restore(fn, klcp);
+		return;
+	}
+	klcp_init_blocks(klcp, header[2]);
+	xassert(length == KLCP_FILE_HEADER_LENGTH + klcp->klcp->capacity * sizeof(bitarray_block_t),
+		"[prophyle_index] klcp file has unexpected size");
+	klcp->mapping = addr;
+	klcp->mapping_length = length;
+	klcp->klcp->blocks = (bitarray_block_t*)(addr + KLCP_FILE_HEADER_LENGTH);
+}
+
+typedef struct {
+	const bwt_t* bwt;
+	int kmer_length;
+	int prefix_length;
+	klcp_t* klcp;
+} klcp_construction_t;
+
+// Subtree of the recursion for the prefix_length-mer number i; SA intervals of different
+// prefixes are disjoint, so the subtrees set disjoint ranges of the bitarray.
+static void construct_klcp_subtree(void* data, int i, int tid) {
+	const klcp_construction_t* construction = (const klcp_construction_t*)data;
+	const bwt_t* bwt = construction->bwt;
+	bwtint_t k = 0;
+	bwtint_t l = bwt->seq_len;
+	int depth;
+	for (depth = 0; depth < construction->prefix_length; ++depth) {
+		if (k >= l) {
+			return;
+		}
+		ubyte_t c = (i >> (2 * (construction->prefix_length - 1 - depth))) & 3;
+		bwtint_t new_k = 0;
+		bwtint_t new_l = 0;
+		bwt_2occ(bwt, k - 1, l, c, &new_k, &new_l);
+		k = bwt->L2[c] + new_k + 1;
+		l = bwt->L2[c] + new_l;
+	}
+	construct_klcp_recursion(bwt, k, l, construction->prefix_length, construction->kmer_length, construction->klcp);
+}
+
+klcp_t* construct_klcp(const bwt_t *bwt, const int kmer_length, const int n_threads) {
+	extern void kt_for(int n_threads, void (*func)(void*,int,int), void* data, int n);
 	double t_real;
 	t_real = realtime();
 	uint64_t n = bwt->seq_len;
   klcp_t* klcp = malloc(sizeof(klcp_t));
   klcp->seq_len = n;
+	klcp->mapping = NULL;
+	klcp->mapping_length = 0;
 	klcp->klcp = create_bitarray(n);
-	uint64_t i;
-	for(i = 0; i < klcp->klcp->capacity; ++i) {
-		klcp->klcp->blocks[i] = 0;
+	if (n_threads <= 1) {
+		construct_klcp_recursion(bwt, (bwtint_t)0, (bwtint_t)n, 0, kmer_length, klcp);
+	} else {
+		// enough prefixes for the threads to balance subtrees of very different sizes
+		klcp_construction_t construction = {bwt, kmer_length, 0, klcp};
+		while (construction.prefix_length < kmer_length - 1 && construction.prefix_length < 10
+				&& (1 << (2 * construction.prefix_length)) < 64 * n_threads) {
+			construction.prefix_length++;
+		}
+		kt_for(n_threads, construct_klcp_subtree, &construction, 1 << (2 * construction.prefix_length));
 	}
-	construct_klcp_recursion(bwt, (bwtint_t)0, (bwtint_t)n, 0, kmer_length, klcp);
 	fprintf(stderr, "[prophyle_index:%s]  time: %.3f sec; CPU: %.3f sec\n", __func__, realtime() - t_real, cputime());
 	return klcp;
 }
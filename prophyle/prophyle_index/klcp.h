@@ -13,12 +13,17 @@
 typedef struct {
   uint64_t seq_len;
   bitarray_t* klcp;
+  // file mapping holding the blocks if restored by klcp_restore_mmap
+  void* mapping;
+  size_t mapping_length;
 } klcp_t;
 
 void destroy_klcp(klcp_t* klcp);
 void klcp_dump(const char *fn, const klcp_t* klcp);
-klcp_t* construct_klcp(const bwt_t *bwt, const int kmer_length);
+klcp_t* construct_klcp(const bwt_t *bwt, const int kmer_length, const int n_threads);
 void klcp_restore(const char *fn, klcp_t* klcp);
+// blocks of the restored klcp point into a mapping of fn; files of the old format are read into memory
+void klcp_restore_mmap(const char *fn, klcp_t* klcp);
 uint64_t decrease_sa_position(const klcp_t* klcp, uint64_t position);
 uint64_t increase_sa_position(const klcp_t* klcp, uint64_t position);
 
@@ -7,6 +7,12 @@
 			prophyle_index build -k 20 -s index.fa
 		query reads for k=20 using rolling window search with 10 threads, writing output in results.txt:
 			prophyle_index query -u -k 20 -t 10 index.fa reads.fq > results.txt
+		query reads and assign them in the same process, writing SAM output in results.sam:
+			prophyle_index classify -u -k 20 -t 10 index.fa tree.nw reads.fq > results.sam
+		keep the index and the tree loaded and classify read files on requests sent to a Unix socket:
+			prophyle_index serve -u -k 20 -t 10 -S /tmp/prophyle.sock index.fa tree.nw
+		merge outputs of queries of three index shards into the output of the whole index:
+			prophyle_index merge nodes.txt shard.1.txt shard.2.txt shard.3.txt > results.txt
 */
 
 #include <stdio.h>
@@ -20,6 +26,8 @@
 #include "bwa.h"
 #include "prophyle_index_build.h"
 #include "bwa_utils.h"
+#include "prophyle_serve.h"
+#include "prophyle_merge.h"
 
 static int usage()
 {
@@ -31,17 +39,33 @@ static int usage()
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Command: build     construct index\n");
 	fprintf(stderr, "         query     query reads against index\n");
+	fprintf(stderr, "         classify  query reads against index and assign them to nodes of the tree\n");
+	fprintf(stderr, "         serve     keep index loaded and query read files on request\n");
+	fprintf(stderr, "         merge     merge query outputs of index shards\n");
 	fprintf(stderr, "\n");
 	return 1;
 }
 
-static int usage_build(){
+static int usage_build(int threads){
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Usage:   prophyle_index build <prefix>\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Options: -k INT    length of k-mer\n");
 	fprintf(stderr, "         -s        construct k-LCP and SA in parallel\n");
 	fprintf(stderr, "         -i        sampling distance for SA\n");
+	fprintf(stderr, "         -t INT    number of threads for k-LCP construction [%d]\n", threads);
+	fprintf(stderr, "\n");
+	return 1;
+}
+
+static int usage_merge(){
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Usage:   prophyle_index merge <nodes.txt> <shard_1.txt> [<shard_2.txt> ...]\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "         Outputs of prophyle_index query (the same reads in the same order) of shards of an index\n");
+	fprintf(stderr, "         with disjoint sets of nodes are merged into the output of the whole index. nodes.txt lists\n");
+	fprintf(stderr, "         the nodes in the order of the whole index, one per line (see prophyle_split_index.py).\n");
+	fprintf(stderr, "         Shards must be queried with the same k, without -s and -v; - stands for stdin.\n");
 	fprintf(stderr, "\n");
 	return 1;
 }
@@ -53,21 +77,162 @@ static int usage_debwtupdate(){
 	return 1;
 }
 
-static int usage_query(int threads){
+static int usage_klcpupdate(){
 	fprintf(stderr, "\n");
-	fprintf(stderr, "Usage:   prophyle_index query [options] <prefix> <in.fq>\n");
+	fprintf(stderr, "Usage:   prophyle_index klcpupdate input.klcp output.klcp\n");
 	fprintf(stderr, "\n");
-	fprintf(stderr, "Options: -k INT    length of k-mer\n");
+	return 1;
+}
+
+// options of querying shared by query, classify and serve
+#define QUERY_OPTIONS "l:psd:w:uk:bt:K:Mc:"
+// options of the assignment shared by classify and serve
+#define ASSIGNMENT_OPTIONS "f:m:ALXD"
+
+static void usage_query_options(const char* first_indent, int threads, int batch_size, int cache_size){
+	fprintf(stderr, "%s-k INT    length of k-mer\n", first_indent);
 	fprintf(stderr, "         -u        use k-LCP for querying\n");
-	fprintf(stderr, "         -v        output set of chromosomes for every k-mer\n");
 	fprintf(stderr, "         -p        do not check whether k-mer is on border of two contigs, and show such k-mers in output\n");
+	fprintf(stderr, "         -s        do not search k-mers overlapping the nucleotide at which a search failed\n");
+	fprintf(stderr, "         -d INT    search only every INT-th k-mer, the others get the nodes of the previous one [1]\n");
+	fprintf(stderr, "         -w INT    search only minimizers of windows of INT k-mers, the others get the nodes of the previous one\n");
 	fprintf(stderr, "         -b        print sequences and base qualities\n");
 	fprintf(stderr, "         -l STR    log file name to output statistics\n");
 	fprintf(stderr, "         -t INT    number of threads [%d]\n", threads);
+	fprintf(stderr, "         -K INT    number of reads in one batch [%d]\n", batch_size);
+	fprintf(stderr, "         -M        memory-map index files, so that the index is shared by concurrent processes\n");
+	fprintf(stderr, "         -c INT    max number of cached node sets of large SA intervals, 0 to disable [%d]\n", cache_size);
+	fprintf(stderr, "                   (at most INT*%d node ids, node sets exceeding them are not cached)\n", NODE_SET_CACHE_MEAN_NODES);
+}
+
+static void usage_assignment_options(){
+	fprintf(stderr, "         -f STR    format of output: sam, kraken [sam]\n");
+	fprintf(stderr, "         -m STR    measure: h1=hitnumber, c1=coverage [h1]\n");
+	fprintf(stderr, "         -A        annotate assignments\n");
+	fprintf(stderr, "         -L        use LCA when tie (multiple hits with the same score)\n");
+	fprintf(stderr, "         -X        replace k-mer matches by their LCA\n");
+	fprintf(stderr, "         -D        do not translate blocks from node to tax IDs\n");
+}
+
+static int usage_query(int threads, int batch_size, int cache_size){
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Usage:   prophyle_index query [options] <prefix> <in.fq> [<in_2.fq>]\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "         Mates from in.fq and in_2.fq are matched together as one read.\n");
+	fprintf(stderr, "\n");
+	usage_query_options("Options: ", threads, batch_size, cache_size);
+	fprintf(stderr, "         -v        output set of chromosomes for every k-mer\n");
+	fprintf(stderr, "\n");
+	return 1;
+}
+
+static int usage_classify(int threads, int batch_size, int cache_size){
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Usage:   prophyle_index classify [options] <prefix> <newick_fn> <in.fq> [<in_2.fq>]\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "         Mates from in.fq and in_2.fq are classified together as one read.\n");
+	fprintf(stderr, "\n");
+	usage_query_options("Options: ", threads, batch_size, cache_size);
+	usage_assignment_options();
 	fprintf(stderr, "\n");
 	return 1;
 }
 
+static int usage_serve(int threads, int batch_size, int cache_size){
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Usage:   prophyle_index serve [options] <prefix> [<newick_fn>]\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "         Requests '<in.fq>\\t<out_fn>' ('<in.1.fq>\\t<in.2.fq>\\t<out_fn>' for\n");
+	fprintf(stderr, "         paired-end reads) are read line by line and answered 'OK\\t<reads>'\n");
+	fprintf(stderr, "         or 'ERROR\\t<message>'; 'quit' closes the connection, 'shutdown' stops\n");
+	fprintf(stderr, "         the server. Reads are assigned if newick_fn is given.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Options: -S STR    Unix socket to listen on [requests from stdin]\n");
+	usage_query_options("         ", threads, batch_size, cache_size);
+	usage_assignment_options();
+	fprintf(stderr, "\n");
+	return 1;
+}
+
+static int parse_assignment_format(const char* value, prophyle_index_opt_t* opt)
+{
+	if (strcmp(value, "sam") == 0) opt->assignment_format = ASSIGNMENT_FORMAT_SAM;
+	else if (strcmp(value, "kraken") == 0) opt->assignment_format = ASSIGNMENT_FORMAT_KRAKEN;
+	else {
+		fprintf(stderr, "[prophyle_index:%s] unknown output format '%s'\n", __func__, value);
+		return 1;
+	}
+	return 0;
+}
+
+static int parse_assignment_measure(const char* value, prophyle_index_opt_t* opt)
+{
+	if (strcmp(value, "h1") == 0) opt->assignment_measure = ASSIGNMENT_MEASURE_H1;
+	else if (strcmp(value, "c1") == 0) opt->assignment_measure = ASSIGNMENT_MEASURE_C1;
+	else {
+		fprintf(stderr, "[prophyle_index:%s] unknown measure '%s'\n", __func__, value);
+		return 1;
+	}
+	return 0;
+}
+
+// Returns 0 if c is an option of QUERY_OPTIONS, -1 otherwise.
+static int parse_query_option(int c, char* value, prophyle_index_opt_t* opt)
+{
+	switch (c) {
+	case 'u': opt->use_klcp = 1; break;
+	case 'k': opt->kmer_length = atoi(value); break;
+	case 's': opt->skip_after_fail = 1; break;
+	case 'd': opt->sampling_distance = atoi(value); break;
+	case 'w': opt->minimizer_window = atoi(value); break;
+	case 'p': opt->skip_positions_on_border = 0; break;
+	case 'l': { opt->need_log = 1; opt->log_file_name = value; break; }
+	case 'b': opt->output_read_qual = 1; break;
+	case 't': opt->n_threads = atoi(value); break;
+	case 'K': opt->batch_size = atoi(value); break;
+	case 'M': opt->use_mmap = 1; break;
+	case 'c': opt->cache_size = atoi(value); break;
+	default: return -1;
+	}
+	return 0;
+}
+
+// Returns 0 if c is an option of ASSIGNMENT_OPTIONS, 1 for a wrong value, -1 otherwise.
+static int parse_assignment_option(int c, char* value, prophyle_index_opt_t* opt)
+{
+	switch (c) {
+	case 'f': return parse_assignment_format(value, opt);
+	case 'm': return parse_assignment_measure(value, opt);
+	case 'A': opt->assignment_annotate = 1; break;
+	case 'L': opt->assignment_tie_lca = 1; break;
+	case 'X': opt->assignment_kmer_lca = 1; break;
+	case 'D': opt->assignment_not_translate_blocks = 1; break;
+	default: return -1;
+	}
+	return 0;
+}
+
+static int check_query_options(const prophyle_index_opt_t* opt)
+{
+	if (opt->batch_size <= 0) {
+		fprintf(stderr, "[prophyle_index:%s] batch size (-K) should be positive\n", __func__);
+		return 1;
+	}
+	if (opt->sampling_distance <= 0) {
+		fprintf(stderr, "[prophyle_index:%s] sampling distance (-d) should be positive\n", __func__);
+		return 1;
+	}
+	if (opt->minimizer_window < 0) {
+		fprintf(stderr, "[prophyle_index:%s] minimizer window (-w) should be positive\n", __func__);
+		return 1;
+	}
+	if (opt->sampling_distance > 1 && opt->minimizer_window > 1) {
+		fprintf(stderr, "[prophyle_index:%s] -d and -w cannot be combined\n", __func__);
+		return 1;
+	}
+	return 0;
+}
+
 int prophyle_index_query(int argc, char *argv[])
 {
 	int c;
@@ -75,26 +240,24 @@ int prophyle_index_query(int argc, char *argv[])
 	char *prefix;
 
 	opt = prophyle_index_init_opt();
-	while ((c = getopt(argc, argv, "l:psuvk:bt:")) >= 0) {
-		switch (c) {
-		case 'v': { opt->output_old = 1; opt->output = 0; } break;
-		case 'u': opt->use_klcp = 1; break;
-		case 'k': opt->kmer_length = atoi(optarg); break;
-		case 's': opt->skip_after_fail = 1; break;
-		case 'p': opt->skip_positions_on_border = 0; break;
-		case 'l': { opt->need_log = 1; opt->log_file_name = optarg; break; }
-		case 'b': opt->output_read_qual = 1; break;
-		case 't': opt->n_threads = atoi(optarg); break;
-		default: return 1;
-		}
+	while ((c = getopt(argc, argv, QUERY_OPTIONS "v")) >= 0) {
+		if (c == 'v') { opt->output_old = 1; opt->output = 0; }
+		else if (parse_query_option(c, optarg, opt)) { free(opt); return 1; }
 	}
 	if (opt->output_old && opt->n_threads > 1) {
 		fprintf(stderr, "[prophyle_index:%s] -v option can be used only with one thread (-t 1)\n", __func__);
+		free(opt);
+		return 1;
+	}
+
+	if (check_query_options(opt)) {
+		free(opt);
 		return 1;
 	}
 
 	if (optind + 2 > argc) {
-		usage_query(opt->n_threads);
+		usage_query(opt->n_threads, opt->batch_size, opt->cache_size);
+		free(opt);
 		return 1;
 	}
 	if ((prefix = bwa_idx_infer_prefix(argv[optind])) == 0) {
@@ -102,11 +265,85 @@ int prophyle_index_query(int argc, char *argv[])
 		free(opt);
 		return 1;
 	}
-	query(prefix, argv[optind+1], opt);
+	query(prefix, argv[optind+1], optind + 2 < argc ? argv[optind+2] : NULL, opt);
 	free(opt); free(prefix);
 	return 0;
 }
 
+int prophyle_index_classify(int argc, char *argv[])
+{
+	int c;
+	prophyle_index_opt_t *opt;
+	char *prefix;
+
+	opt = prophyle_index_init_opt();
+	opt->assign = 1;
+	while ((c = getopt(argc, argv, QUERY_OPTIONS ASSIGNMENT_OPTIONS)) >= 0) {
+		int ret = parse_query_option(c, optarg, opt);
+		if (ret < 0) ret = parse_assignment_option(c, optarg, opt);
+		if (ret) { free(opt); return 1; }
+	}
+
+	if (check_query_options(opt)) {
+		free(opt);
+		return 1;
+	}
+
+	if (optind + 3 > argc) {
+		usage_classify(opt->n_threads, opt->batch_size, opt->cache_size);
+		free(opt);
+		return 1;
+	}
+	if ((prefix = bwa_idx_infer_prefix(argv[optind])) == 0) {
+		fprintf(stderr, "[prophyle_index:%s] fail to locate the index %s\n", __func__, argv[optind]);
+		free(opt);
+		return 1;
+	}
+	opt->tree_fn = argv[optind+1];
+	query(prefix, argv[optind+2], optind + 3 < argc ? argv[optind+3] : NULL, opt);
+	free(opt); free(prefix);
+	return 0;
+}
+
+int prophyle_index_serve(int argc, char *argv[])
+{
+	int c;
+	prophyle_index_opt_t *opt;
+	char *prefix;
+
+	opt = prophyle_index_init_opt();
+	char* socket_path = NULL;
+	while ((c = getopt(argc, argv, "S:" QUERY_OPTIONS ASSIGNMENT_OPTIONS)) >= 0) {
+		if (c == 'S') { socket_path = optarg; continue; }
+		int ret = parse_query_option(c, optarg, opt);
+		if (ret < 0) ret = parse_assignment_option(c, optarg, opt);
+		if (ret) { free(opt); return 1; }
+	}
+
+	if (check_query_options(opt)) {
+		free(opt);
+		return 1;
+	}
+
+	if (optind + 1 > argc) {
+		usage_serve(opt->n_threads, opt->batch_size, opt->cache_size);
+		free(opt);
+		return 1;
+	}
+	if ((prefix = bwa_idx_infer_prefix(argv[optind])) == 0) {
+		fprintf(stderr, "[prophyle_index:%s] fail to locate the index %s\n", __func__, argv[optind]);
+		free(opt);
+		return 1;
+	}
+	if (optind + 1 < argc) {
+		opt->assign = 1;
+		opt->tree_fn = argv[optind+1];
+	}
+	int ret = serve(prefix, opt, socket_path);
+	free(opt); free(prefix);
+	return ret;
+}
+
 int prophyle_index_build(int argc, char *argv[])
 {
 	int c;
@@ -114,16 +351,17 @@ int prophyle_index_build(int argc, char *argv[])
 	char *prefix;
 	opt = prophyle_index_init_opt();
 	int sa_intv = 32;
-	while ((c = getopt(argc, argv, "si:k:")) >= 0) {
+	while ((c = getopt(argc, argv, "si:k:t:")) >= 0) {
 		switch (c) {
 		case 'k': opt->kmer_length = atoi(optarg); break;
+		case 't': opt->n_threads = atoi(optarg); break;
 		case 'i': sa_intv = atoi(optarg); break;
 		case 's': opt->construct_sa_parallel = 1; break;
 		default: return 1;
 		}
 	}
 	if (optind + 1 > argc) {
-		usage_build();
+		usage_build(opt->n_threads);
 		return 1;
 	}
 	if ((prefix = bwa_idx_infer_prefix(argv[optind])) == 0) {
@@ -135,6 +373,15 @@ int prophyle_index_build(int argc, char *argv[])
 	return 0;
 }
 
+int prophyle_index_merge(int argc, char *argv[])
+{
+	if (argc < 2) {
+		return usage_merge();
+	}
+	merge_shards(argv[0], argc - 1, argv + 1, stdout);
+	return 0;
+}
+
 int prophyle_debwtupdate(int argc, char *argv[])
 {
 	if (argc < 2) {
@@ -143,13 +390,25 @@ int prophyle_debwtupdate(int argc, char *argv[])
 	return debwtupdate(argv[0], argv[1]);
 }
 
+int prophyle_klcpupdate(int argc, char *argv[])
+{
+	if (argc < 2) {
+		return usage_klcpupdate();
+	}
+	return klcpupdate(argv[0], argv[1]);
+}
+
 int main(int argc, char *argv[])
 {
 	int ret = 0;
 	if (argc < 2) return usage();
 	if (strcmp(argv[1], "build") == 0) ret = prophyle_index_build(argc - 1, argv + 1);
 	else if (strcmp(argv[1], "query") == 0) ret = prophyle_index_query(argc - 1, argv+1);
+	else if (strcmp(argv[1], "classify") == 0) ret = prophyle_index_classify(argc - 1, argv+1);
+	else if (strcmp(argv[1], "serve") == 0) ret = prophyle_index_serve(argc - 1, argv+1);
+	else if (strcmp(argv[1], "merge") == 0) ret = prophyle_index_merge(argc - 2, argv + 2);
 	else if (strcmp(argv[1], "debwtupdate") == 0) ret = prophyle_debwtupdate(argc - 2, argv + 2);
+	else if (strcmp(argv[1], "klcpupdate") == 0) ret = prophyle_klcpupdate(argc - 2, argv + 2);
 	else return usage();
 
 	return ret;
@@ -0,0 +1,134 @@
+#include <stdlib.h>
+#include <string.h>
+#include "node_set_cache.h"
+
+#define NODE_SET_CACHE_MAX_LOCKS 1024
+
+node_set_cache_t* node_set_cache_init(size_t capacity)
+{
+	node_set_cache_t* cache = malloc(sizeof(node_set_cache_t));
+	cache->sets_cnt = 1;
+	while (cache->sets_cnt * NODE_SET_CACHE_WAYS < capacity) {
+		cache->sets_cnt <<= 1;
+	}
+	size_t entries_cnt = cache->sets_cnt * NODE_SET_CACHE_WAYS;
+	cache->entries = malloc(entries_cnt * sizeof(node_set_cache_entry_t));
+	size_t i;
+	for (i = 0; i < entries_cnt; ++i) {
+		// empty interval marks a free entry
+		cache->entries[i].k = 1;
+		cache->entries[i].l = 0;
+		cache->entries[i].nodes_cnt = 0;
+		cache->entries[i].nodes = NULL;
+	}
+	cache->locks_cnt = cache->sets_cnt < NODE_SET_CACHE_MAX_LOCKS ? cache->sets_cnt : NODE_SET_CACHE_MAX_LOCKS;
+	cache->locks = malloc(cache->locks_cnt * sizeof(pthread_mutex_t));
+	for (i = 0; i < cache->locks_cnt; ++i) {
+		pthread_mutex_init(&cache->locks[i], NULL);
+	}
+	cache->entries_cnt = 0;
+	cache->evictions = 0;
+	cache->nodes_cnt = 0;
+	cache->max_nodes = (int64_t)capacity * NODE_SET_CACHE_MEAN_NODES;
+	cache->rejections = 0;
+	return cache;
+}
+
+void node_set_cache_destroy(node_set_cache_t* cache)
+{
+	if (!cache) {
+		return;
+	}
+	size_t i;
+	for (i = 0; i < cache->sets_cnt * NODE_SET_CACHE_WAYS; ++i) {
+		free(cache->entries[i].nodes);
+	}
+	for (i = 0; i < cache->locks_cnt; ++i) {
+		pthread_mutex_destroy(&cache->locks[i]);
+	}
+	free(cache->locks);
+	free(cache->entries);
+	free(cache);
+}
+
+static inline size_t node_set_cache_set(const node_set_cache_t* cache, uint64_t k, uint64_t l)
+{
+	uint64_t h = (k * 0x9e3779b97f4a7c15ULL) ^ (l * 0xc2b2ae3d27d4eb4fULL);
+	h ^= h >> 29;
+	return h & (cache->sets_cnt - 1);
+}
+
+int node_set_cache_get(node_set_cache_t* cache, uint64_t k, uint64_t l, int32_t* nodes, int32_t* nodes_cnt)
+{
+	size_t set = node_set_cache_set(cache, k, l);
+	node_set_cache_entry_t* entries = cache->entries + set * NODE_SET_CACHE_WAYS;
+	pthread_mutex_t* lock = &cache->locks[set & (cache->locks_cnt - 1)];
+	int found = 0;
+	pthread_mutex_lock(lock);
+	int way;
+	for (way = 0; way < NODE_SET_CACHE_WAYS; ++way) {
+		if (entries[way].k == k && entries[way].l == l) {
+			*nodes_cnt = entries[way].nodes_cnt;
+			memcpy(nodes, entries[way].nodes, entries[way].nodes_cnt * sizeof(int32_t));
+			found = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(lock);
+	return found;
+}
+
+void node_set_cache_put(node_set_cache_t* cache, uint64_t k, uint64_t l, const int32_t* nodes, int32_t nodes_cnt)
+{
+	size_t set = node_set_cache_set(cache, k, l);
+	node_set_cache_entry_t* entries = cache->entries + set * NODE_SET_CACHE_WAYS;
+	pthread_mutex_t* lock = &cache->locks[set & (cache->locks_cnt - 1)];
+	// copied outside of the lock, a concurrent put of the same interval just wastes it
+	int32_t* copy = malloc((nodes_cnt > 0 ? nodes_cnt : 1) * sizeof(int32_t));
+	memcpy(copy, nodes, nodes_cnt * sizeof(int32_t));
+	pthread_mutex_lock(lock);
+	int victim = -1;
+	int way;
+	for (way = 0; way < NODE_SET_CACHE_WAYS; ++way) {
+		if (entries[way].k == k && entries[way].l == l) {
+			break;
+		}
+		if (entries[way].k > entries[way].l) {
+			if (victim == -1 || entries[victim].k <= entries[victim].l) {
+				victim = way;
+			}
+		} else if (victim == -1 || (entries[victim].k <= entries[victim].l
+				&& entries[way].l - entries[way].k < entries[victim].l - entries[victim].k)) {
+			victim = way;
+		}
+	}
+	if (way < NODE_SET_CACHE_WAYS) {
+		pthread_mutex_unlock(lock);
+		free(copy);
+		return;
+	}
+	node_set_cache_entry_t* entry = entries + victim;
+	const int64_t added_nodes = nodes_cnt - (entry->k > entry->l ? 0 : entry->nodes_cnt);
+	if (added_nodes > 0 && __sync_add_and_fetch(&cache->nodes_cnt, added_nodes) > cache->max_nodes) {
+		__sync_fetch_and_sub(&cache->nodes_cnt, added_nodes);
+		__sync_fetch_and_add(&cache->rejections, 1);
+		pthread_mutex_unlock(lock);
+		free(copy);
+		return;
+	}
+	if (added_nodes <= 0) {
+		__sync_fetch_and_add(&cache->nodes_cnt, added_nodes);
+	}
+	int32_t* evicted = entry->nodes;
+	if (entry->k > entry->l) {
+		__sync_fetch_and_add(&cache->entries_cnt, 1);
+	} else {
+		__sync_fetch_and_add(&cache->evictions, 1);
+	}
+	entry->k = k;
+	entry->l = l;
+	entry->nodes_cnt = nodes_cnt;
+	entry->nodes = copy;
+	pthread_mutex_unlock(lock);
+	free(evicted);
+}
@@ -0,0 +1,50 @@
+/*
+	Cache of node sets of large SA intervals shared by all query threads, so that k-mers from
+	conserved regions are translated to nodes only once.
+	Author: Kamil Salikhov <salikhov.kamil@gmail.com>
+	Licence: MIT
+*/
+
+#ifndef NODE_SET_CACHE_H
+#define NODE_SET_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+// smaller intervals are cheaper to translate than to look up
+#define NODE_SET_CACHE_MIN_INTERVAL 16
+#define NODE_SET_CACHE_WAYS 4
+// cached node ids per interval on average, so that the memory of the cache is bounded
+#define NODE_SET_CACHE_MEAN_NODES 16
+
+typedef struct {
+	uint64_t k;
+	uint64_t l;
+	int32_t nodes_cnt;
+	int32_t* nodes;
+} node_set_cache_entry_t;
+
+// Set-associative table, a full set evicts its smallest interval. Sets are guarded by a
+// fixed number of locks. Node sets which would exceed max_nodes cached node ids are not cached.
+typedef struct {
+	node_set_cache_entry_t* entries;
+	size_t sets_cnt;
+	pthread_mutex_t* locks;
+	size_t locks_cnt;
+	int64_t entries_cnt;
+	int64_t evictions;
+	int64_t nodes_cnt;
+	int64_t max_nodes;
+	int64_t rejections;
+} node_set_cache_t;
+
+// capacity is the maximal number of cached intervals, with NODE_SET_CACHE_MEAN_NODES node ids each
+// on average
+node_set_cache_t* node_set_cache_init(size_t capacity);
+void node_set_cache_destroy(node_set_cache_t* cache);
+// copies the cached sorted node set of [k, l] to nodes and returns 1, or returns 0 if not cached
+int node_set_cache_get(node_set_cache_t* cache, uint64_t k, uint64_t l, int32_t* nodes, int32_t* nodes_cnt);
+void node_set_cache_put(node_set_cache_t* cache, uint64_t k, uint64_t l, const int32_t* nodes, int32_t nodes_cnt);
+
+#endif //NODE_SET_CACHE_H
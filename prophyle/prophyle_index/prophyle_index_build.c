@@ -11,13 +11,14 @@ typedef struct {
 	klcp_t* klcp;
 	bwt_t* bwt;
 	int kmer_length;
+	int n_threads;
 	const char* prefix;
 	int sa_intv;
 } klcp_data_t;
 
 void* construct_klcp_parallel(void* data) {
 	klcp_data_t* klcp_data = (klcp_data_t*)data;
-	klcp_data->klcp = construct_klcp(klcp_data->bwt, klcp_data->kmer_length);
+	klcp_data->klcp = construct_klcp(klcp_data->bwt, klcp_data->kmer_length, klcp_data->n_threads);
 	return 0;
 }
 
@@ -46,6 +47,7 @@ void build_index(const char *prefix, const prophyle_index_opt_t *opt, int sa_int
 		klcp_data_t* klcp_data = malloc(sizeof(klcp_data_t));
 		klcp_data->bwt = bwt;
 		klcp_data->kmer_length = opt->kmer_length;
+		klcp_data->n_threads = opt->n_threads;
 		klcp_data->prefix = prefix;
 		klcp_data->sa_intv = sa_intv;
 		pthread_t tid[2];
@@ -60,7 +62,7 @@ void build_index(const char *prefix, const prophyle_index_opt_t *opt, int sa_int
 		xassert(!status_addr_sa, "[prophyle_index] error sa parallel construction, try construction separate from klcp\n");
 		klcp = klcp_data->klcp;
 	} else {
-		klcp = construct_klcp(bwt, opt->kmer_length);
+		klcp = construct_klcp(bwt, opt->kmer_length, opt->n_threads);
 	}
 	char* fn = malloc((strlen(prefix) + 10) * sizeof(char));
 	strcpy(fn, prefix);
@@ -106,3 +108,12 @@ int debwtupdate(const char* bwt_input_file, const char* bwt_output_file) {
 	bwt_destroy(bwt);
 	return 0;
 }
+
+int klcpupdate(const char* klcp_input_file, const char* klcp_output_file) {
+	klcp_t* klcp = malloc(sizeof(klcp_t));
+	klcp->klcp = malloc(sizeof(bitarray_t));
+	klcp_restore(klcp_input_file, klcp);
+	klcp_dump(klcp_output_file, klcp);
+	destroy_klcp(klcp);
+	return 0;
+}
@@ -11,5 +11,7 @@
 
 void build_index(const char *prefix, const prophyle_index_opt_t *opt, int sa_intv);
 int debwtupdate(const char* bwt_input_file, const char* bwt_output_file);
+// rewrites a klcp file of any supported format in the current one
+int klcpupdate(const char* klcp_input_file, const char* klcp_output_file);
 
 #endif //PROPHYLE_INDEX_BUILD_H
@@ -0,0 +1,406 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "prophyle_merge.h"
+#include "kstring.h"
+#include "utils.h"
+
+#define MERGE_NODES 0
+#define MERGE_UNMATCHED 1
+#define MERGE_AMBIGUOUS 2
+
+typedef struct {
+	const char* name;
+	int32_t rank;
+} merge_node_t;
+
+typedef struct {
+	merge_node_t* nodes;
+	char** names;
+	int32_t nodes_cnt;
+} merge_nodes_t;
+
+typedef struct {
+	int type;
+	int32_t size;
+	size_t ranks_offset;
+	int32_t ranks_cnt;
+} merge_block_t;
+
+// a shard with the fields and the parsed blocks of its current line
+typedef struct {
+	const char* fn;
+	FILE* file;
+	char* line;
+	size_t line_capacity;
+	char* name;
+	char* length;
+	char* rest;
+	merge_block_t* blocks;
+	size_t blocks_cnt;
+	size_t blocks_capacity;
+	int32_t* ranks;
+	size_t ranks_cnt;
+	size_t ranks_capacity;
+	// position in the blocks while merging
+	size_t block;
+	int32_t used;
+} merge_shard_t;
+
+static int compare_nodes(const void* a, const void* b) {
+	return strcmp(((const merge_node_t*)a)->name, ((const merge_node_t*)b)->name);
+}
+
+static int compare_ranks(const void* a, const void* b) {
+	int32_t x = *(const int32_t*)a;
+	int32_t y = *(const int32_t*)b;
+	return (x > y) - (x < y);
+}
+
+// node names are sorted, so that they are found by a binary search
+static merge_nodes_t* merge_nodes_load(const char* nodes_fn) {
+	FILE* file = fopen(nodes_fn, "r");
+	if (file == NULL) {
+		err_fatal(__func__, "cannot open the list of nodes %s", nodes_fn);
+	}
+	merge_nodes_t* nodes = calloc(1, sizeof(merge_nodes_t));
+	size_t capacity = 0;
+	char* line = NULL;
+	size_t line_capacity = 0;
+	ssize_t length;
+	while ((length = getline(&line, &line_capacity, file)) >= 0) {
+		while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+			line[--length] = '\0';
+		}
+		if (length == 0) {
+			continue;
+		}
+		if (nodes->nodes_cnt == capacity) {
+			capacity = capacity ? capacity << 1 : 1024;
+			nodes->nodes = realloc(nodes->nodes, capacity * sizeof(merge_node_t));
+			nodes->names = realloc(nodes->names, capacity * sizeof(char*));
+		}
+		nodes->names[nodes->nodes_cnt] = strdup(line);
+		nodes->nodes[nodes->nodes_cnt].name = nodes->names[nodes->nodes_cnt];
+		nodes->nodes[nodes->nodes_cnt].rank = nodes->nodes_cnt;
+		nodes->nodes_cnt++;
+	}
+	free(line);
+	fclose(file);
+	qsort(nodes->nodes, nodes->nodes_cnt, sizeof(merge_node_t), compare_nodes);
+	int32_t i;
+	for (i = 1; i < nodes->nodes_cnt; ++i) {
+		if (strcmp(nodes->nodes[i - 1].name, nodes->nodes[i].name) == 0) {
+			err_fatal(__func__, "node '%s' is listed in %s twice", nodes->nodes[i].name, nodes_fn);
+		}
+	}
+	return nodes;
+}
+
+static void merge_nodes_destroy(merge_nodes_t* nodes) {
+	int32_t i;
+	for (i = 0; i < nodes->nodes_cnt; ++i) {
+		free(nodes->names[i]);
+	}
+	free(nodes->names);
+	free(nodes->nodes);
+	free(nodes);
+}
+
+static int32_t merge_nodes_rank(const merge_nodes_t* nodes, const char* name, const merge_shard_t* shard) {
+	merge_node_t key;
+	key.name = name;
+	const merge_node_t* node = bsearch(&key, nodes->nodes, nodes->nodes_cnt, sizeof(merge_node_t), compare_nodes);
+	if (node == NULL) {
+		err_fatal(__func__, "node '%s' from %s is not in the list of nodes", name, shard->fn);
+	}
+	return node->rank;
+}
+
+static void add_block(merge_shard_t* shard, int type, int32_t size) {
+	if (shard->blocks_cnt == shard->blocks_capacity) {
+		shard->blocks_capacity = shard->blocks_capacity ? shard->blocks_capacity << 1 : 64;
+		shard->blocks = realloc(shard->blocks, shard->blocks_capacity * sizeof(merge_block_t));
+	}
+	merge_block_t* block = shard->blocks + shard->blocks_cnt++;
+	block->type = type;
+	block->size = size;
+	block->ranks_offset = shard->ranks_cnt;
+	block->ranks_cnt = 0;
+}
+
+static void add_rank(merge_shard_t* shard, int32_t rank) {
+	if (shard->ranks_cnt == shard->ranks_capacity) {
+		shard->ranks_capacity = shard->ranks_capacity ? shard->ranks_capacity << 1 : 256;
+		shard->ranks = realloc(shard->ranks, shard->ranks_capacity * sizeof(int32_t));
+	}
+	shard->ranks[shard->ranks_cnt++] = rank;
+	shard->blocks[shard->blocks_cnt - 1].ranks_cnt++;
+}
+
+// Blocks "<node>,<node>:<size>", "0:<size>" (no node) and "A:<size>" (ambiguous) are separated by spaces,
+// the line is modified in place.
+static void parse_blocks(merge_shard_t* shard, const merge_nodes_t* nodes, char* blocks) {
+	shard->blocks_cnt = 0;
+	shard->ranks_cnt = 0;
+	shard->block = 0;
+	shard->used = 0;
+	char* token = blocks;
+	while (*token) {
+		char* end = strchr(token, ' ');
+		if (end) {
+			*end = '\0';
+		}
+		char* colon = strrchr(token, ':');
+		if (colon == NULL) {
+			err_fatal(__func__, "malformed block '%s' of read %s in %s", token, shard->name, shard->fn);
+		}
+		*colon = '\0';
+		int32_t size = atoi(colon + 1);
+		if (strcmp(token, "A") == 0) {
+			add_block(shard, MERGE_AMBIGUOUS, size);
+		} else if (strcmp(token, "0") == 0) {
+			add_block(shard, MERGE_UNMATCHED, size);
+		} else {
+			add_block(shard, MERGE_NODES, size);
+			char* name = token;
+			while (name) {
+				char* comma = strchr(name, ',');
+				if (comma) {
+					*comma = '\0';
+				}
+				add_rank(shard, merge_nodes_rank(nodes, name, shard));
+				name = comma ? comma + 1 : NULL;
+			}
+		}
+		if (end == NULL) {
+			break;
+		}
+		token = end + 1;
+	}
+}
+
+// returns 0 at the end of the file
+static int read_line(merge_shard_t* shard, const merge_nodes_t* nodes) {
+	ssize_t length = getline(&shard->line, &shard->line_capacity, shard->file);
+	if (length < 0) {
+		return 0;
+	}
+	if (length > 0 && shard->line[length - 1] == '\n') {
+		shard->line[--length] = '\0';
+	}
+	// U <name> 0 <length> <blocks> [<sequence> <qualities>]
+	char* fields[5];
+	char* field = shard->line;
+	int i;
+	for (i = 0; i < 4; ++i) {
+		char* tab = strchr(field, '\t');
+		if (tab == NULL) {
+			err_fatal(__func__, "malformed line '%s' in %s", shard->line, shard->fn);
+		}
+		*tab = '\0';
+		fields[i] = field;
+		field = tab + 1;
+	}
+	fields[4] = field;
+	shard->name = fields[1];
+	shard->length = fields[3];
+	// the optional columns are kept with their leading tab, which is restored after the blocks are parsed
+	shard->rest = fields[4] + strcspn(fields[4], "\t");
+	const char rest_first = *shard->rest;
+	*shard->rest = '\0';
+	parse_blocks(shard, nodes, fields[4]);
+	*shard->rest = rest_first;
+	return 1;
+}
+
+static void put_block(kstring_t* str, int type, int32_t size, const int32_t* ranks, int32_t ranks_cnt,
+		const merge_nodes_t* nodes, int first) {
+	if (!first) {
+		kputc(' ', str);
+	}
+	if (type == MERGE_AMBIGUOUS) {
+		kputsn("A:", 2, str);
+	} else if (type == MERGE_UNMATCHED) {
+		kputsn("0:", 2, str);
+	} else {
+		int32_t r;
+		for (r = 0; r < ranks_cnt; ++r) {
+			if (r > 0) {
+				kputc(',', str);
+			}
+			kputs(nodes->names[ranks[r]], str);
+		}
+		kputc(':', str);
+	}
+	kputw(size, str);
+}
+
+static int equal_ranks(const int32_t* a, int32_t a_cnt, const int32_t* b, int32_t b_cnt) {
+	return a_cnt == b_cnt && (a_cnt == 0 || memcmp(a, b, a_cnt * sizeof(int32_t)) == 0);
+}
+
+// Walks the blocks of all shards k-mer by k-mer (in segments where no shard changes its block); united
+// node sets equal to the previous one extend the current block, as in the query of the whole index.
+static void merge_blocks(merge_shard_t* shards, int shards_cnt, const merge_nodes_t* nodes, kstring_t* str,
+		int32_t** ranks, size_t* ranks_capacity) {
+	size_t total_ranks = 0;
+	int s;
+	for (s = 0; s < shards_cnt; ++s) {
+		total_ranks += shards[s].ranks_cnt;
+	}
+	// the current and the previous node sets
+	if (2 * total_ranks > *ranks_capacity) {
+		*ranks_capacity = 2 * total_ranks;
+		*ranks = realloc(*ranks, *ranks_capacity * sizeof(int32_t));
+	}
+	int32_t* current = *ranks;
+	int32_t* prev = *ranks + total_ranks;
+	int32_t prev_cnt = 0;
+	int prev_type = -1;
+	int32_t prev_size = 0;
+	int first = 1;
+	while (1) {
+		// blocks of size 0 (e.g., an empty block before an ambiguous k-mer at the beginning) do not
+		// depend on the index, they are copied from the first shard
+		for (s = 0; s < shards_cnt; ++s) {
+			merge_shard_t* shard = shards + s;
+			while (shard->block < shard->blocks_cnt && shard->blocks[shard->block].size == 0) {
+				if (s == 0) {
+					if (prev_type != -1) {
+						put_block(str, prev_type, prev_size, prev, prev_cnt, nodes, first);
+						first = 0;
+						prev_type = -1;
+					}
+					put_block(str, shard->blocks[shard->block].type == MERGE_AMBIGUOUS ? MERGE_AMBIGUOUS : MERGE_UNMATCHED,
+						0, NULL, 0, nodes, first);
+					first = 0;
+				}
+				shard->block++;
+			}
+		}
+		int finished = 0;
+		for (s = 0; s < shards_cnt; ++s) {
+			finished += shards[s].block == shards[s].blocks_cnt;
+		}
+		if (finished == shards_cnt) {
+			break;
+		}
+		if (finished > 0) {
+			err_fatal(__func__, "read %s has different numbers of k-mers in the shards", shards[0].name);
+		}
+		int32_t size = INT32_MAX;
+		int ambiguous = 0;
+		for (s = 0; s < shards_cnt; ++s) {
+			const merge_block_t* block = shards[s].blocks + shards[s].block;
+			if (block->size - shards[s].used < size) {
+				size = block->size - shards[s].used;
+			}
+			ambiguous += block->type == MERGE_AMBIGUOUS;
+		}
+		if (ambiguous > 0 && ambiguous < shards_cnt) {
+			err_fatal(__func__, "ambiguous k-mers of read %s differ between shards", shards[0].name);
+		}
+		int32_t current_cnt = 0;
+		if (!ambiguous) {
+			for (s = 0; s < shards_cnt; ++s) {
+				const merge_block_t* block = shards[s].blocks + shards[s].block;
+				if (block->ranks_cnt > 0) {
+					memcpy(current + current_cnt, shards[s].ranks + block->ranks_offset, block->ranks_cnt * sizeof(int32_t));
+					current_cnt += block->ranks_cnt;
+				}
+			}
+			// nodes of every shard are sorted, but the shards interleave in the order of the whole index
+			if (current_cnt > 1) {
+				qsort(current, current_cnt, sizeof(int32_t), compare_ranks);
+			}
+		}
+		int type = ambiguous ? MERGE_AMBIGUOUS : (current_cnt > 0 ? MERGE_NODES : MERGE_UNMATCHED);
+		if (type == prev_type && equal_ranks(current, current_cnt, prev, prev_cnt)) {
+			prev_size += size;
+		} else {
+			if (prev_type != -1) {
+				put_block(str, prev_type, prev_size, prev, prev_cnt, nodes, first);
+				first = 0;
+			}
+			int32_t* tmp = prev;
+			prev = current;
+			current = tmp;
+			prev_cnt = current_cnt;
+			prev_type = type;
+			prev_size = size;
+		}
+		for (s = 0; s < shards_cnt; ++s) {
+			merge_shard_t* shard = shards + s;
+			shard->used += size;
+			if (shard->used == shard->blocks[shard->block].size) {
+				shard->block++;
+				shard->used = 0;
+			}
+		}
+	}
+	if (prev_type != -1) {
+		put_block(str, prev_type, prev_size, prev, prev_cnt, nodes, first);
+	}
+}
+
+int64_t merge_shards(const char* nodes_fn, int shards_cnt, char** shard_fns, FILE* output_file) {
+	merge_nodes_t* nodes = merge_nodes_load(nodes_fn);
+	merge_shard_t* shards = calloc(shards_cnt, sizeof(merge_shard_t));
+	int s;
+	for (s = 0; s < shards_cnt; ++s) {
+		shards[s].fn = shard_fns[s];
+		shards[s].file = strcmp(shard_fns[s], "-") == 0 ? stdin : fopen(shard_fns[s], "r");
+		if (shards[s].file == NULL) {
+			err_fatal(__func__, "cannot open %s", shard_fns[s]);
+		}
+	}
+	kstring_t str = {0, 0, 0};
+	int32_t* ranks = NULL;
+	size_t ranks_capacity = 0;
+	int64_t reads = 0;
+	while (1) {
+		int ended = 0;
+		for (s = 0; s < shards_cnt; ++s) {
+			ended += !read_line(shards + s, nodes);
+		}
+		if (ended == shards_cnt) {
+			break;
+		}
+		if (ended > 0) {
+			err_fatal(__func__, "outputs of the shards have different numbers of reads");
+		}
+		for (s = 1; s < shards_cnt; ++s) {
+			if (strcmp(shards[s].name, shards[0].name) != 0 || strcmp(shards[s].length, shards[0].length) != 0) {
+				err_fatal(__func__, "read %s of %s does not match read %s of %s", shards[s].name, shards[s].fn,
+					shards[0].name, shards[0].fn);
+			}
+		}
+		str.l = 0;
+		kputsn("U\t", 2, &str);
+		kputs(shards[0].name, &str);
+		kputsn("\t0\t", 3, &str);
+		kputs(shards[0].length, &str);
+		kputc('\t', &str);
+		merge_blocks(shards, shards_cnt, nodes, &str, &ranks, &ranks_capacity);
+		kputs(shards[0].rest, &str);
+		kputc('\n', &str);
+		fputs(str.s, output_file);
+		reads++;
+	}
+	fflush(output_file);
+	for (s = 0; s < shards_cnt; ++s) {
+		if (shards[s].file != stdin) {
+			fclose(shards[s].file);
+		}
+		free(shards[s].line);
+		free(shards[s].blocks);
+		free(shards[s].ranks);
+	}
+	free(shards);
+	free(ranks);
+	free(str.s);
+	merge_nodes_destroy(nodes);
+	return reads;
+}
@@ -0,0 +1,20 @@
+/*
+	prophyle_index merge command: outputs of queries of index shards are merged into the output of the whole index.
+	Author: Kamil Salikhov <salikhov.kamil@gmail.com>
+	Licence: MIT
+*/
+
+#ifndef PROPHYLE_MERGE_H
+#define PROPHYLE_MERGE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Shards are indexes of disjoint sets of nodes of the whole index. Their outputs (kraken-like lines
+// of the same reads in the same order, "-" for stdin) are read in lockstep; the node sets of every
+// k-mer are united and the blocks are rebuilt, so the output is the same as for the whole index.
+// nodes_fn lists the names of the nodes in the order of the whole index (index.fa), one per line.
+// Columns after the blocks (-b) are copied from the first shard. Returns the number of reads.
+int64_t merge_shards(const char* nodes_fn, int shards_cnt, char** shard_fns, FILE* output_file);
+
+#endif //PROPHYLE_MERGE_H
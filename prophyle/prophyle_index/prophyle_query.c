@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <math.h>
 #include <inttypes.h>
+#include <string.h>
+#include <time.h>
 #include "prophyle_query.h"
 #include "utils.h"
 #include "bwa.h"
@@ -9,58 +11,44 @@
 #include "klcp.h"
 #include "bwa_utils.h"
 #include "contig_node_translator.h"
+#include "sa_interval_search.h"
 
 #define MAX_POSSIBLE_SA_POSITIONS 1000000
-#define MAX_STREAK_LENGTH 10000000
-#define MAX_SOFT_STREAK_LENGTH 9000000
 
-int calculate_sa_interval(const bwt_t* bwt, int len, const ubyte_t* str, uint64_t* k, uint64_t* l, int start_pos)
-{
-	bwtint_t ok, ol;
-	int i;
-	for (i = start_pos; i < start_pos + len; ++i) {
-		ubyte_t c = str[i];
-		if (c > 3) {
-			*k = 1;
-			*l = 0;
-			return i - start_pos;
-		}
-		if (c < 4) {
-			bwt_2occ(bwt, *k - 1, *l, c, &ok, &ol);
-			*k = bwt->L2[c] + ok + 1;
-			*l = bwt->L2[c] + ol;
-		}
-		if (*k > *l) {
-			return i - start_pos;
-		}
-	}
-	return len;
+// time of the stats, realtime() is too coarse for single k-mers
+static inline double stats_time() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
 }
 
-int calculate_sa_interval_restart(const bwt_t* bwt, int len, const ubyte_t* str, uint64_t* k, uint64_t* l, int start_pos)
-{
-	*k = 0;
-	*l = bwt->seq_len;
-	return calculate_sa_interval(bwt, len, str, k, l, start_pos);
-}
-
-int calculate_sa_interval_continue(const bwt_t* bwt, int len, const ubyte_t* str,
-															uint64_t* k, uint64_t* l,
-															uint64_t* decreased_k, uint64_t* increased_l,
-															int start_pos, const klcp_t* klcp)
-{
-	*k = decrease_sa_position(klcp, *k);
-	*decreased_k = *k;
-	*l = increase_sa_position(klcp, *l);
-	*increased_l = *l;
-	return calculate_sa_interval(bwt, len, str, k, l, start_pos);
+// bin of the histogram of SA interval widths (see PROPHYLE_SA_WIDTH_BINS)
+static inline int sa_width_bin(uint64_t width) {
+	int bin = 0;
+	while (width > 0 && bin < PROPHYLE_SA_WIDTH_BINS - 1) {
+		width >>= 1;
+		bin++;
+	}
+	return bin;
 }
 
-size_t get_positions(const bwaidx_t* idx, bwt_position_t* positions, const int query_length,
+size_t get_positions(const bwaidx_t* idx, prophyle_query_aux_t* aux_data, const int query_length,
 										 const uint64_t k, const uint64_t l) {
+	size_t positions_cnt = (l - k + 1 < MAX_POSSIBLE_SA_POSITIONS ? l - k + 1 : MAX_POSSIBLE_SA_POSITIONS);
+	if (positions_cnt > aux_data->positions_capacity) {
+		while (positions_cnt > aux_data->positions_capacity) {
+			aux_data->positions_capacity = aux_data->positions_capacity ? aux_data->positions_capacity << 1 : 64;
+		}
+		if (aux_data->positions_capacity > MAX_POSSIBLE_SA_POSITIONS) {
+			aux_data->positions_capacity = MAX_POSSIBLE_SA_POSITIONS;
+		}
+		aux_data->positions = realloc(aux_data->positions, aux_data->positions_capacity * sizeof(bwt_position_t));
+	}
+	bwt_position_t* positions = aux_data->positions;
 	uint64_t t;
 	for(t = k; t <= l; ++t) {
 		if (t - k >= MAX_POSSIBLE_SA_POSITIONS) {
+			aux_data->stats.sa_truncations++;
 			fprintf(stderr, "[prophyle_index:%s] translation from SA-pos to seq-pos is truncated, too many (%llu) positions\n",
 				__func__, l - k + 1);
 			break;
@@ -71,7 +59,8 @@ size_t get_positions(const bwaidx_t* idx, bwt_position_t* positions, const int q
 		positions[t - k].strand = strand;
 		positions[t - k].rid = -1;
 	}
-	return (l - k + 1 < MAX_POSSIBLE_SA_POSITIONS ? l - k + 1 : MAX_POSSIBLE_SA_POSITIONS);
+	aux_data->stats.sa_positions_translated += positions_cnt;
+	return positions_cnt;
 }
 
 int is_position_on_border(const bwaidx_t* idx, bwt_position_t* position, int query_length) {
@@ -93,7 +82,7 @@ void sort(int count, int** array) {
 	}
 }
 
-size_t get_nodes_from_positions(const bwaidx_t* idx, const int query_length,
+size_t get_nodes_from_positions(const bwaidx_t* idx, const pos2node_map_t* pos2node_map, const int query_length,
 																const int positions_cnt, bwt_position_t* positions, int32_t* seen_nodes,
 																int8_t** seen_nodes_marks, int skip_positions_on_border) {
 	size_t nodes_cnt = 0;
@@ -104,14 +93,21 @@ size_t get_nodes_from_positions(const bwaidx_t* idx, const int query_length,
 			continue;
 		}
 		int rid = positions[i].rid;
-		if (rid == -1 || is_position_on_border(idx, &(positions[i]), query_length)) {
-			rid = bns_pos2rid(idx->bns, pos);
+		int node = pos2node_map ? pos2node_map_get_node(pos2node_map, pos, query_length, &rid) : -1;
+		int on_border = 0;
+		if (node == -1) {
+			// the k-mer is close to a border of contigs
+			if (rid == -1 || is_position_on_border(idx, &(positions[i]), query_length)) {
+				rid = pos2node_map ? pos2node_map_get_rid(pos2node_map, idx->bns, pos) : bns_pos2rid(idx->bns, pos);
+				positions[i].rid = rid;
+			}
+			node = get_node_from_contig(rid);
+			on_border = is_position_on_border(idx, &(positions[i]), query_length);
+		} else {
 			positions[i].rid = rid;
 		}
-		int node = get_node_from_contig(rid);
 		positions[i].node = node;
-		int seen = (*seen_nodes_marks)[node];
-		if (!seen && node != -1 && (!skip_positions_on_border || !is_position_on_border(idx, &(positions[i]), query_length))) {
+		if (node != -1 && !(*seen_nodes_marks)[node] && (!skip_positions_on_border || !on_border)) {
 			seen_nodes[nodes_cnt] = node;
 			++nodes_cnt;
 			(*seen_nodes_marks)[node] = 1;
@@ -134,61 +130,63 @@ void output_old(int* seen_nodes, const int nodes_cnt) {
 	fprintf(stdout, "\n");
 }
 
-void strncat_with_check(char* str, char* str_to_append, int* str_length,
-	int str_to_append_length, int length_limit) {
-	if (*str_length >= length_limit) {
-		fprintf(stderr, "[prophyle_index:%s] too long output string, more than %d symbols\n",
-			__func__, length_limit);
-	} else {
-		strncat(str, str_to_append, length_limit - str_to_append_length);
-		*str_length += str_to_append_length;
-		if (*str_length > length_limit) {
-			*str_length = length_limit;
+void add_streak(prophyle_query_aux_t* aux_data, const int32_t* seen_nodes, int nodes_cnt, int streak_size,
+	int is_ambiguous_streak) {
+	if (aux_data->streaks_cnt == aux_data->streaks_capacity) {
+		aux_data->streaks_capacity = aux_data->streaks_capacity ? aux_data->streaks_capacity << 1 : 16;
+		aux_data->streaks = realloc(aux_data->streaks, aux_data->streaks_capacity * sizeof(prophyle_streak_t));
+	}
+	prophyle_streak_t* streak = aux_data->streaks + aux_data->streaks_cnt;
+	aux_data->streaks_cnt++;
+	streak->size = streak_size;
+	streak->is_ambiguous = is_ambiguous_streak;
+	streak->nodes_cnt = is_ambiguous_streak ? 0 : nodes_cnt;
+	streak->nodes_offset = aux_data->streak_nodes_cnt;
+	if (streak->nodes_cnt > 0) {
+		if (aux_data->streak_nodes_cnt + streak->nodes_cnt > aux_data->streak_nodes_capacity) {
+			while (aux_data->streak_nodes_cnt + streak->nodes_cnt > aux_data->streak_nodes_capacity) {
+				aux_data->streak_nodes_capacity = aux_data->streak_nodes_capacity ? aux_data->streak_nodes_capacity << 1 : 64;
+			}
+			aux_data->streak_nodes = realloc(aux_data->streak_nodes,
+				aux_data->streak_nodes_capacity * sizeof(int32_t));
 		}
+		memcpy(aux_data->streak_nodes + aux_data->streak_nodes_cnt, seen_nodes, streak->nodes_cnt * sizeof(int32_t));
+		aux_data->streak_nodes_cnt += streak->nodes_cnt;
 	}
 }
 
-void construct_streaks(char** all_streaks, char** current_streak, int* seen_nodes, int nodes_cnt, int streak_size,
-	int is_ambiguous_streak, int* is_first_streak) {
-	if (*is_first_streak) {
-		*all_streaks[0] = '\0';
-	}
-	*current_streak[0] = '\0';
-	int current_streak_approximate_length = 0;
-	if (is_ambiguous_streak) {
-		strcat(*current_streak, "A:");
-		current_streak_approximate_length += 2;
-	} else if (nodes_cnt > 0) {
-		int r;
-		for(r = 0; r < nodes_cnt - 1; ++r) {
-			strncat_with_check(*current_streak, get_node_name(seen_nodes[r]), &current_streak_approximate_length, get_node_name_length(seen_nodes[r]), MAX_SOFT_STREAK_LENGTH);
-			strncat_with_check(*current_streak, ",", &current_streak_approximate_length, 1, MAX_SOFT_STREAK_LENGTH);
+// Streaks are collected from the last k-mer of the read to the first one (the sequence is stored reversed),
+// so they are written in reverse order of addition. They are appended to str, which stays terminated.
+void construct_streaks(const prophyle_query_aux_t* aux_data, kstring_t* str) {
+	ks_resize(str, str->l + 8 * aux_data->streaks_cnt + 1);
+	str->s[str->l] = '\0';
+	int64_t s;
+	for (s = (int64_t)aux_data->streaks_cnt - 1; s >= 0; --s) {
+		const prophyle_streak_t* streak = aux_data->streaks + s;
+		if (s != (int64_t)aux_data->streaks_cnt - 1) {
+			kputc(' ', str);
 		}
-		strncat_with_check(*current_streak, get_node_name(seen_nodes[nodes_cnt - 1]), &current_streak_approximate_length, get_node_name_length(seen_nodes[nodes_cnt - 1]), MAX_SOFT_STREAK_LENGTH);
-		strncat_with_check(*current_streak, ":", &current_streak_approximate_length, 1, MAX_SOFT_STREAK_LENGTH);
-	} else {
-		strncat_with_check(*current_streak, "0:", &current_streak_approximate_length, 2, MAX_SOFT_STREAK_LENGTH);
-	}
-	sprintf(*current_streak + strlen(*current_streak), "%d", streak_size);
-	current_streak_approximate_length += 3;
-	if (*is_first_streak) {
-		if (current_streak_approximate_length <= MAX_STREAK_LENGTH) {
-			strcpy(*all_streaks, *current_streak);
+		if (streak->is_ambiguous) {
+			kputsn("A:", 2, str);
+		} else if (streak->nodes_cnt > 0) {
+			const int32_t* nodes = aux_data->streak_nodes + streak->nodes_offset;
+			int r;
+			for(r = 0; r < streak->nodes_cnt; ++r) {
+				if (r > 0) {
+					kputc(',', str);
+				}
+				kputsn(get_node_name(nodes[r]), get_node_name_length(nodes[r]), str);
+			}
+			kputc(':', str);
 		} else {
-			strncpy(*all_streaks, *current_streak, MAX_STREAK_LENGTH);
+			kputsn("0:", 2, str);
 		}
-	} else {
-		strncat_with_check(*current_streak, " ", &current_streak_approximate_length, 1, MAX_SOFT_STREAK_LENGTH);
-		strncat_with_check(*current_streak, *all_streaks, &current_streak_approximate_length, strlen(*all_streaks), MAX_SOFT_STREAK_LENGTH);
-		char* tmp = *all_streaks;
-		*all_streaks = *current_streak;
-		*current_streak = tmp;
+		kputw(streak->size, str);
 	}
-	*is_first_streak = 0;
 }
 
-void print_streaks(char* streaks) {
-	fprintf(stdout, "%s", streaks);
+void print_streaks(FILE* output_file, const char* streaks, size_t length) {
+	fwrite(streaks, 1, length, output_file);
 }
 
 void shift_positions_by_one(const bwaidx_t* idx, int positions_cnt, bwt_position_t* positions,
@@ -219,53 +217,72 @@ int equal(int a_cnt, const int* a, int b_cnt, const int* b) {
 	return 1;
 }
 
-void print_read(const bwa_seq_t* p) {
+void print_read(FILE* output_file, const bwa_seq_t* p) {
 	int j;
 	for(j = (int)p->len - 1; j>= 0; j--) {
-		fprintf(stdout, "%c", "ACGTN"[p->seq[j]]);
+		fputc("ACGTN"[p->seq[j]], output_file);
 	}
 }
 
-void print_read_qual(const bwa_seq_t* p) {
+void print_read_qual(FILE* output_file, const bwa_seq_t* p) {
 	if (p->qual) {
 		int j;
 		for(j = 0; j < (int)p->len; j++) {
-			fprintf(stdout, "%c", p->qual[j]);
+			fputc(p->qual[j], output_file);
 		}
 	} else {
-		fprintf(stdout, "*");
+		fputc('*', output_file);
 	}
 }
 
-prophyle_worker_t* prophyle_worker_init(const bwaidx_t* idx, int32_t seqs_cnt, const bwa_seq_t* seqs,
+prophyle_query_aux_t* prophyle_aux_data_init(const bwaidx_t* idx, int n_threads) {
+	prophyle_query_aux_t* aux_data = malloc(n_threads * sizeof(prophyle_query_aux_t));
+	int nodes_count = get_nodes_count();
+	int tid;
+	for (tid = 0; tid < n_threads; ++tid) {
+		aux_data[tid].positions = NULL;
+		aux_data[tid].positions_capacity = 0;
+		aux_data[tid].streaks = NULL;
+		aux_data[tid].streaks_cnt = 0;
+		aux_data[tid].streaks_capacity = 0;
+		aux_data[tid].streak_nodes = NULL;
+		aux_data[tid].streak_nodes_cnt = 0;
+		aux_data[tid].streak_nodes_capacity = 0;
+		aux_data[tid].assignment_blocks = NULL;
+		aux_data[tid].assignment_blocks_capacity = 0;
+		aux_data[tid].assignment_nodes = NULL;
+		aux_data[tid].assignment_nodes_capacity = 0;
+		aux_data[tid].intervals = NULL;
+		aux_data[tid].intervals_capacity = 0;
+		// a k-mer never matches more distinct nodes than the index has
+		aux_data[tid].seen_nodes = malloc(nodes_count * sizeof(int32_t));
+		aux_data[tid].prev_seen_nodes = malloc(nodes_count * sizeof(int32_t));
+		// marks are cleared after every k-mer, so they are zeroed only here
+		aux_data[tid].seen_nodes_marks = calloc(nodes_count, sizeof(int8_t));
+		memset(&aux_data[tid].krakmers, 0, sizeof(kstring_t));
+		memset(&aux_data[tid].read, 0, sizeof(kstring_t));
+		memset(&aux_data[tid].qualities, 0, sizeof(kstring_t));
+		memset(&aux_data[tid].stats, 0, sizeof(prophyle_query_stats_t));
+	}
+	return aux_data;
+}
+
+prophyle_worker_t* prophyle_worker_init(const bwaidx_t* idx, int32_t seqs_cnt, bwa_seq_t* seqs,
 		const prophyle_index_opt_t* opt, const klcp_t* klcp) {
 	prophyle_worker_t* prophyle_worker = malloc(1 * sizeof(prophyle_worker_t));
 	prophyle_worker->idx = idx;
 	prophyle_worker->seqs = seqs;
 	prophyle_worker->opt = opt;
 	prophyle_worker->klcp = klcp;
-	prophyle_worker->aux_data = malloc(opt->n_threads * sizeof(prophyle_query_aux_t));
-	int tid;
-	for (tid = 0; tid < opt->n_threads; ++tid) {
-		prophyle_worker->aux_data[tid].positions = malloc(MAX_POSSIBLE_SA_POSITIONS * sizeof(bwt_position_t));
-		prophyle_worker->aux_data[tid].all_streaks = malloc(MAX_STREAK_LENGTH * sizeof(char));
-		prophyle_worker->aux_data[tid].current_streak = malloc(MAX_STREAK_LENGTH * sizeof(char));
-		prophyle_worker->aux_data[tid].seen_nodes = malloc(MAX_POSSIBLE_SA_POSITIONS * sizeof(int32_t));
-		prophyle_worker->aux_data[tid].prev_seen_nodes = malloc(MAX_POSSIBLE_SA_POSITIONS * sizeof(int32_t));
-		prophyle_worker->aux_data[tid].seen_nodes_marks = malloc(idx->bns->n_seqs * sizeof(int8_t));
-		int index;
-		for(index = 0; index < idx->bns->n_seqs; ++index) {
-			prophyle_worker->aux_data[tid].seen_nodes_marks[index] = 0;
-		}
-		prophyle_worker->aux_data[tid].rids_computations = 0;
-		prophyle_worker->aux_data[tid].using_prev_rids = 0;
-	}
+	prophyle_worker->aux_data = NULL;
+	prophyle_worker->read_assigners = NULL;
+	prophyle_worker->tree_ids = NULL;
+	prophyle_worker->cache = NULL;
+	prophyle_worker->pos2node_map = NULL;
+	prophyle_worker->output_file = stdout;
 	prophyle_worker->seqs_cnt = seqs_cnt;
-	prophyle_worker->output = malloc(seqs_cnt * sizeof(char*));
-	int i = 0;
-	for (i = 0; i < seqs_cnt; ++i) {
-		prophyle_worker->output[i] = NULL;
-	}
+	prophyle_worker->output = calloc(seqs_cnt, sizeof(prophyle_read_output_t));
+	prophyle_worker->output_buffers = calloc(opt->n_threads, sizeof(kstring_t));
 	return prophyle_worker;
 }
 
@@ -273,11 +290,20 @@ void prophyle_aux_data_destroy(prophyle_query_aux_t* prophyle_query_aux_data) {
 	if (prophyle_query_aux_data->positions) {
 		free(prophyle_query_aux_data->positions);
 	}
-	if (prophyle_query_aux_data->all_streaks) {
-		free(prophyle_query_aux_data->all_streaks);
+	if (prophyle_query_aux_data->streaks) {
+		free(prophyle_query_aux_data->streaks);
+	}
+	if (prophyle_query_aux_data->streak_nodes) {
+		free(prophyle_query_aux_data->streak_nodes);
+	}
+	if (prophyle_query_aux_data->assignment_blocks) {
+		free(prophyle_query_aux_data->assignment_blocks);
+	}
+	if (prophyle_query_aux_data->assignment_nodes) {
+		free(prophyle_query_aux_data->assignment_nodes);
 	}
-	if (prophyle_query_aux_data->current_streak) {
-		free(prophyle_query_aux_data->current_streak);
+	if (prophyle_query_aux_data->intervals) {
+		free(prophyle_query_aux_data->intervals);
 	}
 	if (prophyle_query_aux_data->seen_nodes) {
 		free(prophyle_query_aux_data->seen_nodes);
@@ -288,67 +314,108 @@ void prophyle_aux_data_destroy(prophyle_query_aux_t* prophyle_query_aux_data) {
 	if (prophyle_query_aux_data->seen_nodes_marks) {
 		free(prophyle_query_aux_data->seen_nodes_marks);
 	}
+	free(prophyle_query_aux_data->krakmers.s);
+	free(prophyle_query_aux_data->read.s);
+	free(prophyle_query_aux_data->qualities.s);
 }
 
 void prophyle_worker_destroy(prophyle_worker_t* prophyle_worker) {
 	if (!prophyle_worker) {
 		return;
 	}
-	int i;
-	for (i = 0; i < prophyle_worker->opt->n_threads; ++i) {
-		prophyle_aux_data_destroy(&prophyle_worker->aux_data[i]);
-	}
-	if (prophyle_worker->aux_data) {
-		free(prophyle_worker->aux_data);
+	int tid;
+	for (tid = 0; tid < prophyle_worker->opt->n_threads; ++tid) {
+		free(prophyle_worker->output_buffers[tid].s);
 	}
-	if (prophyle_worker->output) {
-		for (i = 0; i < prophyle_worker->seqs_cnt; ++i) {
-			if (prophyle_worker->output[i]) {
-				free(prophyle_worker->output[i]);
-		  }
+	free(prophyle_worker->output_buffers);
+	free(prophyle_worker->output);
+	free(prophyle_worker);
+}
+
+// Passes the streaks of the read, in the order of the read and with nodes translated to tree ids,
+// directly to the assignment, and appends the assignment to output.
+void assign_read(const prophyle_worker_t* prophyle_worker, prophyle_query_aux_t* aux_data,
+		const bwa_seq_t* seq, const char* krakmers, int tid, kstring_t* output) {
+	if (aux_data->streaks_cnt > aux_data->assignment_blocks_capacity) {
+		aux_data->assignment_blocks_capacity = aux_data->streaks_capacity;
+		aux_data->assignment_blocks = realloc(aux_data->assignment_blocks,
+			aux_data->assignment_blocks_capacity * sizeof(assignment_block_t));
+	}
+	if (aux_data->streak_nodes_cnt > aux_data->assignment_nodes_capacity) {
+		aux_data->assignment_nodes_capacity = aux_data->streak_nodes_capacity;
+		aux_data->assignment_nodes = realloc(aux_data->assignment_nodes,
+			aux_data->assignment_nodes_capacity * sizeof(int32_t));
+	}
+	size_t s;
+	for (s = 0; s < aux_data->streaks_cnt; ++s) {
+		const prophyle_streak_t* streak = aux_data->streaks + aux_data->streaks_cnt - 1 - s;
+		assignment_block_t* block = aux_data->assignment_blocks + s;
+		block->length = streak->size;
+		block->nodes_offset = streak->nodes_offset;
+		block->nodes_count = streak->nodes_cnt;
+		block->ambiguous = streak->is_ambiguous;
+	}
+	for (s = 0; s < aux_data->streak_nodes_cnt; ++s) {
+		aux_data->assignment_nodes[s] = prophyle_worker->tree_ids[aux_data->streak_nodes[s]];
+	}
+	kstring_t* read = &aux_data->read;
+	kstring_t* qualities = &aux_data->qualities;
+	read->l = 0;
+	qualities->l = 0;
+	if (prophyle_worker->opt->output_read_qual) {
+		ks_resize(read, seq->len + 1);
+		int j;
+		for(j = (int)seq->len - 1; j >= 0; j--) {
+			read->s[read->l++] = "ACGTN"[seq->seq[j]];
 		}
-		if (prophyle_worker->output) {
-			free(prophyle_worker->output);
+		read->s[read->l] = '\0';
+		if (seq->qual) {
+			kputsn((const char*)seq->qual, seq->len, qualities);
+		} else {
+			kputc('*', qualities);
 		}
-	}
-	free(prophyle_worker);
+	} else {
+		kputc('*', read);
+		kputc('*', qualities);
+	}
+	size_t records_length;
+	const char* records = read_assigner_process(prophyle_worker->read_assigners[tid], seq->name, seq->len,
+		aux_data->streaks_cnt, aux_data->assignment_blocks, aux_data->streak_nodes_cnt, aux_data->assignment_nodes,
+		krakmers, read->s, qualities->s, &records_length);
+	kputsn(records, records_length, output);
 }
 
-void process_sequence(void* data, int i, int tid) {
-	prophyle_worker_t* prophyle_worker = (prophyle_worker_t*)data;
+void process_sequence(prophyle_worker_t* prophyle_worker, int i, int tid, const sa_interval_t* intervals) {
 	const bwaidx_t* idx = prophyle_worker->idx;
 	bwa_seq_t seq = prophyle_worker->seqs[i];
 	const prophyle_index_opt_t* opt = prophyle_worker->opt;
-	const klcp_t* klcp = prophyle_worker->klcp;
-	prophyle_query_aux_t aux_data = prophyle_worker->aux_data[tid];
-	char* current_streak = aux_data.current_streak;
-	char* all_streaks = aux_data.all_streaks;
-	int32_t* seen_nodes = aux_data.seen_nodes;
-	int32_t* prev_seen_nodes = aux_data.prev_seen_nodes;
-	int8_t* seen_nodes_marks = aux_data.seen_nodes_marks;
+	prophyle_query_aux_t* aux_data = &prophyle_worker->aux_data[tid];
+	int32_t* seen_nodes = aux_data->seen_nodes;
+	int32_t* prev_seen_nodes = aux_data->prev_seen_nodes;
+	int8_t* seen_nodes_marks = aux_data->seen_nodes_marks;
+	prophyle_query_stats_t* stats = &aux_data->stats;
+	const int timed = opt->need_log;
+	const double start_time = timed ? stats_time() : 0;
+	const double start_positions_time = stats->sa2pos_time + stats->pos2rid_time;
+	aux_data->streaks_cnt = 0;
+	aux_data->streak_nodes_cnt = 0;
 
 	if (opt->output_old) {
 		fprintf(stdout, "#");
-		print_read(&seq);
+		print_read(stdout, &seq);
 		fprintf(stdout, "\n");
 	}
-	bwt_t* bwt = idx->bwt;
-	uint64_t k = 0, l = 0, prev_k = 1, prev_l = 0;
+	uint64_t k = 0, l = 0;
 	int current_streak_size = 0;
 	int prev_nodes_count = 0;
 	int start_pos = 0;
 	size_t positions_cnt = 0;
-	uint64_t decreased_k = 1;
-	uint64_t increased_l = 0;
-	int is_first_streak = 1;
+	int positions_of_prev_kmer = 0;
 	int last_ambiguous_index = 0 - opt->kmer_length;
 	int is_ambiguous_streak = 0;
 	int ambiguous_streak_just_ended = 0;
 	if (start_pos + opt->kmer_length > seq.len) {
-		if (opt->output) {
-			prophyle_worker->output[i] = malloc(5 * sizeof(char));
-			strncpy(prophyle_worker->output[i], "0:0", 5);
-		}
+		add_streak(aux_data, prev_seen_nodes, 0, 0, 0);
 	} else {
 		int index = 0;
 		for(index = 0; index < opt->kmer_length; ++index) {
@@ -364,8 +431,7 @@ void process_sequence(void* data, int i, int tid) {
 				}
 				if (end_pos - last_ambiguous_index < opt->kmer_length) {
 					if (!is_ambiguous_streak) {
-						construct_streaks(&all_streaks, &current_streak, prev_seen_nodes, prev_nodes_count, current_streak_size,
-							is_ambiguous_streak, &is_first_streak);
+						add_streak(aux_data, prev_seen_nodes, prev_nodes_count, current_streak_size, is_ambiguous_streak);
 						is_ambiguous_streak = 1;
 						current_streak_size = 1;
 					} else {
@@ -375,48 +441,63 @@ void process_sequence(void* data, int i, int tid) {
 					continue;
 				} else {
 					if (is_ambiguous_streak && current_streak_size > 0) {
-						construct_streaks(&all_streaks, &current_streak, prev_seen_nodes, prev_nodes_count, current_streak_size,
-							is_ambiguous_streak, &is_first_streak);
+						add_streak(aux_data, prev_seen_nodes, prev_nodes_count, current_streak_size, is_ambiguous_streak);
 						is_ambiguous_streak = 0;
 						current_streak_size = 0;
 					}
 				}
 				if (end_pos - last_ambiguous_index == opt->kmer_length) {
-					k = 0;
-					l = 0;
-					prev_k = 1;
-					prev_l = 0;
 					prev_nodes_count = 0;
 					ambiguous_streak_just_ended = 1;
 				} else {
 					ambiguous_streak_just_ended = 0;
 				}
 			}
-			if (start_pos == 0 || ambiguous_streak_just_ended) {
-				k = 0;
-				l = 0;
-				calculate_sa_interval_restart(bwt, opt->kmer_length, seq.seq, &k, &l, start_pos);
-			} else {
-				if (opt->use_klcp && k <= l) {
-					calculate_sa_interval_continue(bwt, 1, seq.seq, &k, &l, &decreased_k, &increased_l, start_pos + opt->kmer_length - 1, klcp);
-				} else {
-					k = 0;
-					l = 0;
-					calculate_sa_interval_restart(bwt, opt->kmer_length, seq.seq, &k, &l, start_pos);
+			if (intervals[start_pos].inherited) {
+				// not searched because of sampling, the nodes of the previous k-mer are kept
+				stats->kmers_inherited++;
+				positions_of_prev_kmer = 0;
+				if (opt->output_old) {
+					output_old(prev_seen_nodes, prev_nodes_count);
+				} else if (opt->output) {
+					current_streak_size++;
 				}
+				start_pos++;
+				continue;
 			}
+			k = intervals[start_pos].k;
+			l = intervals[start_pos].l;
+			stats->sa_widths[k <= l ? sa_width_bin(l - k + 1) : 0]++;
 			int nodes_cnt = 0;
 			if (k <= l) {
-				if (prev_l - prev_k == l - k
-						&& increased_l - decreased_k == l - k) {
-					aux_data.using_prev_rids++;
-					shift_positions_by_one(idx, positions_cnt, aux_data.positions, opt->kmer_length, k, l);
+				int cacheable = prophyle_worker->cache && l - k + 1 >= NODE_SET_CACHE_MIN_INTERVAL;
+				if (cacheable && node_set_cache_get(prophyle_worker->cache, k, l, seen_nodes, &nodes_cnt)) {
+					stats->cache_hits++;
+					// positions are left from an older k-mer now
+					positions_of_prev_kmer = 0;
 				} else {
-					aux_data.rids_computations++;
-					positions_cnt = get_positions(idx, aux_data.positions, opt->kmer_length, k, l);
+					const double sa2pos_start = timed ? stats_time() : 0;
+					if (intervals[start_pos].shifted && positions_of_prev_kmer) {
+						stats->using_prev_rids++;
+						shift_positions_by_one(idx, positions_cnt, aux_data->positions, opt->kmer_length, k, l);
+					} else {
+						stats->rids_computations++;
+						positions_cnt = get_positions(idx, aux_data, opt->kmer_length, k, l);
+					}
+					positions_of_prev_kmer = 1;
+					const double pos2rid_start = timed ? stats_time() : 0;
+					nodes_cnt = get_nodes_from_positions(idx, prophyle_worker->pos2node_map, opt->kmer_length,
+						positions_cnt, aux_data->positions, seen_nodes, &seen_nodes_marks, opt->skip_positions_on_border);
+					if (timed) {
+						const double pos2rid_end = stats_time();
+						stats->sa2pos_time += pos2rid_start - sa2pos_start;
+						stats->pos2rid_time += pos2rid_end - pos2rid_start;
+					}
+					if (cacheable) {
+						stats->cache_misses++;
+						node_set_cache_put(prophyle_worker->cache, k, l, seen_nodes, nodes_cnt);
+					}
 				}
-				nodes_cnt = get_nodes_from_positions(idx, opt->kmer_length,
-					positions_cnt, aux_data.positions, seen_nodes, &seen_nodes_marks, opt->skip_positions_on_border);
 			}
 			if (opt->output_old) {
 				output_old(seen_nodes, nodes_cnt);
@@ -424,8 +505,7 @@ void process_sequence(void* data, int i, int tid) {
 				if (start_pos == 0 || ambiguous_streak_just_ended || (equal(nodes_cnt, seen_nodes, prev_nodes_count, prev_seen_nodes))) {
 					current_streak_size++;
 				} else {
-					construct_streaks(&all_streaks, &current_streak, prev_seen_nodes, prev_nodes_count, current_streak_size,
-						is_ambiguous_streak, &is_first_streak);
+					add_streak(aux_data, prev_seen_nodes, prev_nodes_count, current_streak_size, is_ambiguous_streak);
 					current_streak_size = 1;
 				}
 			}
@@ -433,76 +513,284 @@ void process_sequence(void* data, int i, int tid) {
 			seen_nodes = prev_seen_nodes;
 			prev_seen_nodes = tmp;
 			prev_nodes_count = nodes_cnt;
-			prev_k = k;
-			prev_l = l;
 			start_pos++;
 		}
 		if (current_streak_size > 0) {
-			construct_streaks(&all_streaks, &current_streak, prev_seen_nodes, prev_nodes_count, current_streak_size,
-				is_ambiguous_streak, &is_first_streak);
+			add_streak(aux_data, prev_seen_nodes, prev_nodes_count, current_streak_size, is_ambiguous_streak);
+		}
+	}
+	kstring_t* output_buffer = prophyle_worker->output_buffers + tid;
+	prophyle_read_output_t* output = prophyle_worker->output + i;
+	output->tid = tid;
+	output->offset = output_buffer->l;
+	if (opt->output) {
+		if (!prophyle_worker->read_assigners) {
+			construct_streaks(aux_data, output_buffer);
+		} else if (opt->assignment_format == ASSIGNMENT_FORMAT_KRAKEN) {
+			// only the Kraken-like output of the assignment prints the k-mer blocks
+			aux_data->krakmers.l = 0;
+			construct_streaks(aux_data, &aux_data->krakmers);
 		}
-		if (opt->output) {
-			size_t all_streaks_length = strlen(all_streaks);
-			prophyle_worker->output[i] = malloc((all_streaks_length + 1) * sizeof(char));
-			strncpy(prophyle_worker->output[i], all_streaks, all_streaks_length + 1);
+	}
+	if (timed) {
+		// everything else than the translation of positions is the building of streaks
+		const double positions_time = stats->sa2pos_time + stats->pos2rid_time - start_positions_time;
+		stats->streaks_time += stats_time() - start_time - positions_time;
+	}
+	if (opt->output && prophyle_worker->read_assigners) {
+		const double assignment_start = timed ? stats_time() : 0;
+		assign_read(prophyle_worker, aux_data, &seq, aux_data->krakmers.s ? aux_data->krakmers.s : "", tid, output_buffer);
+		if (timed) {
+			stats->assignment_time += stats_time() - assignment_start;
+		}
+	}
+	output->length = output_buffer->l - output->offset;
+}
+
+// SA intervals of a batch of SA_SEARCH_LANES reads are searched together, then the reads
+// are processed one by one
+void process_sequence_batch(void* data, int batch, int tid) {
+	prophyle_worker_t* prophyle_worker = (prophyle_worker_t*)data;
+	const prophyle_index_opt_t* opt = prophyle_worker->opt;
+	prophyle_query_aux_t* aux_data = &prophyle_worker->aux_data[tid];
+	int first = batch * SA_SEARCH_LANES;
+	int last = first + SA_SEARCH_LANES < prophyle_worker->seqs_cnt ? first + SA_SEARCH_LANES : prophyle_worker->seqs_cnt;
+	size_t offsets[SA_SEARCH_LANES];
+	size_t intervals_cnt = 0;
+	int i;
+	for (i = first; i < last; ++i) {
+		offsets[i - first] = intervals_cnt;
+		if (prophyle_worker->seqs[i].len >= opt->kmer_length) {
+			intervals_cnt += prophyle_worker->seqs[i].len - opt->kmer_length + 1;
 		}
 	}
+	if (intervals_cnt > aux_data->intervals_capacity) {
+		while (intervals_cnt > aux_data->intervals_capacity) {
+			aux_data->intervals_capacity = aux_data->intervals_capacity ? aux_data->intervals_capacity << 1 : 1024;
+		}
+		aux_data->intervals = realloc(aux_data->intervals, aux_data->intervals_capacity * sizeof(sa_interval_t));
+	}
+	sa_search_lane_t lanes[SA_SEARCH_LANES];
+	for (i = first; i < last; ++i) {
+		sa_search_lane_init(&lanes[i - first], prophyle_worker->seqs[i].seq, prophyle_worker->seqs[i].len,
+			aux_data->intervals + offsets[i - first]);
+	}
+	sa_search_params_t params;
+	params.kmer_length = opt->kmer_length;
+	params.use_klcp = opt->use_klcp;
+	params.skip_after_fail = opt->skip_after_fail;
+	params.sampling_distance = opt->sampling_distance;
+	params.minimizer_window = opt->minimizer_window;
+	prophyle_query_stats_t* stats = &aux_data->stats;
+	const double search_start = opt->need_log ? stats_time() : 0;
+	sa_search_intervals(prophyle_worker->idx->bwt, prophyle_worker->klcp, &params, lanes, last - first);
+	if (opt->need_log) {
+		stats->sa_search_time += stats_time() - search_start;
+	}
+	for (i = first; i < last; ++i) {
+		const sa_search_lane_t* lane = &lanes[i - first];
+		stats->bwt_restarts += lane->restarts;
+		stats->klcp_continues += lane->klcp_continues;
+		stats->bwt_extensions += lane->extensions;
+		stats->kmers_skipped += lane->skipped;
+	}
+	for (i = first; i < last; ++i) {
+		process_sequence(prophyle_worker, i, tid, aux_data->intervals + offsets[i - first]);
+	}
 }
 
-void process_sequences(const bwaidx_t* idx, int n_seqs, bwa_seq_t* seqs,
-	const prophyle_index_opt_t* opt, const klcp_t* klcp)
+void process_sequences(prophyle_worker_t* prophyle_worker)
 {
 	extern void kt_for(int n_threads, void (*func)(void*,int,int), void* data, int n);
-	bwase_initialize();
-	prophyle_worker_t* prophyle_worker = prophyle_worker_init(idx, n_seqs, seqs, opt, klcp);
-	kt_for(opt->n_threads, process_sequence, prophyle_worker, n_seqs);
+	int batches_cnt = (prophyle_worker->seqs_cnt + SA_SEARCH_LANES - 1) / SA_SEARCH_LANES;
+	kt_for(prophyle_worker->opt->n_threads, process_sequence_batch, prophyle_worker, batches_cnt);
+}
+
+void output_sequences(const prophyle_worker_t* prophyle_worker) {
+	const prophyle_index_opt_t* opt = prophyle_worker->opt;
+	FILE* output_file = prophyle_worker->output_file;
 	int i;
-	for (i = 0; i < n_seqs; ++i) {
-		bwa_seq_t* seq = seqs + i;
-		if (opt->output) {
-			fprintf(stdout, "U\t%s\t0\t%d\t", seq->name, seq->len);
-			print_streaks(prophyle_worker->output[i]);
+	for (i = 0; i < prophyle_worker->seqs_cnt; ++i) {
+		const bwa_seq_t* seq = prophyle_worker->seqs + i;
+		const prophyle_read_output_t* output = prophyle_worker->output + i;
+		const char* output_str = prophyle_worker->output_buffers[output->tid].s + output->offset;
+		if (prophyle_worker->read_assigners) {
+			fwrite(output_str, 1, output->length, output_file);
+		} else if (opt->output) {
+			fprintf(output_file, "U\t%s\t0\t%d\t", seq->name, seq->len);
+			print_streaks(output_file, output_str, output->length);
 			if (opt->output_read_qual) {
-				fprintf(stdout, "\t");
-				print_read(seq);
-				fprintf(stdout, "\t");
-				print_read_qual(seq);
+				fputc('\t', output_file);
+				print_read(output_file, seq);
+				fputc('\t', output_file);
+				print_read_qual(output_file, seq);
 			}
-			fprintf(stdout, "\n");
+			fputc('\n', output_file);
 		}
-		free(seq->name); free(seq->seq); free(seq->rseq); free(seq->qual);
-		seq->name = 0; seq->seq = seq->rseq = seq->qual = 0;
 	}
-	prophyle_worker_destroy(prophyle_worker);
 }
 
-void query(const char* prefix, const char* fn_fa, const prophyle_index_opt_t* opt) {
-	extern bwa_seqio_t* bwa_open_reads(int mode, const char* fn_fa);
+// Name of the pair: common part of the mate names before the last '/' (e.g. 'r1' for 'r1/1' and
+// 'r1/2'), or the name of the first mate, as prophyle_paired_end.py does.
+char* pair_name(const char* name_1, const char* name_2) {
+	const char* sep_1 = strrchr(name_1, '/');
+	const char* sep_2 = strrchr(name_2, '/');
+	if (sep_1 && sep_2 && sep_1 - name_1 == sep_2 - name_2
+			&& strncmp(name_1, name_2, sep_1 - name_1) == 0
+			&& sep_1 - name_1 >= 0.3 * strlen(name_1)) {
+		return strndup(name_1, sep_1 - name_1);
+	}
+	return strdup(name_1);
+}
 
-	int n_seqs;
-	bwa_seq_t* seqs;
-	bwa_seqio_t* ks;
-	bwaidx_t* idx;
+// Mates are matched as one read 'mate_1 NNN mate_2' (qualities 'qual_1 !!! qual_2'), so that
+// the k-mers of both mates are scored together and no k-mer spans the two mates.
+// Sequences of bwa_seq_t are stored reversed and rseq is the reverse complement, so both start with mate_2.
+void merge_mates(bwa_seq_t* mate_1, const bwa_seq_t* mate_2) {
+	const int gap = 3;
+	int len = mate_1->len + gap + mate_2->len;
+	ubyte_t* seq = malloc(len + 1);
+	memcpy(seq, mate_2->seq, mate_2->len);
+	memset(seq + mate_2->len, 4, gap);
+	memcpy(seq + mate_2->len + gap, mate_1->seq, mate_1->len);
+	seq[len] = 0;
+	ubyte_t* rseq = malloc(len + 1);
+	memcpy(rseq, mate_2->rseq, mate_2->len);
+	memset(rseq + mate_2->len, 4, gap);
+	memcpy(rseq + mate_2->len + gap, mate_1->rseq, mate_1->len);
+	rseq[len] = 0;
+	ubyte_t* qual = NULL;
+	// an empty mate of a FASTQ file has no qualities
+	if (mate_1->qual || mate_2->qual) {
+		qual = malloc(len + 1);
+		memset(qual, '!', len);
+		if (mate_1->qual) {
+			memcpy(qual, mate_1->qual, mate_1->len);
+		}
+		if (mate_2->qual) {
+			memcpy(qual + mate_1->len + gap, mate_2->qual, mate_2->len);
+		}
+		qual[len] = 0;
+	}
+	char* name = pair_name(mate_1->name, mate_2->name);
+	free(mate_1->seq);
+	free(mate_1->rseq);
+	free(mate_1->qual);
+	free(mate_1->name);
+	mate_1->seq = seq;
+	mate_1->rseq = rseq;
+	mate_1->qual = qual;
+	mate_1->name = name;
+	mate_1->len = len;
+	mate_1->full_len = len;
+}
+
+// Reads the next batch of reads; with a second file, pairs of mates are merged into single reads.
+bwa_seq_t* read_batch(prophyle_pipeline_t* pipeline, int* n_seqs) {
+	const prophyle_index_opt_t* opt = pipeline->session->opt;
+	if (pipeline->pairs_ended) {
+		return 0;
+	}
+	bwa_seq_t* seqs = bwa_read_seq(pipeline->ks, opt->batch_size, n_seqs, opt->mode, opt->trim_qual);
+	if (!pipeline->ks_pe) {
+		return seqs;
+	}
+	int n_mates = 0;
+	bwa_seq_t* mates = bwa_read_seq(pipeline->ks_pe, opt->batch_size, &n_mates, opt->mode, opt->trim_qual);
+	if (n_mates != *n_seqs) {
+		fprintf(stderr, "[prophyle_index:%s] Warning: paired-end files of different length (merged till the end of the shortest)\n",
+			__func__);
+		pipeline->pairs_ended = 1;
+		int n_pairs = n_mates < *n_seqs ? n_mates : *n_seqs;
+		bwa_seq_t* unpaired = n_mates < *n_seqs ? seqs : mates;
+		int n_unpaired = (n_mates < *n_seqs ? *n_seqs : n_mates) - n_pairs;
+		bwa_seq_t* rest = malloc(n_unpaired * sizeof(bwa_seq_t));
+		memcpy(rest, unpaired + n_pairs, n_unpaired * sizeof(bwa_seq_t));
+		bwa_free_read_seq(n_unpaired, rest);
+		*n_seqs = n_pairs;
+		if (n_pairs == 0) {
+			free(seqs);
+			free(mates);
+			return 0;
+		}
+	}
 	int i;
-	FILE* log_file;
+	for (i = 0; i < *n_seqs; ++i) {
+		merge_mates(seqs + i, mates + i);
+	}
+	bwa_free_read_seq(*n_seqs, mates);
+	return seqs;
+}
+
+// Reading of reads, their matching and writing of the output are the three steps of kt_pipeline,
+// so that the next batch is read and the previous one is written while the current one is matched.
+void* query_pipeline_step(void* shared, int step, void* data) {
+	prophyle_pipeline_t* pipeline = (prophyle_pipeline_t*)shared;
+	const prophyle_index_opt_t* opt = pipeline->session->opt;
+	if (step == 0) {
+		int n_seqs = 0;
+		bwa_seq_t* seqs = read_batch(pipeline, &n_seqs);
+		if (seqs == 0) {
+			return 0;
+		}
+		const prophyle_query_session_t* session = pipeline->session;
+		prophyle_worker_t* prophyle_worker = prophyle_worker_init(session->idx, n_seqs, seqs, opt, session->klcp);
+		prophyle_worker->aux_data = session->aux_data;
+		prophyle_worker->read_assigners = session->read_assigners;
+		prophyle_worker->tree_ids = session->tree_ids;
+		prophyle_worker->cache = session->cache;
+		prophyle_worker->pos2node_map = session->pos2node_map;
+		prophyle_worker->output_file = pipeline->output_file;
+		return prophyle_worker;
+	} else if (step == 1) {
+		process_sequences((prophyle_worker_t*)data);
+		return data;
+	} else if (step == 2) {
+		prophyle_worker_t* prophyle_worker = (prophyle_worker_t*)data;
+		output_sequences(prophyle_worker);
+		pipeline->total_seqs += prophyle_worker->seqs_cnt;
+		int i;
+		for (i = 0; i < prophyle_worker->seqs_cnt; ++i) {
+			int seq_kmers_count = prophyle_worker->seqs[i].len - opt->kmer_length + 1;
+			if (seq_kmers_count > 0) {
+				pipeline->total_kmers_count += seq_kmers_count;
+			}
+		}
+		bwa_free_read_seq(prophyle_worker->seqs_cnt, prophyle_worker->seqs);
+		prophyle_worker_destroy(prophyle_worker);
+		return 0;
+	}
+	return 0;
+}
+
+prophyle_query_session_t* prophyle_query_session_init(const char* prefix, const prophyle_index_opt_t* opt) {
+	prophyle_query_session_t* session = calloc(1, sizeof(prophyle_query_session_t));
+	session->opt = opt;
 	if (opt->need_log) {
-		log_file = fopen(opt->log_file_name, "w");
+		session->log_file = fopen(opt->log_file_name, "w");
 	} else {
-		log_file = stderr;
+		session->log_file = stderr;
 	}
+	FILE* log_file = session->log_file;
 
-	if ((idx = bwa_idx_load_partial(prefix, BWA_IDX_ALL, opt->need_log, log_file)) == 0) {
+	bwaidx_t* idx;
+	if ((idx = bwa_idx_load_partial(prefix, BWA_IDX_ALL, opt->need_log, log_file, opt->use_mmap)) == 0) {
 		fprintf(stderr, "[prophyle_index:%s] Couldn't load idx from %s\n", __func__, prefix);
-		return;
+		if (opt->need_log) {
+			fclose(log_file);
+		}
+		free(session);
+		return NULL;
 	}
+	session->idx = idx;
 
 	// If fa2pac was called only for doubled string, then set bns->l_pac = bwt->seq_len, as it is for forward-only string
 	idx->bns->l_pac = idx->bwt->seq_len / 2;
 
 	bwa_destroy_unused_fields(idx);
+	session->pos2node_map = pos2node_map_init(idx->bns);
 
-	double ctime, rtime;
-	ctime = cputime(); rtime = realtime();
+	double rtime = realtime();
 	klcp_t* klcp = malloc(sizeof(klcp_t));
 	klcp->klcp = malloc(sizeof(bitarray_t));
 
@@ -514,26 +802,139 @@ void query(const char* prefix, const char* fn_fa, const prophyle_index_opt_t* op
 	  sprintf(kmer_length_str, "%d", opt->kmer_length);
 	  strcat(fn, kmer_length_str);
 	  strcat(fn, ".klcp");
-		klcp_restore(fn, klcp);
+		if (opt->use_mmap) {
+			klcp_restore_mmap(fn, klcp);
+		} else {
+			klcp_restore(fn, klcp);
+		}
 		free(fn);
 		fprintf(log_file, "klcp_loading\t%.2fs\n", realtime() - rtime);
 	}
-	ks = bwa_open_reads(opt->mode, fn_fa);
-	float total_time = 0;
-	int64_t total_seqs = 0;
-	ctime = cputime(); rtime = realtime();
-	int64_t total_kmers_count = 0;
-	while ((seqs = bwa_read_seq(ks, 0x100, &n_seqs, opt->mode, opt->trim_qual)) != 0) {
-		process_sequences(idx, n_seqs, seqs, opt, klcp);
-		total_seqs += n_seqs;
-		for (i = 0; i < n_seqs; ++i) {
-			int seq_kmers_count = seqs[i].len - opt->kmer_length + 1;
-			if (seq_kmers_count > 0) {
-				total_kmers_count += seq_kmers_count;
+	session->klcp = klcp;
+	if (opt->assign) {
+		session->assignment = assignment_init(opt->tree_fn, opt->kmer_length, opt->assignment_format, opt->assignment_measure,
+			opt->assignment_kmer_lca, opt->assignment_annotate, opt->assignment_tie_lca, opt->assignment_not_translate_blocks);
+		int nodes_count = get_nodes_count();
+		session->tree_ids = malloc(nodes_count * sizeof(int32_t));
+		int node;
+		for (node = 0; node < nodes_count; ++node) {
+			session->tree_ids[node] = assignment_id_by_name(session->assignment, get_node_name(node));
+			if (session->tree_ids[node] < 0) {
+				err_fatal(__func__, "node '%s' from the index is not present in the tree %s", get_node_name(node), opt->tree_fn);
 			}
 		}
-		bwa_free_read_seq(n_seqs, seqs);
+		session->read_assigners = malloc(opt->n_threads * sizeof(read_assigner_t*));
+		int tid;
+		for (tid = 0; tid < opt->n_threads; ++tid) {
+			session->read_assigners[tid] = read_assigner_init(session->assignment);
+		}
+	}
+	session->aux_data = prophyle_aux_data_init(idx, opt->n_threads);
+	if (opt->cache_size > 0) {
+		session->cache = node_set_cache_init(opt->cache_size);
 	}
+	bwase_initialize();
+	return session;
+}
+
+// Sums up the counters of all threads into the log and resets them for the next read file.
+void log_query_stats(const prophyle_query_session_t* session, FILE* log_file) {
+	const prophyle_index_opt_t* opt = session->opt;
+	prophyle_query_stats_t total;
+	memset(&total, 0, sizeof(prophyle_query_stats_t));
+	int tid, b;
+	for (tid = 0; tid < opt->n_threads; ++tid) {
+		prophyle_query_stats_t* stats = &session->aux_data[tid].stats;
+		total.bwt_restarts += stats->bwt_restarts;
+		total.klcp_continues += stats->klcp_continues;
+		total.bwt_extensions += stats->bwt_extensions;
+		total.kmers_inherited += stats->kmers_inherited;
+		total.kmers_skipped += stats->kmers_skipped;
+		total.rids_computations += stats->rids_computations;
+		total.using_prev_rids += stats->using_prev_rids;
+		total.sa_positions_translated += stats->sa_positions_translated;
+		total.sa_truncations += stats->sa_truncations;
+		total.cache_hits += stats->cache_hits;
+		total.cache_misses += stats->cache_misses;
+		for (b = 0; b < PROPHYLE_SA_WIDTH_BINS; ++b) {
+			total.sa_widths[b] += stats->sa_widths[b];
+		}
+		total.sa_search_time += stats->sa_search_time;
+		total.sa2pos_time += stats->sa2pos_time;
+		total.pos2rid_time += stats->pos2rid_time;
+		total.streaks_time += stats->streaks_time;
+		total.assignment_time += stats->assignment_time;
+		memset(stats, 0, sizeof(prophyle_query_stats_t));
+	}
+	fprintf(log_file, "bwt_restarts\t%" PRId64 "\n", total.bwt_restarts);
+	fprintf(log_file, "klcp_continues\t%" PRId64 "\n", total.klcp_continues);
+	fprintf(log_file, "bwt_extensions\t%" PRId64 "\n", total.bwt_extensions);
+	fprintf(log_file, "kmers_inherited\t%" PRId64 "\n", total.kmers_inherited);
+	fprintf(log_file, "kmers_skipped\t%" PRId64 "\n", total.kmers_skipped);
+	fprintf(log_file, "rids_computations\t%" PRId64 "\n", total.rids_computations);
+	fprintf(log_file, "using_prev_rids\t%" PRId64 "\n", total.using_prev_rids);
+	fprintf(log_file, "sa_positions_translated\t%" PRId64 "\n", total.sa_positions_translated);
+	fprintf(log_file, "sa_truncations\t%" PRId64 "\n", total.sa_truncations);
+	// thread times, summed over all threads
+	fprintf(log_file, "sa_search_time\t%.3fs\n", total.sa_search_time);
+	fprintf(log_file, "sa2pos_time\t%.3fs\n", total.sa2pos_time);
+	fprintf(log_file, "pos2rid_time\t%.3fs\n", total.pos2rid_time);
+	fprintf(log_file, "streaks_time\t%.3fs\n", total.streaks_time);
+	if (session->assignment) {
+		fprintf(log_file, "assignment_time\t%.3fs\n", total.assignment_time);
+	}
+	int last_bin = 0;
+	for (b = 0; b < PROPHYLE_SA_WIDTH_BINS; ++b) {
+		if (total.sa_widths[b] > 0) {
+			last_bin = b;
+		}
+	}
+	for (b = 0; b <= last_bin; ++b) {
+		if (b < 2) {
+			fprintf(log_file, "sa_width_%d", b);
+		} else if (b < PROPHYLE_SA_WIDTH_BINS - 1) {
+			fprintf(log_file, "sa_width_%" PRIu64 "-%" PRIu64, (uint64_t)1 << (b - 1), ((uint64_t)1 << b) - 1);
+		} else {
+			fprintf(log_file, "sa_width_%" PRIu64 "+", (uint64_t)1 << (b - 1));
+		}
+		fprintf(log_file, "\t%" PRId64 "\n", total.sa_widths[b]);
+	}
+	if (session->cache) {
+		fprintf(log_file, "cache_hits\t%" PRId64 "\n", total.cache_hits);
+		fprintf(log_file, "cache_misses\t%" PRId64 "\n", total.cache_misses);
+	}
+}
+
+int64_t prophyle_query_session_run(prophyle_query_session_t* session, const char* fn_fa, const char* fn_fa_pe,
+		FILE* output_file) {
+	extern bwa_seqio_t* bwa_open_reads(int mode, const char* fn_fa);
+	extern void kt_pipeline(int n_threads, void* (*func)(void*, int, void*), void* shared_data, int n_steps);
+	const prophyle_index_opt_t* opt = session->opt;
+	FILE* log_file = session->log_file;
+
+	if (session->assignment) {
+		char* header = assignment_header(session->assignment);
+		fputs(header, output_file);
+		free(header);
+	}
+	bwa_seqio_t* ks = bwa_open_reads(opt->mode, fn_fa);
+	bwa_seqio_t* ks_pe = fn_fa_pe ? bwa_open_reads(opt->mode, fn_fa_pe) : NULL;
+	float total_time = 0;
+	double ctime, rtime;
+	ctime = cputime(); rtime = realtime();
+	prophyle_pipeline_t pipeline;
+	pipeline.session = session;
+	pipeline.ks = ks;
+	pipeline.ks_pe = ks_pe;
+	pipeline.pairs_ended = 0;
+	pipeline.output_file = output_file;
+	pipeline.total_seqs = 0;
+	pipeline.total_kmers_count = 0;
+	// -v output is printed directly by the matching threads, so batches are not overlapped then
+	kt_pipeline(opt->output_old ? 1 : 2, query_pipeline_step, &pipeline, 3);
+	fflush(output_file);
+	int64_t total_seqs = pipeline.total_seqs;
+	int64_t total_kmers_count = pipeline.total_kmers_count;
 	total_time = realtime() - rtime;
 	fprintf(stderr, "[prophyle_index:%s] match time: %.2f sec\n", __func__, total_time);
 	fprintf(stderr, "[prophyle_index::%s] Processed %llu reads in %.3f CPU sec, %.3f real sec\n", __func__, total_seqs, cputime() - ctime, realtime() - rtime);
@@ -544,16 +945,60 @@ void query(const char* prefix, const char* fn_fa, const prophyle_index_opt_t* op
 		fprintf(log_file, "kmers\t%" PRId64 "\n", total_kmers_count);
 		fprintf(log_file, "rpm\t%" PRId64 "\n", (int64_t)(round(total_seqs * 60.0 / total_time)));
 		fprintf(log_file, "kpm\t%" PRId64 "\n", (int64_t)(round(total_kmers_count * 60.0 / total_time)));
+		log_query_stats(session, log_file);
+		if (session->cache) {
+			fprintf(log_file, "cache_entries\t%" PRId64 "\n", session->cache->entries_cnt);
+			fprintf(log_file, "cache_evictions\t%" PRId64 "\n", session->cache->evictions);
+			fprintf(log_file, "cache_nodes\t%" PRId64 "\n", session->cache->nodes_cnt);
+			fprintf(log_file, "cache_rejections\t%" PRId64 "\n", session->cache->rejections);
+		}
+		fflush(log_file);
 	}
+	bwa_seq_close(ks);
+	if (ks_pe) {
+		bwa_seq_close(ks_pe);
+	}
+	return total_seqs;
+}
+
+void prophyle_query_session_destroy(prophyle_query_session_t* session) {
+	if (!session) {
+		return;
+	}
+	const prophyle_index_opt_t* opt = session->opt;
 	if (opt->need_log) {
-		fclose(log_file);
+		fclose(session->log_file);
+	}
+	int tid;
+	for (tid = 0; tid < opt->n_threads; ++tid) {
+		prophyle_aux_data_destroy(&session->aux_data[tid]);
 	}
+	free(session->aux_data);
+	node_set_cache_destroy(session->cache);
+	pos2node_map_destroy(session->pos2node_map);
 	if (opt->use_klcp) {
-		destroy_klcp(klcp);
+		destroy_klcp(session->klcp);
 	} else {
-		free(klcp->klcp);
-		free(klcp);
+		free(session->klcp->klcp);
+		free(session->klcp);
 	}
-	bwa_idx_destroy_without_bns_name_and_anno(idx);
-	bwa_seq_close(ks);
+	if (session->assignment) {
+		for (tid = 0; tid < opt->n_threads; ++tid) {
+			read_assigner_destroy(session->read_assigners[tid]);
+		}
+		free(session->read_assigners);
+		free(session->tree_ids);
+		assignment_destroy(session->assignment);
+	}
+	bwa_idx_destroy_without_bns_name_and_anno(session->idx, opt->use_mmap);
+	free(session);
+}
+
+void query(const char* prefix, const char* fn_fa, const char* fn_fa_pe, const prophyle_index_opt_t* opt) {
+	prophyle_query_session_t* session = prophyle_query_session_init(prefix, opt);
+	if (!session) {
+		return;
+	}
+	prophyle_query_session_run(session, fn_fa, fn_fa_pe, stdout);
+	prophyle_query_session_destroy(session);
 }
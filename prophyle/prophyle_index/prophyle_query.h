@@ -7,12 +7,18 @@
 #ifndef PROPHYLE_QUERY_H
 #define PROPHYLE_QUERY_H
 
+#include <stdio.h>
 #include <stdint.h>
 #include "bwt.h"
 #include "bwtaln.h"
 #include "bwa.h"
+#include "kstring.h"
 #include "klcp.h"
+#include "sa_interval_search.h"
+#include "node_set_cache.h"
+#include "bwa_utils.h"
 #include "prophyle_utils.h"
+#include "assignment_c_api.h"
 
 typedef struct {
 	uint64_t position;
@@ -21,27 +27,127 @@ typedef struct {
 	int node;
 } bwt_position_t;
 
+typedef struct {
+	size_t nodes_offset;
+	int32_t nodes_cnt;
+	int32_t size;
+	int is_ambiguous;
+} prophyle_streak_t;
+
+// bins of the histogram of SA interval widths: 0 (no occurrence), 1, 2-3, 4-7, ..., the last bin
+// collects the widths from 2^(PROPHYLE_SA_WIDTH_BINS - 2)
+#define PROPHYLE_SA_WIDTH_BINS 22
+
+// Counters of the matching, kept per thread and summed up in the log (-l) after every read file;
+// times are summed over all threads and measured only with -l.
+typedef struct {
+	// k-mers searched in the BWT from scratch / continued from the previous k-mer using k-LCP
+	int64_t bwt_restarts;
+	int64_t klcp_continues;
+	int64_t bwt_extensions;
+	// k-mers not searched because of sampling / because of a failure of the previous search (-s)
+	int64_t kmers_inherited;
+	int64_t kmers_skipped;
+	// k-mers whose positions were translated from the SA / shifted from the previous k-mer
+	int64_t rids_computations;
+	int64_t using_prev_rids;
+	int64_t sa_positions_translated;
+	// SA intervals truncated to MAX_POSSIBLE_SA_POSITIONS positions
+	int64_t sa_truncations;
+	int64_t cache_hits;
+	int64_t cache_misses;
+	int64_t sa_widths[PROPHYLE_SA_WIDTH_BINS];
+	double sa_search_time;
+	double sa2pos_time;
+	double pos2rid_time;
+	double streaks_time;
+	double assignment_time;
+} prophyle_query_stats_t;
+
+// Per-thread scratch buffers, allocated once per session; positions, streaks and the assignment
+// buffers grow on demand and are reused by all reads processed by the thread afterwards.
 typedef struct {
 	bwt_position_t* positions;
-	char* all_streaks;
-	char* current_streak;
+	size_t positions_capacity;
+	prophyle_streak_t* streaks;
+	size_t streaks_cnt;
+	size_t streaks_capacity;
+	int32_t* streak_nodes;
+	size_t streak_nodes_cnt;
+	size_t streak_nodes_capacity;
+	assignment_block_t* assignment_blocks;
+	size_t assignment_blocks_capacity;
+	int32_t* assignment_nodes;
+	size_t assignment_nodes_capacity;
+	sa_interval_t* intervals;
+	size_t intervals_capacity;
 	int32_t* seen_nodes;
 	int32_t* prev_seen_nodes;
 	int8_t* seen_nodes_marks;
-	int rids_computations;
-	int using_prev_rids;
+	// k-mer blocks, sequence and qualities of the read passed to the assignment
+	kstring_t krakmers;
+	kstring_t read;
+	kstring_t qualities;
+	prophyle_query_stats_t stats;
 } prophyle_query_aux_t;
 
+// output of a read: length bytes from offset in the output buffer of the thread which processed it
+typedef struct {
+	int32_t tid;
+	size_t offset;
+	size_t length;
+} prophyle_read_output_t;
+
 typedef struct {
 	const bwaidx_t* idx;
 	const klcp_t* klcp;
 	const prophyle_index_opt_t* opt;
-	const bwa_seq_t* seqs;
+	bwa_seq_t* seqs;
 	prophyle_query_aux_t* aux_data;
 	int32_t seqs_cnt;
-	char** output;
+	prophyle_read_output_t* output;
+	// one per thread, outputs of all reads of the batch processed by the thread
+	kstring_t* output_buffers;
+	read_assigner_t** read_assigners;
+	const int32_t* tree_ids;
+	node_set_cache_t* cache;
+	const pos2node_map_t* pos2node_map;
+	FILE* output_file;
 } prophyle_worker_t;
 
-void query(const char* prefix, const char* fn_fa, const prophyle_index_opt_t* opt);
+// Everything loaded once and reused by all queried read files: the index, the k-LCP, the tree
+// for assignment, the node-set cache, the sampled position->node map and per-thread scratch buffers.
+typedef struct {
+	bwaidx_t* idx;
+	klcp_t* klcp;
+	const prophyle_index_opt_t* opt;
+	assignment_t* assignment;
+	int32_t* tree_ids;
+	read_assigner_t** read_assigners;
+	prophyle_query_aux_t* aux_data;
+	node_set_cache_t* cache;
+	pos2node_map_t* pos2node_map;
+	FILE* log_file;
+} prophyle_query_session_t;
+
+typedef struct {
+	const prophyle_query_session_t* session;
+	bwa_seqio_t* ks;
+	// second mates of paired-end reads, NULL for single-end reads
+	bwa_seqio_t* ks_pe;
+	// one of the paired-end files has no more reads
+	int pairs_ended;
+	FILE* output_file;
+	int64_t total_seqs;
+	int64_t total_kmers_count;
+} prophyle_pipeline_t;
+
+prophyle_query_session_t* prophyle_query_session_init(const char* prefix, const prophyle_index_opt_t* opt);
+// queries reads from fn_fa (paired with mates from fn_fa_pe unless NULL) and writes kraklines
+// (or assignments) to output_file, returns the number of reads (pairs)
+int64_t prophyle_query_session_run(prophyle_query_session_t* session, const char* fn_fa, const char* fn_fa_pe,
+		FILE* output_file);
+void prophyle_query_session_destroy(prophyle_query_session_t* session);
+void query(const char* prefix, const char* fn_fa, const char* fn_fa_pe, const prophyle_index_opt_t* opt);
 
 #endif //PROPHYLE_QUERY_H
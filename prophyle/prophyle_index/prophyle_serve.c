@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "prophyle_serve.h"
+#include "prophyle_query.h"
+
+#define SERVE_CONTINUE 0
+#define SERVE_QUIT 1
+#define SERVE_SHUTDOWN 2
+
+int process_request(prophyle_query_session_t* session, char* request, FILE* reply_file) {
+	char* end = request + strlen(request);
+	while (end > request && (end[-1] == '\n' || end[-1] == '\r')) {
+		*--end = '\0';
+	}
+	if (request[0] == '\0') {
+		return SERVE_CONTINUE;
+	}
+	if (strcmp(request, "quit") == 0) {
+		return SERVE_QUIT;
+	}
+	if (strcmp(request, "shutdown") == 0) {
+		return SERVE_SHUTDOWN;
+	}
+	// '<in.fq>\t<out_fn>' or '<in.1.fq>\t<in.2.fq>\t<out_fn>' for paired-end reads
+	char* fields[3];
+	int fields_cnt = 0;
+	char* field = request;
+	while (field != NULL && fields_cnt < 3) {
+		fields[fields_cnt++] = field;
+		field = strchr(field, '\t');
+		if (field != NULL) {
+			*field++ = '\0';
+		}
+	}
+	if (fields_cnt < 2 || field != NULL) {
+		fprintf(reply_file, "ERROR\texpected request '<in.fq>[\\t<in.2.fq>]\\t<out_fn>'\n");
+		return SERVE_CONTINUE;
+	}
+	char* reads_fn = fields[0];
+	char* reads_pe_fn = fields_cnt == 3 ? fields[1] : NULL;
+	char* output_fn = fields[fields_cnt - 1];
+	if (access(reads_fn, R_OK) != 0) {
+		fprintf(reply_file, "ERROR\tcannot read file '%s'\n", reads_fn);
+		return SERVE_CONTINUE;
+	}
+	if (reads_pe_fn && access(reads_pe_fn, R_OK) != 0) {
+		fprintf(reply_file, "ERROR\tcannot read file '%s'\n", reads_pe_fn);
+		return SERVE_CONTINUE;
+	}
+	FILE* output_file = fopen(output_fn, "w");
+	if (output_file == NULL) {
+		fprintf(reply_file, "ERROR\tcannot write file '%s'\n", output_fn);
+		return SERVE_CONTINUE;
+	}
+	if (reads_pe_fn) {
+		fprintf(stderr, "[prophyle_index:%s] querying paired-end reads from %s and %s\n", __func__, reads_fn, reads_pe_fn);
+	} else {
+		fprintf(stderr, "[prophyle_index:%s] querying reads from %s\n", __func__, reads_fn);
+	}
+	int64_t reads = prophyle_query_session_run(session, reads_fn, reads_pe_fn, output_file);
+	fclose(output_file);
+	fprintf(reply_file, "OK\t%" PRId64 "\n", reads);
+	return SERVE_CONTINUE;
+}
+
+int serve_stream(prophyle_query_session_t* session, FILE* request_file, FILE* reply_file) {
+	char* line = NULL;
+	size_t line_capacity = 0;
+	int status = SERVE_CONTINUE;
+	while (status == SERVE_CONTINUE && getline(&line, &line_capacity, request_file) >= 0) {
+		status = process_request(session, line, reply_file);
+		fflush(reply_file);
+	}
+	free(line);
+	return status;
+}
+
+int serve_socket(prophyle_query_session_t* session, const char* socket_path) {
+	struct sockaddr_un addr;
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "[prophyle_index:%s] socket path %s is too long\n", __func__, socket_path);
+		return 1;
+	}
+	int server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (server_fd < 0) {
+		perror("[prophyle_index] socket");
+		return 1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+	unlink(socket_path);
+	if (bind(server_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(server_fd, 16) < 0) {
+		perror("[prophyle_index] bind");
+		close(server_fd);
+		return 1;
+	}
+	// a client closing its connection early must not kill the server
+	signal(SIGPIPE, SIG_IGN);
+	fprintf(stderr, "[prophyle_index:%s] listening on %s\n", __func__, socket_path);
+	int status = SERVE_CONTINUE;
+	while (status != SERVE_SHUTDOWN) {
+		int client_fd = accept(server_fd, NULL, NULL);
+		if (client_fd < 0) {
+			perror("[prophyle_index] accept");
+			break;
+		}
+		FILE* request_file = fdopen(client_fd, "r");
+		FILE* reply_file = fdopen(dup(client_fd), "w");
+		status = serve_stream(session, request_file, reply_file);
+		fclose(request_file);
+		fclose(reply_file);
+	}
+	close(server_fd);
+	unlink(socket_path);
+	return 0;
+}
+
+int serve(const char* prefix, const prophyle_index_opt_t* opt, const char* socket_path) {
+	prophyle_query_session_t* session = prophyle_query_session_init(prefix, opt);
+	if (!session) {
+		return 1;
+	}
+	fprintf(stderr, "[prophyle_index:%s] index %s loaded\n", __func__, prefix);
+	int ret = 0;
+	if (socket_path) {
+		ret = serve_socket(session, socket_path);
+	} else {
+		serve_stream(session, stdin, stdout);
+	}
+	prophyle_query_session_destroy(session);
+	return ret;
+}
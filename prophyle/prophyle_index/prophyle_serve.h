@@ -0,0 +1,17 @@
+/*
+	prophyle_index serve command: the index is loaded once and read files are queried on request.
+	Author: Kamil Salikhov <salikhov.kamil@gmail.com>
+	Licence: MIT
+*/
+
+#ifndef PROPHYLE_SERVE_H
+#define PROPHYLE_SERVE_H
+
+#include "prophyle_utils.h"
+
+// Requests are read line by line from stdin, or from clients of the Unix socket socket_path if it is not NULL.
+// Request "<in.fq>\t<out_fn>" queries reads from in.fq and writes the output to out_fn, and is answered
+// "OK\t<reads>" or "ERROR\t<message>". Request "quit" closes the connection, "shutdown" stops the server.
+int serve(const char* prefix, const prophyle_index_opt_t* opt, const char* socket_path);
+
+#endif //PROPHYLE_SERVE_H
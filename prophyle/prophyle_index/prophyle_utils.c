@@ -1,5 +1,13 @@
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "prophyle_utils.h"
+#include "utils.h"
+#include "assignment_c_api.h"
 
 prophyle_index_opt_t* prophyle_index_init_opt()
 {
@@ -7,6 +15,7 @@ prophyle_index_opt_t* prophyle_index_init_opt()
 	o = (prophyle_index_opt_t*)calloc(1, sizeof(prophyle_index_opt_t));
 	o->mode = BWA_MODE_GAPE | BWA_MODE_COMPREAD;
 	o->n_threads = 1;
+	o->batch_size = 0x10000;
 	o->trim_qual = 0;
 	o->kmer_length = 14;
 	o->use_klcp = 0;
@@ -14,8 +23,48 @@ prophyle_index_opt_t* prophyle_index_init_opt()
 	o->output_read_qual = 0;
 	o->output_old = 0;
 	o->skip_positions_on_border = 1;
+	o->skip_after_fail = 0;
+	o->sampling_distance = 1;
+	o->minimizer_window = 0;
 	o->construct_sa_parallel = 0;
+	o->use_mmap = 0;
+	o->cache_size = 65536;
 	o->need_log = 0;
 	o->log_file_name = NULL;
+	o->assign = 0;
+	o->tree_fn = NULL;
+	o->assignment_format = ASSIGNMENT_FORMAT_SAM;
+	o->assignment_measure = ASSIGNMENT_MEASURE_H1;
+	o->assignment_annotate = 0;
+	o->assignment_tie_lca = 0;
+	o->assignment_kmer_lca = 0;
+	o->assignment_not_translate_blocks = 0;
 	return o;
 }
+
+void* prophyle_map_file(const char* fn, size_t* length)
+{
+	int fd = open(fn, O_RDONLY);
+	if (fd < 0) {
+		err_fatal(__func__, "fail to open file '%s' : %s", fn, strerror(errno));
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		err_fatal(__func__, "fail to stat file '%s' : %s", fn, strerror(errno));
+	}
+	*length = st.st_size;
+	// MAP_PRIVATE lets callers patch a few header words in place, only the touched pages are copied
+	void* addr = mmap(NULL, *length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (addr == MAP_FAILED) {
+		err_fatal(__func__, "fail to map file '%s' : %s", fn, strerror(errno));
+	}
+	close(fd);
+	return addr;
+}
+
+void prophyle_unmap_file(void* addr, size_t length)
+{
+	if (addr) {
+		munmap(addr, length);
+	}
+}
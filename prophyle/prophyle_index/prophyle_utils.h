@@ -1,5 +1,5 @@
 /*
-	Structure for prophyle_index options.
+	Structure for prophyle_index options and helpers for memory-mapped index files.
 	Author: Kamil Salikhov <salikhov.kamil@gmail.com>
 	Licence: MIT
 */
@@ -14,6 +14,7 @@
 typedef struct {
 	int mode;
 	int n_threads;
+	int batch_size;
 	int trim_qual;
 	int use_klcp;
 	int kmer_length;
@@ -21,12 +22,28 @@ typedef struct {
 	int output_old;
 	int output_read_qual;
 	int skip_after_fail;
+	int sampling_distance;
+	int minimizer_window;
 	int skip_positions_on_border;
 	int need_log;
 	char* log_file_name;
 	int construct_sa_parallel;
+	int use_mmap;
+	int cache_size;
+	int assign;
+	char* tree_fn;
+	int assignment_format;
+	int assignment_measure;
+	int assignment_annotate;
+	int assignment_tie_lca;
+	int assignment_kmer_lca;
+	int assignment_not_translate_blocks;
 } prophyle_index_opt_t;
 
 prophyle_index_opt_t* prophyle_index_init_opt();
+// maps the whole file fn, pages are shared with other processes mapping the same file
+// as long as they are not written to; length receives the size of the mapping
+void* prophyle_map_file(const char* fn, size_t* length);
+void prophyle_unmap_file(void* addr, size_t length);
 
 #endif //PROPHYLE_UTILS_H
@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include "sa_interval_search.h"
+
+enum {
+	SA_SEARCH_FINISHED = 0,
+	// k-LCP has to be applied to the interval of the previous k-mer
+	SA_SEARCH_ADJUST,
+	// the interval is extended by the character at pos
+	SA_SEARCH_EXTEND
+};
+
+void sa_search_lane_init(sa_search_lane_t* lane, const ubyte_t* seq, int len, sa_interval_t* intervals)
+{
+	lane->seq = seq;
+	lane->len = len;
+	lane->intervals = intervals;
+	lane->phase = SA_SEARCH_FINISHED;
+	lane->start_pos = 0;
+	lane->pos = 0;
+	lane->last_ambiguous_index = -1;
+	lane->k = 1;
+	lane->l = 0;
+	lane->decreased_k = 1;
+	lane->increased_l = 0;
+	lane->restarts = 0;
+	lane->klcp_continues = 0;
+	lane->extensions = 0;
+	lane->skipped = 0;
+}
+
+static inline void prefetch_occ(const bwt_t* bwt, bwtint_t position)
+{
+	if (position == (bwtint_t)-1) {
+		return;
+	}
+	position -= (position >= bwt->primary);
+	__builtin_prefetch(bwt_occ_intv(bwt, position));
+}
+
+static inline void prefetch_extension(const bwt_t* bwt, const sa_search_lane_t* lane)
+{
+	prefetch_occ(bwt, lane->k - 1);
+	prefetch_occ(bwt, lane->l);
+}
+
+static inline void prefetch_klcp(const klcp_t* klcp, uint64_t position)
+{
+	if (position < klcp->seq_len) {
+		__builtin_prefetch(klcp->klcp->blocks + position / BITS_IN_BLOCK);
+	}
+}
+
+static inline uint64_t sa_search_kmer_hash(uint64_t x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+// Marks the k-mers which are not searched because of sampling (inherited). The first k-mer of every
+// run of unambiguous k-mers is searched, so that there is always a previous k-mer to inherit from.
+static void sa_search_select_kmers(sa_search_lane_t* lane, const sa_search_params_t* params)
+{
+	const int kmer_length = params->kmer_length;
+	const int sampled = params->sampling_distance > 1;
+	const int minimizers = params->minimizer_window > 1;
+	int i;
+	if (!sampled && !minimizers) {
+		for (i = 0; i + kmer_length <= lane->len; ++i) {
+			lane->intervals[i].inherited = 0;
+		}
+		return;
+	}
+	// minimizers are compared by hashes of the last (at most 32) nucleotides of the k-mers,
+	// which are kept in the k fields of the intervals until the search
+	const int code_length = kmer_length < 32 ? kmer_length : 32;
+	const uint64_t mask = code_length == 32 ? ~(uint64_t)0 : ((uint64_t)1 << (2 * code_length)) - 1;
+	const int window = params->minimizer_window;
+	uint64_t code = 0;
+	int valid = 0;
+	int run_start = -1;
+	int since_searched = 0;
+	int minimizer = -1;
+	int pos;
+	for (pos = 0; pos < lane->len; ++pos) {
+		const ubyte_t c = lane->seq[pos];
+		if (c > 3) {
+			valid = 0;
+		} else {
+			code = ((code << 2) | c) & mask;
+			valid++;
+		}
+		i = pos - kmer_length + 1;
+		if (i < 0) {
+			continue;
+		}
+		sa_interval_t* interval = lane->intervals + i;
+		if (valid < kmer_length) {
+			interval->inherited = 0;
+			run_start = -1;
+			continue;
+		}
+		if (run_start == -1) {
+			run_start = i;
+			since_searched = 0;
+			minimizer = -1;
+			interval->inherited = 0;
+		} else if (sampled) {
+			since_searched++;
+			interval->inherited = since_searched < params->sampling_distance;
+			if (!interval->inherited) {
+				since_searched = 0;
+			}
+		} else {
+			interval->inherited = 1;
+		}
+		if (minimizers) {
+			interval->k = sa_search_kmer_hash(code);
+			if (i - run_start + 1 < window) {
+				continue;
+			}
+			// window [i - window + 1, i]
+			if (minimizer < i - window + 1) {
+				int j;
+				minimizer = i - window + 1;
+				for (j = minimizer + 1; j <= i; ++j) {
+					if (lane->intervals[j].k < lane->intervals[minimizer].k) {
+						minimizer = j;
+					}
+				}
+			} else if (interval->k < lane->intervals[minimizer].k) {
+				minimizer = i;
+			}
+			lane->intervals[minimizer].inherited = 0;
+		}
+	}
+}
+
+static inline void sa_search_set_empty(sa_interval_t* interval)
+{
+	interval->k = 1;
+	interval->l = 0;
+	interval->shifted = 0;
+}
+
+// Moves the lane to the next k-mer which needs the BWT; ambiguous and inherited k-mers on the way
+// only get an empty interval. The next k-mer continues from the previous one if its interval is not empty.
+static void sa_search_next_kmer(const bwt_t* bwt, const klcp_t* klcp, int kmer_length, int use_klcp,
+		sa_search_lane_t* lane)
+{
+	while (lane->start_pos + kmer_length <= lane->len) {
+		int end_pos = lane->start_pos + kmer_length - 1;
+		if (lane->seq[end_pos] > 3) {
+			lane->last_ambiguous_index = end_pos;
+		}
+		if (end_pos - lane->last_ambiguous_index < kmer_length || lane->intervals[lane->start_pos].inherited) {
+			sa_search_set_empty(lane->intervals + lane->start_pos);
+			lane->start_pos++;
+			continue;
+		}
+		const sa_interval_t* prev = lane->start_pos > 0 ? lane->intervals + lane->start_pos - 1 : NULL;
+		if (use_klcp && prev && prev->k <= prev->l) {
+			lane->phase = SA_SEARCH_ADJUST;
+			lane->klcp_continues++;
+			lane->pos = end_pos;
+			prefetch_klcp(klcp, prev->k);
+			prefetch_klcp(klcp, prev->l);
+		} else {
+			lane->phase = SA_SEARCH_EXTEND;
+			lane->restarts++;
+			lane->pos = lane->start_pos;
+			lane->k = 0;
+			lane->l = bwt->seq_len;
+			lane->decreased_k = 1;
+			lane->increased_l = 0;
+			prefetch_extension(bwt, lane);
+		}
+		return;
+	}
+	lane->phase = SA_SEARCH_FINISHED;
+}
+
+static void sa_search_adjust(const bwt_t* bwt, const klcp_t* klcp, sa_search_lane_t* lane)
+{
+	const sa_interval_t* prev = lane->intervals + lane->start_pos - 1;
+	lane->k = decrease_sa_position(klcp, prev->k);
+	lane->decreased_k = lane->k;
+	lane->l = increase_sa_position(klcp, prev->l);
+	lane->increased_l = lane->l;
+	lane->phase = SA_SEARCH_EXTEND;
+	prefetch_extension(bwt, lane);
+}
+
+// A k-mer search failed at the nucleotide at fail_pos, the following k-mers overlapping it
+// (probably a sequencing error or a variant) are expected to fail as well.
+static void sa_search_skip(sa_search_lane_t* lane, int kmer_length, int fail_pos)
+{
+	while (lane->start_pos <= fail_pos && lane->start_pos + kmer_length <= lane->len) {
+		int end_pos = lane->start_pos + kmer_length - 1;
+		if (lane->seq[end_pos] > 3) {
+			lane->last_ambiguous_index = end_pos;
+		}
+		sa_search_set_empty(lane->intervals + lane->start_pos);
+		lane->intervals[lane->start_pos].inherited = 0;
+		lane->start_pos++;
+		lane->skipped++;
+	}
+}
+
+// returns 1 if the interval of the current k-mer is final
+static int sa_search_extend(const bwt_t* bwt, int kmer_length, int skip_after_fail, sa_search_lane_t* lane)
+{
+	bwtint_t ok, ol;
+	ubyte_t c = lane->seq[lane->pos];
+	bwt_2occ(bwt, lane->k - 1, lane->l, c, &ok, &ol);
+	lane->k = bwt->L2[c] + ok + 1;
+	lane->l = bwt->L2[c] + ol;
+	lane->pos++;
+	lane->extensions++;
+	if (lane->k <= lane->l && lane->pos < lane->start_pos + kmer_length) {
+		return 0;
+	}
+	sa_interval_t* interval = lane->intervals + lane->start_pos;
+	interval->k = lane->k;
+	interval->l = lane->l;
+	interval->shifted = 0;
+	if (lane->k <= lane->l && lane->start_pos > 0) {
+		const sa_interval_t* prev = interval - 1;
+		interval->shifted = prev->l - prev->k == lane->l - lane->k
+			&& lane->increased_l - lane->decreased_k == lane->l - lane->k;
+	}
+	lane->start_pos++;
+	if (skip_after_fail && lane->k > lane->l) {
+		sa_search_skip(lane, kmer_length, lane->pos - 1);
+	}
+	return 1;
+}
+
+void sa_search_intervals(const bwt_t* bwt, const klcp_t* klcp, const sa_search_params_t* params,
+		sa_search_lane_t* lanes, int lanes_cnt)
+{
+	const int kmer_length = params->kmer_length;
+	const int use_klcp = params->use_klcp;
+	sa_search_lane_t* active[SA_SEARCH_LANES];
+	int active_cnt = 0;
+	int i;
+	for (i = 0; i < lanes_cnt; ++i) {
+		sa_search_lane_t* lane = lanes + i;
+		sa_search_select_kmers(lane, params);
+		int index;
+		for (index = 0; index < kmer_length - 1 && index < lane->len; ++index) {
+			if (lane->seq[index] > 3) {
+				lane->last_ambiguous_index = index;
+			}
+		}
+		sa_search_next_kmer(bwt, klcp, kmer_length, use_klcp, lane);
+		if (lane->phase != SA_SEARCH_FINISHED) {
+			active[active_cnt++] = lane;
+		}
+	}
+	// every lane does one memory-bound step per round, by the time it is visited again
+	// the blocks prefetched for it should have arrived
+	while (active_cnt > 0) {
+		i = 0;
+		while (i < active_cnt) {
+			sa_search_lane_t* lane = active[i];
+			if (lane->phase == SA_SEARCH_ADJUST) {
+				sa_search_adjust(bwt, klcp, lane);
+			} else if (sa_search_extend(bwt, kmer_length, params->skip_after_fail, lane)) {
+				sa_search_next_kmer(bwt, klcp, kmer_length, use_klcp, lane);
+				if (lane->phase == SA_SEARCH_FINISHED) {
+					active[i] = active[--active_cnt];
+					continue;
+				}
+			} else {
+				prefetch_extension(bwt, lane);
+			}
+			++i;
+		}
+	}
+}
@@ -0,0 +1,68 @@
+/*
+	SA intervals of all k-mers of several reads computed in lockstep, so that the random
+	accesses into the BWT of the different reads overlap instead of being waited for one by one.
+	Author: Kamil Salikhov <salikhov.kamil@gmail.com>
+	Licence: MIT
+*/
+
+#ifndef SA_INTERVAL_SEARCH_H
+#define SA_INTERVAL_SEARCH_H
+
+#include <stdint.h>
+#include "bwt.h"
+#include "klcp.h"
+
+// number of reads searched in lockstep by one thread
+#define SA_SEARCH_LANES 16
+
+typedef struct {
+	uint64_t k;
+	uint64_t l;
+	// the interval was obtained from the previous one using k-LCP and has the same size,
+	// so its positions are the positions of the previous k-mer shifted by one
+	int shifted;
+	// the k-mer was not searched because of sampling and gets the nodes of the previous k-mer
+	int inherited;
+} sa_interval_t;
+
+typedef struct {
+	int kmer_length;
+	int use_klcp;
+	// k-mers overlapping the nucleotide at which a search failed get an empty interval without a search
+	int skip_after_fail;
+	// only every sampling_distance-th k-mer is searched (1 = all of them)
+	int sampling_distance;
+	// if positive, only the k-mers with the minimal hash in a window of minimizer_window k-mers are searched
+	int minimizer_window;
+} sa_search_params_t;
+
+typedef struct {
+	const ubyte_t* seq;
+	int len;
+	// one interval per k-mer of seq (k > l for k-mers that do not occur or are ambiguous)
+	sa_interval_t* intervals;
+	// state of the search
+	int phase;
+	int start_pos;
+	int pos;
+	int last_ambiguous_index;
+	uint64_t k;
+	uint64_t l;
+	uint64_t decreased_k;
+	uint64_t increased_l;
+	// counters of the search: k-mers searched from scratch in the BWT, k-mers continued from
+	// the previous interval using k-LCP, BWT extension steps and k-mers skipped after a failure
+	int64_t restarts;
+	int64_t klcp_continues;
+	int64_t extensions;
+	int64_t skipped;
+} sa_search_lane_t;
+
+// sets up a lane for the read; intervals must have room for len - kmer_length + 1 entries
+void sa_search_lane_init(sa_search_lane_t* lane, const ubyte_t* seq, int len, sa_interval_t* intervals);
+// fills the intervals of at most SA_SEARCH_LANES lanes; k-LCP (if use_klcp) is used to move
+// from one k-mer to the next; the first k-mer after an ambiguous one is always searched
+void sa_search_intervals(const bwt_t* bwt, const klcp_t* klcp, const sa_search_params_t* params,
+		sa_search_lane_t* lanes, int lanes_cnt);
+
+#endif //SA_INTERVAL_SEARCH_H
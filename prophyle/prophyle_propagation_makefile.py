@@ -19,6 +19,12 @@ Propagation parameters (in the Makefile, can be changed through CL):
     * REASM: re-assemble sequences in leaves
     * NONDEL: non-deletative propagation, implies REASM
     * MASKREP: mask repeats in leaves
+    * SORTED: keep k-mer sets of the assembler in sorted vectors (less memory)
+    * ASMMEM: keep k-mer sets of the assembler on disk, using about ASMMEM MB of memory per job
+      for loading and merging them; every assembled set is still loaded to memory, which ASMMEM
+      does not bound (about 16 B per k-mer of the largest set, 24 B for K > 32)
+    * BINKMERS: pass k-mer sets of internal nodes to their parents as binary k-mer files
+      instead of assembled FASTA; only the final sequences are assembled
 """
 
 import argparse
@@ -118,7 +124,13 @@ def merge_fasta_files(input_files_fn, output_file_fn, is_leaf, makefile_fo, nhx_
 
 
 def assembly(
-    input_files_fn, output_files_fn, intersection_file_fn, makefile_fo, counts_fn="/dev/null", nhx_file_fn=None
+    input_files_fn,
+    output_files_fn,
+    intersection_file_fn,
+    makefile_fo,
+    counts_fn="/dev/null",
+    nhx_file_fn=None,
+    binary_intersection=False
 ):
     """Print Makefile lines for running prophyle_assembler.
 
@@ -129,6 +141,7 @@ def assembly(
         makefile_fo (file): Output file.
         counts_fn (str): File with count statistics.
         nhx_file_fn (str): File with the tree (for including in rule dependencies).
+        binary_intersection (bool): Intersection can be saved as binary k-mers (with BINKMERS).
     """
 
     assert len(input_files_fn) == len(output_files_fn)
@@ -145,7 +158,7 @@ def assembly(
             ifdef NONPROP
                CMD_ASM_{nid} = @touch {x} {o}
             else
-               CMD_ASM_{nid} = $(PRG_ASM) -S -k $(K) -x {x} -i {ii} $(CMD_ASM_OUT_{nid}) -s {c}
+               CMD_ASM_{nid} = $(PRG_ASM) -S $(ASM_SETS) {xfmt}-k $(K) -x {x} -i {ii} $(CMD_ASM_OUT_{nid}) -s {c}
             endif
 
             {xcompl}: {icompl} {nhx}
@@ -162,6 +175,7 @@ def assembly(
             xcompl=_compl(intersection_file_fn),
             c=counts_fn,
             nid=intersection_file_fn,
+            xfmt="$(ASM_XFMT) " if binary_intersection else "",
             nhx=nhx_file_fn if nhx_file_fn is not None else "",
         )
     )
@@ -263,7 +277,15 @@ class TreeIndex:
             output_files = [self.reduced_fasta_fn(x) for x in children]
             intersection_file = self.nonreduced_fasta_fn(node)
             count_file = self.count_fn(node)
-            assembly(input_files, output_files, intersection_file, counts_fn=count_file, makefile_fo=makefile_fo)
+            # the full set of the root is the root's final sequence
+            assembly(
+                input_files,
+                output_files,
+                intersection_file,
+                counts_fn=count_file,
+                makefile_fo=makefile_fo,
+                binary_intersection=not node.is_root(),
+            )
 
     def build_index(self, k):
         """Print Makefile for the tree.
@@ -305,6 +327,25 @@ class TreeIndex:
 
                     $(info | Assembler:              $(PRG_ASM))
 
+                    ifdef ASMMEM
+                       $(info | Assembler k-mer sets:   On disk, $(ASMMEM) MB of memory for merging)
+                       ASM_SETS=-M $(ASMMEM)
+                    else ifdef SORTED
+                       $(info | Assembler k-mer sets:   Sorted vectors)
+                       ASM_SETS=-V
+                    else
+                       $(info | Assembler k-mer sets:   Hash tables)
+                       ASM_SETS=
+                    endif
+
+                    ifdef BINKMERS
+                       $(info | Intermediate sets:      Binary k-mers)
+                       ASM_XFMT=-b
+                    else
+                       $(info | Intermediate sets:      Assembled FASTA)
+                       ASM_XFMT=
+                    endif
+
                     $(info | DustMasker:             $(PRG_DUST))
 
                     ifdef MASKREP
@@ -330,7 +371,7 @@ class TreeIndex:
 
                     ifdef REASM
                        $(info | Re-assembling leaves:   On)
-                       CMD_REASM= | $(PRG_ASM) -k $(K) -S -i - -o -
+                       CMD_REASM= | $(PRG_ASM) $(ASM_SETS) -k $(K) -S -i - -o -
                     else
                        $(info | Re-assembling leaves:   Off)
                        CMD_REASM=
@@ -0,0 +1,212 @@
+#! /usr/bin/env python3
+"""Query shards of a ProPhyle index in parallel and merge their outputs.
+
+Shards created by prophyle_split_index.py are queried by prophyle_index query
+at the same time, locally or on remote hosts (via ssh, with the shards and
+reads on a shared file system), and their outputs are merged on the fly by
+prophyle_index merge. The merged kraken-like lines are the same as for the
+whole index and can be passed to prophyle_assignment.
+
+Author: Karel Brinda <kbrinda@hsph.harvard.edu>
+
+Licence: MIT
+
+Example:
+
+    prophyle_sharded_query.py -k 31 -u ~/prophyle/index.shards reads.fq | prophyle_assignment.py ~/prophyle/index/tree.nw 31 -
+"""
+
+import argparse
+import os
+import shlex
+import subprocess
+import sys
+
+sys.path.append(os.path.dirname(__file__))
+import prophylelib as pro
+
+C_D = os.path.dirname(os.path.realpath(__file__))
+IND = os.path.join(C_D, "prophyle_index", "prophyle_index")
+
+
+def load_shards(shards_dir):
+    """Load the list of shards.
+
+    Args:
+        shards_dir (str): Directory with shards (prophyle_split_index.py).
+
+    Returns:
+        list of str: FASTA files of the shards.
+    """
+    shards_fn = os.path.join(shards_dir, "shards.tsv")
+    pro.test_files(shards_fn, os.path.join(shards_dir, "nodes.txt"))
+    shard_fas = []
+    with open(shards_fn) as f:
+        for line in f:
+            parts = line.strip().split("\t")
+            if parts[0] == "shard":
+                continue
+            shard_fas.append(os.path.join(shards_dir, parts[1]))
+    return shard_fas
+
+
+def sharded_query(shards_dir, reads_fns, k, klcp, print_seqs, stride, window, threads, hosts, ind, output_fo):
+    """Query all shards in parallel and merge their outputs.
+
+    Args:
+        shards_dir (str): Directory with shards.
+        reads_fns (list of str): Read files (one or two for paired-end reads).
+        k (int): K-mer length.
+        klcp (bool): Use k-LCP.
+        print_seqs (bool): Print sequences and base qualities.
+        stride (int): Search only every stride-th k-mer.
+        window (int): Search only minimizers of windows (0 = all k-mers).
+        threads (int): Number of threads of every query.
+        hosts (list of str): Hosts of the shards (round robin), local queries if empty.
+        ind (str): prophyle_index binary.
+        output_fo (file): Output file object.
+    """
+    shard_fas = load_shards(shards_dir)
+    reads_fns = [os.path.abspath(x) for x in reads_fns]
+    pro.test_files(*reads_fns)
+
+    query_args = [ind, "query", "-k", k, "-t", threads]
+    if klcp:
+        query_args += ["-u"]
+    if print_seqs:
+        query_args += ["-b"]
+    if stride > 1:
+        query_args += ["-d", stride]
+    if window > 0:
+        query_args += ["-w", window]
+
+    queries = []
+    read_fds = []
+    for i, shard_fa in enumerate(shard_fas):
+        command = [str(x) for x in query_args + [os.path.abspath(shard_fa)] + reads_fns]
+        if len(hosts) > 0:
+            command = ["ssh", hosts[i % len(hosts)], " ".join(shlex.quote(x) for x in command)]
+        pro.message("Querying shard {}:".format(i + 1), " ".join(command))
+        read_fd, write_fd = os.pipe()
+        queries.append(subprocess.Popen(command, stdout=write_fd))
+        os.close(write_fd)
+        read_fds.append(read_fd)
+
+    merge_command = [ind, "merge", os.path.join(shards_dir, "nodes.txt")]
+    merge_command += ["/dev/fd/{}".format(fd) for fd in read_fds]
+    merge = subprocess.Popen(merge_command, stdout=output_fo, pass_fds=read_fds)
+    for fd in read_fds:
+        os.close(fd)
+
+    error = False
+    for i, query in enumerate(queries):
+        if query.wait() != 0:
+            pro.message("Error: query of shard {} failed".format(i + 1))
+            error = True
+    if merge.wait() != 0:
+        pro.message("Error: merging of the outputs of the shards failed")
+        error = True
+    if error:
+        sys.exit(1)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Query shards of a ProPhyle index in parallel and merge their outputs.')
+
+    parser.add_argument(
+        'shards_dir',
+        metavar='<shards.dir>',
+        type=str,
+        help='directory with shards (prophyle_split_index.py)',
+    )
+
+    parser.add_argument(
+        'reads_fns',
+        metavar='<reads.fq>',
+        type=str,
+        nargs='+',
+        help='reads (two files for paired-end reads)',
+    )
+
+    parser.add_argument(
+        '-k',
+        type=int,
+        metavar='int',
+        dest='k',
+        required=True,
+        help='k-mer length',
+    )
+
+    parser.add_argument(
+        '-u',
+        action='store_true',
+        dest='klcp',
+        help='use k-LCP for querying',
+    )
+
+    parser.add_argument(
+        '-b',
+        action='store_true',
+        dest='print_seqs',
+        help='print sequences and base qualities',
+    )
+
+    parser.add_argument(
+        '-d',
+        type=int,
+        metavar='int',
+        dest='stride',
+        default=1,
+        help='search only every int-th k-mer [1]',
+    )
+
+    parser.add_argument(
+        '-w',
+        type=int,
+        metavar='int',
+        dest='window',
+        default=0,
+        help='search only minimizers of windows of int k-mers',
+    )
+
+    parser.add_argument(
+        '-t',
+        type=int,
+        metavar='int',
+        dest='threads',
+        default=1,
+        help='number of threads of every shard query [1]',
+    )
+
+    parser.add_argument(
+        '-H',
+        type=str,
+        metavar='str',
+        dest='hosts',
+        default='',
+        help='comma-separated hosts for the shards (via ssh, round robin) [local]',
+    )
+
+    parser.add_argument(
+        '--ind',
+        type=str,
+        metavar='str',
+        dest='ind',
+        default=IND,
+        help='prophyle_index binary [bundled]',
+    )
+
+    args = parser.parse_args()
+
+    assert len(args.reads_fns) <= 2, "At most two read files (paired-end reads) can be given"
+
+    hosts = [x for x in args.hosts.split(",") if x != ""]
+
+    sharded_query(
+        args.shards_dir, args.reads_fns, args.k, args.klcp, args.print_seqs, args.stride, args.window, args.threads,
+        hosts, args.ind, sys.stdout
+    )
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,293 @@
+#! /usr/bin/env python3
+"""Split a ProPhyle index into shards by subtrees of its tree.
+
+Nodes are taken in the pre-order of the tree, so that subtrees are kept
+together, and cut into shards with similar lengths of sequences. Every shard
+gets an index.fa with the sequences of its nodes (in the order of the original
+index.fa) and, unless -n is used, its BWT, SA and k-LCP. Shards are queried
+and their outputs merged by prophyle_sharded_query.py; the result is the same
+as for the whole index.
+
+Output files:
+    * <shards_dir>/shard.<i>/index.fa: sequences of the i-th shard
+    * <shards_dir>/nodes.txt: nodes in the order of the whole index
+    * <shards_dir>/shards.tsv: shard, index.fa, number of nodes, length
+
+Author: Karel Brinda <kbrinda@hsph.harvard.edu>
+
+Licence: MIT
+
+Example:
+
+    prophyle_split_index.py -s 4 -k 31 ~/prophyle/index ~/prophyle/index.shards
+"""
+
+import argparse
+import concurrent.futures
+import os
+import sys
+
+sys.path.append(os.path.dirname(__file__))
+import prophylelib as pro
+
+C_D = os.path.dirname(os.path.realpath(__file__))
+BWA = os.path.join(C_D, "prophyle_index", "bwa", "bwa")
+IND = os.path.join(C_D, "prophyle_index", "prophyle_index")
+
+
+def node_of_contig(header):
+    """Get the node of a contig of index.fa.
+
+    Args:
+        header (str): FASTA header (`>node@contig`).
+
+    Returns:
+        str: Node name.
+    """
+    return header[1:].strip().partition("@")[0]
+
+
+def fasta_nodes(index_fa):
+    """Get nodes of index.fa and lengths of their sequences.
+
+    Args:
+        index_fa (str): Index FASTA file.
+
+    Returns:
+        (list of str, dict): Nodes in the order of index.fa, lengths of their sequences.
+    """
+    nodes = []
+    lengths = {}
+    node = None
+    with open(index_fa) as f:
+        for line in f:
+            if line[0] == ">":
+                node = node_of_contig(line)
+                if node not in lengths:
+                    nodes.append(node)
+                    lengths[node] = 0
+                elif node != nodes[-1]:
+                    pro.message("Error: contigs of node '{}' are not consecutive in '{}'".format(node, index_fa))
+                    sys.exit(1)
+            else:
+                lengths[node] += len(line.strip())
+    return nodes, lengths
+
+
+def assign_shards(tree, nodes, lengths, shards_count):
+    """Split nodes into shards by the pre-order of the tree.
+
+    Args:
+        tree (ete3.Tree): Tree of the index.
+        nodes (list of str): Nodes of the index.
+        lengths (dict): Lengths of sequences of the nodes.
+        shards_count (int): Number of shards.
+
+    Returns:
+        dict: Node => shard.
+    """
+    preorder = [n.name for n in tree.traverse("preorder") if n.name in lengths]
+    missing = set(nodes) - set(preorder)
+    if len(missing) > 0:
+        pro.message("Error: nodes of the index are not in the tree: {}".format(", ".join(sorted(missing))))
+        sys.exit(1)
+    if len(preorder) < shards_count:
+        pro.message("Error: only {} nodes with sequences, less than {} shards".format(len(preorder), shards_count))
+        sys.exit(1)
+
+    total_length = max(sum(lengths.values()), 1)
+    shards = {}
+    cumulated_length = 0
+    shard = 0
+    for i, node in enumerate(preorder):
+        # a node goes to the shard of the middle of its sequences; shards are contiguous and never empty
+        middle = cumulated_length + lengths[node] / 2.0
+        lower = max(shard, shards_count - (len(preorder) - i))
+        upper = shard + 1 if i > 0 else 0
+        shard = min(max(int(middle * shards_count / total_length), lower), upper)
+        shards[node] = shard
+        cumulated_length += lengths[node]
+    return shards
+
+
+def split_fasta(index_fa, shard_fas, shards):
+    """Split index.fa into FASTA files of shards.
+
+    Args:
+        index_fa (str): Index FASTA file.
+        shard_fas (list of str): FASTA files of shards.
+        shards (dict): Node => shard.
+    """
+    fos = [open(fn, "w") for fn in shard_fas]
+    fo = None
+    with open(index_fa) as f:
+        for line in f:
+            if line[0] == ">":
+                fo = fos[shards[node_of_contig(line)]]
+            fo.write(line)
+    for fo in fos:
+        fo.close()
+
+
+def build_shard(shard_fa, k, klcp, bwa, ind):
+    """Construct BWT, SA and k-LCP of a shard.
+
+    Args:
+        shard_fa (str): FASTA file of the shard.
+        k (int): K-mer length.
+        klcp (bool): Construct k-LCP.
+        bwa (str): BWA binary.
+        ind (str): prophyle_index binary.
+    """
+    pro.run_safe([bwa, "index", shard_fa], err_msg="BWT of '{}' could not be constructed.".format(shard_fa))
+    if klcp:
+        pro.run_safe([ind, "build", "-k", k, shard_fa], err_msg="k-LCP of '{}' could not be constructed.".format(shard_fa))
+
+
+def split_index(index_dir, shards_dir, shards_count, k, build, klcp, threads, bwa, ind):
+    """Split a ProPhyle index into shards.
+
+    Args:
+        index_dir (str): Index directory.
+        shards_dir (str): Output directory.
+        shards_count (int): Number of shards.
+        k (int): K-mer length.
+        build (bool): Construct BWT and SA of the shards.
+        klcp (bool): Construct k-LCP of the shards.
+        threads (int): Number of shards constructed in parallel.
+        bwa (str): BWA binary.
+        ind (str): prophyle_index binary.
+    """
+    index_fa = os.path.join(index_dir, "index.fa")
+    tree_fn = os.path.join(index_dir, "tree.nw")
+    pro.test_files(index_fa, tree_fn)
+
+    nodes, lengths = fasta_nodes(index_fa)
+    tree = pro.load_nhx_tree(tree_fn, validate=False)
+    shards = assign_shards(tree, nodes, lengths, shards_count)
+
+    pro.makedirs(shards_dir)
+    shard_fas = []
+    for i in range(shards_count):
+        shard_dir = os.path.join(shards_dir, "shard.{}".format(i + 1))
+        pro.makedirs(shard_dir)
+        shard_fas.append(os.path.join(shard_dir, "index.fa"))
+    split_fasta(index_fa, shard_fas, shards)
+
+    with open(os.path.join(shards_dir, "nodes.txt"), "w") as fo:
+        for node in nodes:
+            print(node, file=fo)
+
+    with open(os.path.join(shards_dir, "shards.tsv"), "w") as fo:
+        print("shard", "index_fa", "nodes", "length", sep="\t", file=fo)
+        for i, shard_fa in enumerate(shard_fas):
+            shard_nodes = [node for node in nodes if shards[node] == i]
+            print(
+                i + 1,
+                os.path.relpath(shard_fa, shards_dir),
+                len(shard_nodes),
+                sum(lengths[node] for node in shard_nodes),
+                sep="\t",
+                file=fo
+            )
+            pro.message("Shard {}: {} nodes, {} bp".format(i + 1, len(shard_nodes), sum(lengths[x] for x in shard_nodes)))
+
+    if build:
+        with concurrent.futures.ThreadPoolExecutor(max_workers=threads) as executor:
+            futures = [executor.submit(build_shard, shard_fa, k, klcp, bwa, ind) for shard_fa in shard_fas]
+            for future in futures:
+                future.result()
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Split a ProPhyle index into shards by subtrees of its tree.')
+
+    parser.add_argument(
+        'index_dir',
+        metavar='<index.dir>',
+        type=str,
+        help='index directory',
+    )
+
+    parser.add_argument(
+        'shards_dir',
+        metavar='<shards.dir>',
+        type=str,
+        help='output directory',
+    )
+
+    parser.add_argument(
+        '-s',
+        type=int,
+        metavar='int',
+        dest='shards_count',
+        default=2,
+        help='number of shards [2]',
+    )
+
+    parser.add_argument(
+        '-k',
+        type=int,
+        metavar='int',
+        dest='k',
+        default=None,
+        help='k-mer length [detect from the index]',
+    )
+
+    parser.add_argument(
+        '-n',
+        action='store_false',
+        dest='build',
+        help='only split index.fa, do not construct BWT, SA and k-LCP of the shards',
+    )
+
+    parser.add_argument(
+        '-K',
+        action='store_false',
+        dest='klcp',
+        help='skip k-LCP construction',
+    )
+
+    parser.add_argument(
+        '-t',
+        type=int,
+        metavar='int',
+        dest='threads',
+        default=1,
+        help='number of shards constructed in parallel [1]',
+    )
+
+    parser.add_argument(
+        '--bwa',
+        type=str,
+        metavar='str',
+        dest='bwa',
+        default=BWA,
+        help='BWA binary [bundled]',
+    )
+
+    parser.add_argument(
+        '--ind',
+        type=str,
+        metavar='str',
+        dest='ind',
+        default=IND,
+        help='prophyle_index binary [bundled]',
+    )
+
+    args = parser.parse_args()
+
+    assert args.shards_count > 0, "The number of shards must be positive"
+
+    k = args.k
+    if k is None and args.build and args.klcp:
+        k = pro.detect_k_from_index(args.index_dir)
+        pro.message("Automatic detection of k-mer length: k={}".format(k))
+
+    split_index(
+        args.index_dir, args.shards_dir, args.shards_count, k, args.build, args.klcp, args.threads, args.bwa, args.ind
+    )
+
+
+if __name__ == "__main__":
+    main()
@@ -18,6 +18,7 @@ import sys
 import tempfile
 import time
 import gzip
+import struct
 
 ###########
 # LOGGING #
@@ -44,6 +45,46 @@ def open_gzip(fn):
     return open(fn, 'rt')
 
 
+BINARY_ASSIGNMENT_MAGIC = b'PHYA'
+
+
+def read_binary_assignments(fo):
+    """Read assignments in the binary format of prophyle_assignment (-f bin).
+
+    The header is a table of node names, then every record consists of three
+    little-endian uint32: the node id + 1 (0 if unassigned, the top bit marks
+    further ties of the previous read), h1 and c1.
+
+    Args:
+        fo (file): Binary file object (uncompressed).
+
+    Yields:
+        (read_index, node_name, h1, c1); node_name is None for unassigned reads.
+    """
+    magic = fo.read(len(BINARY_ASSIGNMENT_MAGIC))
+    assert magic == BINARY_ASSIGNMENT_MAGIC, "Not a binary assignment file"
+    version, nodes_count = struct.unpack('<II', fo.read(8))
+    assert version == 1, "Unsupported version {} of binary assignments".format(version)
+    uint32 = struct.Struct('<I')
+    names = []
+    for _ in range(nodes_count):
+        length, = uint32.unpack(fo.read(4))
+        names.append(fo.read(length).decode())
+    record = struct.Struct('<III')
+    read_index = -1
+    while True:
+        chunk = fo.read(record.size * 65536)
+        if len(chunk) % record.size != 0:
+            raise ValueError("Truncated binary assignment file")
+        if not chunk:
+            break
+        for node, h1, c1 in record.iter_unpack(chunk):
+            if not node & 0x80000000:
+                read_index += 1
+            node &= 0x7fffffff
+            yield read_index, names[node - 1] if node else None, h1, c1
+
+
 def open_log(fn):
     """Open a log file.
 
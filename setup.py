@@ -107,7 +107,9 @@ setuptools.setup(
             'prophyle_propagation_makefile.py = prophyle.prophyle_propagation_makefile:main',
             'prophyle_propagation_postprocessing.py = prophyle.prophyle_propagation_postprocessing:main',
             'prophyle_propagation_preprocessing.py = prophyle.prophyle_propagation_preprocessing:main',
+            'prophyle_sharded_query.py = prophyle.prophyle_sharded_query:main',
             'prophyle_split_allseq.py = prophyle.prophyle_split_allseq:main',
+            'prophyle_split_index.py = prophyle.prophyle_split_index:main',
         ],
     },
     #
@@ -0,0 +1,167 @@
+#! /usr/bin/env python3
+"""Check which k-mers were searched by a sampled query (-s, -d, -w).
+
+The blocks of the sampled output and of the output without sampling are
+expanded to node sets of individual k-mers. Searched k-mers must have the
+node sets of the full output, inherited k-mers those of the previous k-mer,
+and k-mers skipped after a failed search (-s) must be empty. The searched
+and skipped k-mers are determined independently of prophyle_index: from the
+read and, for -s, from the longest prefix of the failed k-mer present in the
+index.
+
+The k-mers are processed in the order of the read as stored by BWA
+(reversed), in which the BWT is searched; blocks are listed in the order of
+the read.
+"""
+
+import argparse
+import bisect
+import sys
+
+NUCLS = "ACGT"
+COMP = str.maketrans("ACGT", "TGCA")
+
+
+def load_index(fa_fn, length):
+    """Sorted substrings of the index (both strands) of the given length, for prefix queries."""
+    seqs = []
+    with open(fa_fn) as f:
+        for line in f:
+            if line[0] != ">":
+                seqs.append(line.strip().upper())
+    text = "".join(seqs)
+    text += text.translate(COMP)[::-1]
+    return sorted(text[i:i + length] for i in range(len(text)))
+
+
+def occurs(index, s):
+    i = bisect.bisect_left(index, s)
+    return i < len(index) and index[i].startswith(s)
+
+
+def expand_blocks(blocks):
+    nodes = []
+    for block in blocks.split(" "):
+        node_set, _, count = block.rpartition(":")
+        nodes += [node_set] * int(count)
+    return nodes
+
+
+def kmer_hash(x):
+    mask = (1 << 64) - 1
+    x ^= x >> 33
+    x = (x * 0xff51afd7ed558ccd) & mask
+    x ^= x >> 33
+    x = (x * 0xc4ceb9fe1a85ec53) & mask
+    x ^= x >> 33
+    return x
+
+
+def searched_kmers(seq, k, stride, window):
+    """Searched k-mers: every stride-th k-mer or minimizers of windows, from the first k-mer of every
+    run of unambiguous k-mers."""
+    kmers_cnt = max(len(seq) - k + 1, 0)
+    unambiguous = [all(c in NUCLS for c in seq[i:i + k]) for i in range(kmers_cnt)]
+    searched = [False] * kmers_cnt
+    i = 0
+    while i < kmers_cnt:
+        if not unambiguous[i]:
+            i += 1
+            continue
+        run_start = i
+        while i < kmers_cnt and unambiguous[i]:
+            i += 1
+        run = range(run_start, i)
+        searched[run_start] = True
+        if window > 1:
+            code_length = min(k, 32)
+            hashes = {}
+            for j in run:
+                code = 0
+                for c in seq[j + k - code_length:j + k]:
+                    code = (code << 2) | NUCLS.index(c)
+                hashes[j] = kmer_hash(code)
+            for start in range(run_start, i - window + 1):
+                # the leftmost minimum of the window
+                minimizer = min(range(start, start + window), key=lambda j: (hashes[j], j))
+                searched[minimizer] = True
+        else:
+            for j in run:
+                if (j - run_start) % stride == 0:
+                    searched[j] = True
+    return unambiguous, searched
+
+
+def expected_nodes(seq, full, k, stride, window, skip, index):
+    unambiguous, searched = searched_kmers(seq, k, stride, window)
+    expected = []
+    skip_until = -1
+    for i in range(len(unambiguous)):
+        if not unambiguous[i]:
+            assert full[i] == "A", "k-mer {} is not ambiguous in the full output".format(i)
+            expected.append("A")
+        elif i <= skip_until:
+            expected.append("0")
+        elif searched[i]:
+            expected.append(full[i])
+            if skip and full[i] == "0":
+                # the search fails at the first nucleotide which does not extend the k-mer prefix;
+                # a k-mer found only across borders of contigs has no nodes, but did not fail
+                searched_length = 1
+                while searched_length < k and occurs(index, seq[i:i + searched_length + 1][::-1]):
+                    searched_length += 1
+                if searched_length < k:
+                    skip_until = i + searched_length
+        else:
+            expected.append(expected[-1])
+    return expected
+
+
+def read_sequences(fq_fn):
+    with open(fq_fn) as f:
+        for i, line in enumerate(f):
+            if i % 4 == 1:
+                yield line.strip().upper()
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Check k-mers searched by a sampled query.')
+    parser.add_argument('index_fa', metavar='<index.fa>')
+    parser.add_argument('reads_fq', metavar='<reads.fq>')
+    parser.add_argument('full_fn', metavar='<full.txt>', help='output without sampling')
+    parser.add_argument('sampled_fn', metavar='<sampled.txt>', help='output with sampling')
+    parser.add_argument('-k', type=int, required=True, dest='k')
+    parser.add_argument('-s', action='store_true', dest='skip')
+    parser.add_argument('-d', type=int, default=1, dest='stride')
+    parser.add_argument('-w', type=int, default=0, dest='window')
+    args = parser.parse_args()
+
+    index = load_index(args.index_fa, args.k) if args.skip else None
+
+    errors = 0
+    reads = 0
+    with open(args.full_fn) as full_f, open(args.sampled_fn) as sampled_f:
+        for seq, full_line, sampled_line in zip(read_sequences(args.reads_fq), full_f, sampled_f):
+            full_parts = full_line.rstrip("\n").split("\t")
+            sampled_parts = sampled_line.rstrip("\n").split("\t")
+            assert full_parts[1] == sampled_parts[1], "different reads"
+            # BWA stores reads reversed
+            full = expand_blocks(full_parts[4])[::-1]
+            sampled = expand_blocks(sampled_parts[4])[::-1]
+            expected = expected_nodes(seq[::-1], full, args.k, args.stride, args.window, args.skip, index)
+            if sampled != expected:
+                errors += 1
+                diffs = [i for i in range(len(expected)) if i >= len(sampled) or sampled[i] != expected[i]]
+                print(
+                    "{}: k-mer {} has '{}', expected '{}'".format(
+                        sampled_parts[1], diffs[0], sampled[diffs[0]] if diffs[0] < len(sampled) else "", expected[diffs[0]]
+                    ), file=sys.stderr
+                )
+            reads += 1
+
+    print("{} reads checked, {} wrong".format(reads, errors), file=sys.stderr)
+    sys.exit(1 if errors > 0 else 0)
+
+
+if __name__ == "__main__":
+    main()
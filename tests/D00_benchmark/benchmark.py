@@ -0,0 +1,298 @@
+#! /usr/bin/env python3
+"""Benchmark k-mer matching (prophyle_index query) and assignment (prophyle_assignment).
+
+For every read file, the query is run without and with k-LCP (-u) for every
+number of threads, and its output is then assigned. Every run is repeated and
+the fastest repetition is reported, together with its peak RSS and the stages
+from the log of prophyle_index (-l).
+
+Results are saved to a JSON file as a list of records, one per run:
+    * reads, stage (query / assignment), klcp, threads
+    * wall_s, cpu_s, peak_rss_kb
+    * reads_count, kmers_count, reads_per_s, kmers_per_s
+    * stages (s): loading stages and matching time (query only)
+    * matching_stages (s): thread times of parts of the matching (query only)
+    * log: all values from the log of prophyle_index (query only)
+
+Author: Karel Brinda <kbrinda@hsph.harvard.edu>
+
+Licence: MIT
+
+Example:
+
+    benchmark.py -k 12 -t 1,2,4 -o benchmark.json index.fa tree.nw reads1.fq reads2.fq
+"""
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+import time
+
+SCRIPT_DIR = os.path.dirname(os.path.abspath(__file__))
+PROP_DIR = os.path.join(SCRIPT_DIR, "..", "..", "prophyle")
+IND = os.path.join(PROP_DIR, "prophyle_index", "prophyle_index")
+ASSIGN = os.path.join(PROP_DIR, "prophyle_assignment", "prophyle_assignment")
+
+LOADING_STAGES = ["bwt_loading", "sa_loading", "bns_loading", "klcp_loading"]
+# thread times of parts of the matching (summed over threads)
+MATCHING_STAGES = ["sa_search_time", "sa2pos_time", "pos2rid_time", "streaks_time"]
+
+
+def run_measured(command, output_fn):
+    """Run a command and measure its resources.
+
+    Args:
+        command (list of str): Command.
+        output_fn (str): File for the standard output.
+
+    Returns:
+        (float, float, int): Wall time, CPU time (user + system), peak RSS (KB).
+    """
+    with open(output_fn, "w") as fo:
+        start = time.time()
+        proc = subprocess.Popen(command, stdout=fo, stderr=subprocess.DEVNULL)
+        _, status, rusage = os.wait4(proc.pid, 0)
+        wall = time.time() - start
+    proc.returncode = os.WEXITSTATUS(status) if os.WIFEXITED(status) else 1
+    if proc.returncode != 0:
+        print("Error: command '{}' failed".format(" ".join(command)), file=sys.stderr)
+        sys.exit(1)
+    # ru_maxrss is in KB on Linux
+    return wall, rusage.ru_utime + rusage.ru_stime, rusage.ru_maxrss
+
+
+def load_query_log(log_fn):
+    """Load the log of prophyle_index query (-l).
+
+    Args:
+        log_fn (str): Log file name.
+
+    Returns:
+        dict: Values of the log, times in seconds.
+    """
+    log = {}
+    with open(log_fn) as f:
+        for line in f:
+            parts = line.strip().split("\t")
+            if len(parts) != 2:
+                continue
+            name, value = parts
+            if value.endswith("s"):
+                log[name] = float(value[:-1])
+            else:
+                log[name] = int(value)
+    return log
+
+
+def best_run(command, output_fn, repeats, log_fn=None):
+    """Run a command several times and keep the fastest run.
+
+    Args:
+        command (list of str): Command.
+        output_fn (str): File for the standard output.
+        repeats (int): Number of repetitions.
+        log_fn (str): Log of prophyle_index, loaded for the fastest run.
+
+    Returns:
+        dict: Measurements of the fastest run.
+    """
+    best = None
+    for _ in range(repeats):
+        wall, cpu, rss = run_measured(command, output_fn)
+        if best is None or wall < best["wall_s"]:
+            best = {"wall_s": wall, "cpu_s": cpu, "peak_rss_kb": rss}
+            if log_fn is not None:
+                best["log"] = load_query_log(log_fn)
+    return best
+
+
+def rate(count, seconds):
+    """Count per second, None for an unmeasurable time."""
+    return round(count / seconds, 1) if seconds > 0 else None
+
+
+def benchmark(ind, assign, index_fa, tree_fn, k, reads_fns, threads_list, repeats, out_dir):
+    """Run the benchmark.
+
+    Args:
+        ind (str): prophyle_index binary.
+        assign (str): prophyle_assignment binary.
+        index_fa (str): Index FASTA file (with BWT, SA and k-LCP).
+        tree_fn (str): Tree of the index.
+        k (int): K-mer length.
+        reads_fns (list of str): Read files.
+        threads_list (list of int): Numbers of threads.
+        repeats (int): Number of repetitions of every run.
+        out_dir (str): Directory for outputs of the runs.
+
+    Returns:
+        list of dict: Records.
+    """
+    records = []
+    for reads_fn in reads_fns:
+        reads_name = os.path.basename(reads_fn)
+        for klcp in [False, True]:
+            for threads in threads_list:
+                prefix = os.path.join(out_dir, "_{}.{}.{}".format(reads_name, "u" if klcp else "r", threads))
+                query_fn = prefix + ".query.txt"
+                log_fn = prefix + ".log"
+                command = [ind, "query", "-k", str(k), "-t", str(threads), "-l", log_fn]
+                if klcp:
+                    command += ["-u"]
+                command += [index_fa, reads_fn]
+                run = best_run(command, query_fn, repeats, log_fn=log_fn)
+                log = run["log"]
+                stages = {x: log[x] for x in LOADING_STAGES if x in log}
+                stages["matching"] = log["matching_time"]
+                matching_stages = {x[:-len("_time")]: log[x] for x in MATCHING_STAGES if x in log}
+                records.append(
+                    {
+                        "reads": reads_name,
+                        "stage": "query",
+                        "klcp": klcp,
+                        "threads": threads,
+                        "wall_s": round(run["wall_s"], 3),
+                        "cpu_s": round(run["cpu_s"], 3),
+                        "peak_rss_kb": run["peak_rss_kb"],
+                        "reads_count": log["reads"],
+                        "kmers_count": log["kmers"],
+                        # rates of the matching itself, without loading
+                        "reads_per_s": round(log["rpm"] / 60.0, 1),
+                        "kmers_per_s": round(log["kpm"] / 60.0, 1),
+                        "stages": stages,
+                        "matching_stages": matching_stages,
+                        "log": log,
+                    }
+                )
+                print_record(records[-1], sys.stderr)
+
+                # the output does not depend on k-LCP, so the assignment is run only once
+                if klcp:
+                    command = [assign, "-f", "kraken", "-m", "h1", "-t", str(threads), tree_fn, str(k), query_fn]
+                    run = best_run(command, prefix + ".assignment.txt", repeats)
+                    records.append(
+                        {
+                            "reads": reads_name,
+                            "stage": "assignment",
+                            "klcp": None,
+                            "threads": threads,
+                            "wall_s": round(run["wall_s"], 3),
+                            "cpu_s": round(run["cpu_s"], 3),
+                            "peak_rss_kb": run["peak_rss_kb"],
+                            "reads_count": log["reads"],
+                            "kmers_count": log["kmers"],
+                            "reads_per_s": rate(log["reads"], run["wall_s"]),
+                            "kmers_per_s": rate(log["kmers"], run["wall_s"]),
+                        }
+                    )
+                    print_record(records[-1], sys.stderr)
+    return records
+
+
+def print_record(record, fo):
+    """Print a summary of a record as a line of a table."""
+    print(
+        "{reads}\t{stage}\tklcp={klcp}\tt={threads}\t{wall_s:.3f}s\t{peak_rss_kb} KB\t{reads_per_s} reads/s\t{kmers_per_s} k-mers/s".
+        format(**record), file=fo
+    )
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Benchmark prophyle_index query and prophyle_assignment.')
+
+    parser.add_argument(
+        'index_fa',
+        type=str,
+        metavar='<index.fa>',
+        help='index FASTA file (with BWT, SA and k-LCP)',
+    )
+
+    parser.add_argument(
+        'tree_fn',
+        type=str,
+        metavar='<tree.nw>',
+        help='tree of the index',
+    )
+
+    parser.add_argument(
+        'reads_fns',
+        type=str,
+        metavar='<reads.fq>',
+        nargs='+',
+        help='read files',
+    )
+
+    parser.add_argument(
+        '-k',
+        type=int,
+        metavar='int',
+        dest='k',
+        required=True,
+        help='k-mer length',
+    )
+
+    parser.add_argument(
+        '-t',
+        type=str,
+        metavar='str',
+        dest='threads',
+        default='1',
+        help='comma-separated numbers of threads [1]',
+    )
+
+    parser.add_argument(
+        '-r',
+        type=int,
+        metavar='int',
+        dest='repeats',
+        default=3,
+        help='repetitions of every run, the fastest one is reported [3]',
+    )
+
+    parser.add_argument(
+        '-o',
+        type=str,
+        metavar='str',
+        dest='out_fn',
+        default='-',
+        help='output JSON file [stdout]',
+    )
+
+    parser.add_argument(
+        '--ind',
+        type=str,
+        metavar='str',
+        dest='ind',
+        default=IND,
+        help='prophyle_index binary [{}]'.format(IND),
+    )
+
+    parser.add_argument(
+        '--assign',
+        type=str,
+        metavar='str',
+        dest='assign',
+        default=ASSIGN,
+        help='prophyle_assignment binary [{}]'.format(ASSIGN),
+    )
+
+    args = parser.parse_args()
+
+    threads_list = [int(x) for x in args.threads.split(",")]
+    out_dir = os.path.dirname(os.path.abspath(args.out_fn)) if args.out_fn != '-' else os.getcwd()
+
+    records = benchmark(
+        args.ind, args.assign, args.index_fa, args.tree_fn, args.k, args.reads_fns, threads_list, args.repeats, out_dir)
+
+    if args.out_fn == '-':
+        json.dump(records, sys.stdout, indent=4)
+        print()
+    else:
+        with open(args.out_fn, "w") as fo:
+            json.dump(records, fo, indent=4)
+
+
+if __name__ == "__main__":
+    main()
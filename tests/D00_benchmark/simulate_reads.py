@@ -0,0 +1,185 @@
+#! /usr/bin/env python3
+"""Simulate reads for benchmarking of k-mer matching.
+
+Reads are generated deterministically (for a given seed) and can be of three
+types:
+    * genomic: windows of reads from the source FASTQ file, consecutive
+      source reads are joined when the windows are longer than them
+    * random: uniformly random sequences (no matches except by chance)
+    * repeats: tandem repeats of short random units (many k-mers with large
+      SA intervals)
+
+Author: Karel Brinda <kbrinda@hsph.harvard.edu>
+
+Licence: MIT
+
+Example:
+
+    simulate_reads.py -t genomic -l 250 -n 10000 source.fq > reads.fq
+"""
+
+import argparse
+import random
+import sys
+
+NUCLS = "ACGT"
+
+
+def load_fastq_sequences(fq_fn):
+    """Load sequences of a FASTQ file.
+
+    Args:
+        fq_fn (str): FASTQ file name.
+
+    Returns:
+        list of str: Sequences.
+    """
+    seqs = []
+    with open(fq_fn) as f:
+        for i, line in enumerate(f):
+            if i % 4 == 1:
+                seqs.append(line.strip().upper())
+    return seqs
+
+
+def genomic_read(rng, source, length):
+    """Get a window of the concatenation of consecutive source reads.
+
+    Args:
+        rng (random.Random): Random number generator.
+        source (list of str): Source sequences.
+        length (int): Read length.
+
+    Returns:
+        str: Read sequence.
+    """
+    i = rng.randrange(len(source))
+    parts = []
+    parts_len = 0
+    while parts_len < length:
+        parts.append(source[i % len(source)])
+        parts_len += len(parts[-1])
+        i += 1
+    seq = "".join(parts)
+    start = rng.randrange(len(seq) - length + 1)
+    return seq[start:start + length]
+
+
+def random_read(rng, length):
+    return "".join(rng.choice(NUCLS) for _ in range(length))
+
+
+def repeats_read(rng, length, max_unit_length=6):
+    unit = random_read(rng, rng.randint(1, max_unit_length))
+    return (unit * (length // len(unit) + 1))[:length]
+
+
+def add_errors(rng, seq, error_rate):
+    """Add substitutions to a sequence.
+
+    Args:
+        rng (random.Random): Random number generator.
+        seq (str): Sequence.
+        error_rate (float): Probability of a substitution at every position.
+
+    Returns:
+        str: Sequence with substitutions.
+    """
+    seq = list(seq)
+    for i in range(len(seq)):
+        if rng.random() < error_rate:
+            seq[i] = rng.choice([x for x in NUCLS if x != seq[i]])
+    return "".join(seq)
+
+
+def simulate_reads(read_type, source_fn, reads_count, length, error_rate, seed, fo):
+    """Print simulated reads in FASTQ.
+
+    Args:
+        read_type (str): Type of reads (genomic / random / repeats).
+        source_fn (str): Source FASTQ file for genomic reads.
+        reads_count (int): Number of reads.
+        length (int): Read length.
+        error_rate (float): Probability of a substitution at every position.
+        seed (int): Seed of the random number generator.
+        fo (file): Output file.
+    """
+    rng = random.Random(seed)
+    if read_type == "genomic":
+        source = load_fastq_sequences(source_fn)
+        assert len(source) > 0, "No sequences in '{}'".format(source_fn)
+
+    qual = "I" * length
+    for i in range(reads_count):
+        if read_type == "genomic":
+            seq = genomic_read(rng, source, length)
+        elif read_type == "random":
+            seq = random_read(rng, length)
+        else:
+            seq = repeats_read(rng, length)
+        seq = add_errors(rng, seq, error_rate)
+        print("@{}_{}_{}".format(read_type, length, i + 1), seq, "+", qual, sep="\n", file=fo)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Simulate reads for benchmarking of k-mer matching.')
+
+    parser.add_argument(
+        'source_fn',
+        type=str,
+        metavar='<source.fq>',
+        help='FASTQ file with source reads for genomic reads',
+    )
+
+    parser.add_argument(
+        '-t',
+        type=str,
+        choices=['genomic', 'random', 'repeats'],
+        default='genomic',
+        dest='read_type',
+        help='type of reads [genomic]',
+    )
+
+    parser.add_argument(
+        '-n',
+        type=int,
+        default=10000,
+        metavar='int',
+        dest='reads_count',
+        help='number of reads [10000]',
+    )
+
+    parser.add_argument(
+        '-l',
+        type=int,
+        default=100,
+        metavar='int',
+        dest='length',
+        help='read length [100]',
+    )
+
+    parser.add_argument(
+        '-e',
+        type=float,
+        default=0.01,
+        metavar='float',
+        dest='error_rate',
+        help='substitution rate [0.01]',
+    )
+
+    parser.add_argument(
+        '-s',
+        type=int,
+        default=42,
+        metavar='int',
+        dest='seed',
+        help='seed of the random number generator [42]',
+    )
+
+    args = parser.parse_args()
+
+    simulate_reads(args.read_type, args.source_fn, args.reads_count, args.length, args.error_rate, args.seed, sys.stdout)
+
+
+if __name__ == "__main__":
+    main()